@@ -5,15 +5,23 @@
 // Copyright   :
 // Description :
 //----------------------------------------------------------------
+#include <iostream>
+#include <map>
 #include <set>
-#include <omp.h>
+#include <cstring>
 #include <getopt.h>
+#include <unistd.h>
 #include "vcf_file.h"
 #include "annovar_file.h"
 #include "vep_file.h"
 #include "bam_file.h"
-#include "progress_bar.h"
+#include "progress_reporter.h"
 #include "ssw.h"
+#include "task_runtime.h"
+#include "instrumentation.h"
+#include "pileup_kernels.h"
+#include "annotation_server.h"
+#include "result_cache.h"
 #include "annotate_bam_statistics.h"
 //----------------------------------------------------------------
 class Job
@@ -22,13 +30,36 @@ private:
 public:
 
     size_t fileIndex;
-    const char * chr;
-    map<hts_pos_t,vector<pair<hts_pos_t,VarEntry*> > >::iterator pos;
+    int contigID;
+    const VarEndpoint * begin;  //Endpoints at the job position
+    const VarEndpoint * end;
 
-    Job(size_t fileIndex,const char * chr,map<hts_pos_t,vector<pair<hts_pos_t,VarEntry*> > >::iterator pos) : fileIndex(fileIndex),chr(chr),pos(pos) {}
+    Job(size_t fileIndex,int contigID,const VarEndpoint * begin,const VarEndpoint * end) : fileIndex(fileIndex),contigID(contigID),begin(begin),end(end) {}
 };
 //----------------------------------------------------------------
-//class Read;
+class JobTrace  //Costs of one job for the trace file
+{
+private:
+public:
+
+    bool isSNVOnly;
+
+    uint64_t reads;
+    uint64_t fragments;
+    uint64_t references;
+    uint64_t alignments;
+    uint64_t bytesDecompressed;
+    uint64_t nanoseconds;
+
+    JobTrace(void) : isSNVOnly(true),reads(0),fragments(0),references(0),alignments(0),bytesDecompressed(0),nanoseconds(0) {}
+};
+//----------------------------------------------------------------
+#define TRACE_HISTOGRAM_BINS    48  //Log2 latency bins in microseconds
+//----------------------------------------------------------------
+#define DEEP_LOCUS_FRAGMENTS    512 //Align the reads of loci with at least this many fragments in subtasks
+#define FRAGMENTS_PER_TASK      64
+//----------------------------------------------------------------
+#define MAP_NODE_OVERHEAD       32  //Color, parent, left and right of a red black tree node
 //----------------------------------------------------------------
 class Thread
 {
@@ -50,9 +81,13 @@ private:
 
     const vector<string> & bamFileNames;
 
-    const map<string,FastaEntry> & fastaEntries;
-    const map<string,map<hts_pos_t,char[4]> > & vcfEntries;
-    map<string,map<hts_pos_t,vector<pair<hts_pos_t,VarEntry*> > > > & varEntries;
+    const vector<FastaEntry> & fastaEntries;
+    const vector<vector<KnownSNP> > & vcfEntries;
+    VariantStore & variants;
+    const vector<vector<int> > & contigTids;     //Bam target ID by file index and contig ID
+
+    TaskRuntime & runtime;
+    ProgressCounters & counters;
 
     BamFile bamFile;
 
@@ -61,8 +96,10 @@ private:
 
 public:
 
-    Thread(bool countDuplicates,bool countSecondary,uint8_t minHQBaseScore,uint8_t minHQAlignmentScore,hts_pos_t minMatchLength,hts_pos_t pileupTolerance,size_t nBamFiles,double minAlignmentRate,const vector<string> & bamFileNames,const map<string,FastaEntry> & fastaEntries,const map<string,map<hts_pos_t,char[4]> > & vcfEntries,map<string,map<hts_pos_t,vector<pair<hts_pos_t,VarEntry*> > > > & varEntries)
-        : countDuplicates(countDuplicates),countSecondary(countSecondary),minHQBaseScore(minHQBaseScore),minHQAlignmentScore(minHQAlignmentScore),minMatchLength(minMatchLength),pileupTolerance(pileupTolerance),nBamFiles(nBamFiles),minAlignmentRate(minAlignmentRate),bamFileNames(bamFileNames),fastaEntries(fastaEntries),vcfEntries(vcfEntries),varEntries(varEntries) {}
+    Thread(bool countDuplicates,bool countSecondary,uint8_t minHQBaseScore,uint8_t minHQAlignmentScore,hts_pos_t minMatchLength,hts_pos_t pileupTolerance,size_t nBamFiles,double minAlignmentRate,const vector<string> & bamFileNames,const vector<FastaEntry> & fastaEntries,const vector<vector<KnownSNP> > & vcfEntries,VariantStore & variants,const vector<vector<int> > & contigTids,TaskRuntime & runtime,ProgressCounters & counters)
+        : countDuplicates(countDuplicates),countSecondary(countSecondary),minHQBaseScore(minHQBaseScore),minHQAlignmentScore(minHQAlignmentScore),minMatchLength(minMatchLength),pileupTolerance(pileupTolerance),nBamFiles(nBamFiles),minAlignmentRate(minAlignmentRate),bamFileNames(bamFileNames),fastaEntries(fastaEntries),vcfEntries(vcfEntries),variants(variants),contigTids(contigTids),runtime(runtime),counters(counters) {}
+
+    JobTrace trace;     //Costs of the last job
 
     void RunJob(Job & job);
 };
@@ -73,15 +110,15 @@ void Thread::ProcessSNP(Job & job)
     //Get fasta sequence and vcf entries by chromosome
     //----------------------------------------------------------------
 
-    const char * fastaSeq=fastaEntries.at(job.chr).seq;
-    const map<hts_pos_t,char[4]> * vcfEntriesByChr=vcfEntries.count(job.chr)!=0 ? &vcfEntries.at(job.chr) : nullptr;
+    const FastaEntry & fastaEntry=fastaEntries[size_t(job.contigID)];
+    const vector<KnownSNP> * vcfEntriesByChr=size_t(job.contigID)<vcfEntries.size() && vcfEntries[size_t(job.contigID)].empty()==false ? &vcfEntries[size_t(job.contigID)] : nullptr;
 
     //----------------------------------------------------------------
     //Set pileup position SNP
     //----------------------------------------------------------------
 
-    hts_pos_t snpPos=job.pos->first;
-    bamFile.SetRegion(job.chr,snpPos,1);
+    hts_pos_t snpPos=job.begin->pos;
+    bamFile.SetRegion(contigTids[job.fileIndex][size_t(job.contigID)],snpPos,1);
 
     //----------------------------------------------------------------
     //Read class SNP
@@ -109,12 +146,14 @@ void Thread::ProcessSNP(Job & job)
     //Iterate over reads and gather fragments
     //----------------------------------------------------------------
 
-    map<string,Read[2]> fragments;
+    FragmentMap<Read[2]> fragments;
 
-    static const char bamSeq2ASCII[]="NACNGNNNTNNNNNNN";
+    uint64_t nReads=0;
 
     bam1_t * read=bam_init1(); while(bamFile.ReadRegion(read)>=0)
     {
+        nReads++;
+
         hts_pos_t refPos=read->core.pos;
         size_t queryPos=0;
 
@@ -151,24 +190,17 @@ void Thread::ProcessSNP(Job & job)
 
                 matchLength+=opLen;
 
-                uint8_t * bamSeq=bam_get_seq(read);
+                uint8_t * bamSeq=bam_get_seq(read); FastaCursor fastaCursor(fastaEntry,refPos);
 
-                for(size_t i=refPos,iEnd=refPos+opLen,j=queryPos;i<iEnd;i++,j++)
-                {
-                    if(vcfEntriesByChr==nullptr || vcfEntriesByChr->count(i)==0)
-                    {
-                        nMismatches+=fastaSeq[i]!=bamSeq2ASCII[bam_seqi(bamSeq,j)];
-                        continue;
-                    }
+                const KnownSNP * vcfEntry=nullptr,* vcfEntryEnd=nullptr;    //Known SNPs from refPos on
+                if(vcfEntriesByChr!=nullptr) {vcfEntry=VCFFile::LowerBound(*vcfEntriesByChr,refPos); vcfEntryEnd=vcfEntriesByChr->data()+vcfEntriesByChr->size();}
 
-                    auto vcfBases=vcfEntriesByChr->at(i); char bamBase=bamSeq2ASCII[bam_seqi(bamSeq,j)];
-                    nMismatches+=vcfBases[0]!=bamBase && vcfBases[1]!=bamBase && vcfBases[2]!=bamBase && vcfBases[3]!=bamBase;
-                }
+                nMismatches+=CountMismatches(bamSeq,queryPos,fastaCursor,refPos,opLen,vcfEntry,vcfEntryEnd);
 
                 if(refPos<=snpPos && snpPos<refPos+opLen)
                 {
                     queryPos+=snpPos-refPos;
-                    base=bamSeq2ASCII[bam_seqi(bamSeq,queryPos)]; baseScore=bam_get_qual(read)[queryPos];
+                    base=bamSeq2Base[bam_seqi(bamSeq,queryPos)]; baseScore=bam_get_qual(read)[queryPos];
                 }
 
                 refPos+=opLen;
@@ -185,15 +217,17 @@ void Thread::ProcessSNP(Job & job)
     }
 
     bam_destroy1(read);
+    counters.AddReads(nReads); trace.reads=nReads;
 
     //----------------------------------------------------------------
     //Compute statistics
     //----------------------------------------------------------------
 
-    auto & entries=job.pos->second;
+    PhaseTimer countTimer(PHASE_COUNT);
+
     size_t fileIndex=job.fileIndex;
-    size_t nFragments=fragments.size();
-    for(auto & entry : entries) entry.second->statistics[fileIndex].totalDepth=nFragments;
+    size_t nFragments=fragments.size(); trace.fragments=nFragments;
+    for(auto entry=job.begin;entry<job.end;entry++) variants.GetStatistics(entry->var)[fileIndex].totalDepth=nFragments;
 
     for(auto & fragment : fragments)
     {
@@ -208,13 +242,13 @@ void Thread::ProcessSNP(Job & job)
                 bool rvReadIsHQ=rvRead.alignmentScore>=minHQAlignmentScore && rvRead.baseScore>=minHQBaseScore;
                 bool fragmentIsHQ=fwReadIsHQ || rvReadIsHQ;
 
-                for(auto & entry : entries)
+                for(auto entry=job.begin;entry<job.end;entry++)
                 {
-                    auto varEntry=entry.second;
-                    bool fwReadIsAlt=fwRead.base==varEntry->alt[0];
-                    bool rvReadIsAlt=rvRead.base==varEntry->alt[0];
+                    char alt=variants.Alt(entry->var)[0];
+                    bool fwReadIsAlt=fwRead.base==alt;
+                    bool rvReadIsAlt=rvRead.base==alt;
 
-                    auto & statistics=varEntry->statistics[fileIndex];
+                    auto & statistics=variants.GetStatistics(entry->var)[fileIndex];
                     statistics.hqDepth+=fragmentIsHQ;
                     statistics.altBias[0]+=fwReadIsAlt;
                     statistics.altBias[1]+=rvReadIsAlt;
@@ -232,12 +266,11 @@ void Thread::ProcessSNP(Job & job)
                 continue;
             }
 
-            for(auto & entry : entries)
+            for(auto entry=job.begin;entry<job.end;entry++)
             {
-                auto varEntry=entry.second;
-                bool fwReadIsAlt=fragment.second[0].base==varEntry->alt[0];
+                bool fwReadIsAlt=fragment.second[0].base==variants.Alt(entry->var)[0];
 
-                auto & statistics=varEntry->statistics[fileIndex];
+                auto & statistics=variants.GetStatistics(entry->var)[fileIndex];
                 statistics.hqDepth+=fwReadIsHQ;
                 statistics.altBias[0]+=fwReadIsAlt;
                 statistics.hqAltBias[0]+=fwReadIsHQ&&fwReadIsAlt;
@@ -252,12 +285,11 @@ void Thread::ProcessSNP(Job & job)
 
         bool rvReadIsHQ=fragment.second[1].alignmentScore>=minHQAlignmentScore && fragment.second[1].baseScore>=minHQBaseScore;
 
-        for(auto & entry : entries)
+        for(auto entry=job.begin;entry<job.end;entry++)
         {
-            auto varEntry=entry.second;
-            bool rvReadIsAlt=fragment.second[1].base==varEntry->alt[0];
+            bool rvReadIsAlt=fragment.second[1].base==variants.Alt(entry->var)[0];
 
-            auto & statistics=varEntry->statistics[fileIndex];
+            auto & statistics=variants.GetStatistics(entry->var)[fileIndex];
             statistics.hqDepth+=rvReadIsHQ;
             statistics.altBias[1]+=rvReadIsAlt;
             statistics.hqAltBias[1]+=rvReadIsHQ&&rvReadIsAlt;
@@ -275,14 +307,14 @@ void Thread::ProcessIndel(Job & job)
     //Calculate and set pileup regions
     //----------------------------------------------------------------
 
-    hts_pos_t jobPos1=job.pos->first; hts_pos_t jobPos2=0;
+    hts_pos_t jobPos1=job.begin->pos; hts_pos_t jobPos2=0;
 
-    auto fastaEntry=fastaEntries.at(job.chr); hts_pos_t fastaEntryEnd=fastaEntry.len-1;
+    const FastaEntry & fastaEntry=fastaEntries[size_t(job.contigID)]; hts_pos_t fastaEntryEnd=fastaEntry.len-1;
     {
         map<hts_pos_t,hts_pos_t> intervals;
 
         intervals[max(jobPos1-pileupTolerance,0L)]=min(jobPos1+pileupTolerance,fastaEntryEnd);
-        for(auto  entry : job.pos->second) {hts_pos_t pos2=entry.first; jobPos2=max(jobPos2,pos2); intervals[max(pos2-pileupTolerance,0L)]=min(pos2+pileupTolerance,fastaEntryEnd);}
+        for(auto entry=job.begin;entry<job.end;entry++) {hts_pos_t pos2=entry->other; jobPos2=max(jobPos2,pos2); intervals[max(pos2-pileupTolerance,0L)]=min(pos2+pileupTolerance,fastaEntryEnd);}
 
         vector<pair<hts_pos_t,hts_pos_t> > mergedIntervals; mergedIntervals.reserve(16);
 
@@ -303,18 +335,9 @@ void Thread::ProcessIndel(Job & job)
 
         mergedIntervals.emplace_back(intervalBegin,intervalEnd);
 
-        size_t nRegions=mergedIntervals.size(); char ** regions=(char**)malloc(nRegions*sizeof(char*));
-
-        char region[1024]; const char * chr=job.chr;
+        for(auto & interval : mergedIntervals) interval.first=max(interval.first-1,0L);  //Same regions as the former "chr:begin-end" region strings
 
-        for(size_t i=0;i<nRegions;i++)
-        {
-            regions[i]=strcpy((char*)malloc(sprintf(region,"%s:%li-%li",chr,mergedIntervals[i].first,mergedIntervals[i].second)+1),region);
-        }
-
-        bamFile.SetRegions(nRegions,regions);
-
-        for(size_t i=0;i<nRegions;i++) {free(regions[i]);} free(regions);
+        bamFile.SetRegions(contigTids[job.fileIndex][size_t(job.contigID)],mergedIntervals);
     }
 
     //----------------------------------------------------------------
@@ -328,9 +351,9 @@ void Thread::ProcessIndel(Job & job)
 
         bool inJobSet;
         SSW ssw;
-        VarEntry * varEntry;
+        Statistics * statistics;    //Statistics of the variant by file index (Local to the job unless in the job set)
 
-        Reference(bool inJobSet,const string & refSeq,VarEntry * varEntry) : inJobSet(inJobSet),ssw(refSeq),varEntry(varEntry) {}
+        Reference(bool inJobSet,const string & refSeq,Statistics * statistics) : inJobSet(inJobSet),ssw(refSeq),statistics(statistics) {}
     };
 
     class Read
@@ -347,58 +370,21 @@ void Thread::ProcessIndel(Job & job)
         hts_pos_t begin,end;
         char * query;
 
+        Reference * maxRef;
+
         Read(void) : query(nullptr) {}
         ~Read(void) {if(query!=nullptr) free(query);}
 
         void Init(const bam1_t * bamRead,uint8_t minHQAlignmentScore,uint8_t minHQBaseScore,hts_pos_t & readBegin,hts_pos_t & readEnd)
         {
-            isHQ=bamRead->core.qual>=minHQAlignmentScore;
+            PhaseTimer timer(PHASE_READ_INIT);
 
-            readBegin=readEnd=bamRead->core.pos;
-
-            for(uint32_t *cigarBegin=bam_get_cigar(bamRead),*cigarEnd=cigarBegin+bamRead->core.n_cigar-1,*cigar=cigarBegin;cigar<=cigarEnd;cigar++)
-            {
-                hts_pos_t opLen=hts_pos_t(bam_cigar_oplen(*cigar));
-
-                switch(bam_cigar_op(*cigar))
-                {
-                case BAM_CSOFT_CLIP:
-
-                    if(cigar==cigarBegin) {readBegin-=opLen; continue;}
-                    if(cigar==cigarEnd) readEnd+=opLen;
-                    continue;
-
-                case BAM_CDEL:
-                case BAM_CREF_SKIP:
-                case BAM_CMATCH:
-                case BAM_CEQUAL:
-                case BAM_CDIFF:
-
-                    readEnd+=opLen;
-                    continue;
-                }
-            }
-
-            readEnd--;
-
-            static const char bamSeq2ASCII[][2]={ {'n','N'},{'a','A'},{'c','C'},{'n','N'},{'g','G'},{'n','N'},{'n','N'},{'n','N'},{'t','T'},{'n','N'},{'n','N'},{'n','N'},{'n','N'},{'n','N'},{'n','N'},{'n','N'} };
-
-            maxPosScore=0;
-
-            begin=readBegin; end=readEnd;
-
-            size_t queryLen=size_t(bamRead->core.l_qseq); uint8_t * seq=bam_get_seq(bamRead); uint8_t * qual=bam_get_qual(bamRead); uint8_t * qualEnd=qual+(queryLen&~1UL); char * pQuery=query=(char*)malloc((queryLen+1)*sizeof(char));
-
-            for(;qual<qualEnd;seq++,qual+=2,pQuery+=2)
-            {
-                uint8_t packedBases=seq[0]; size_t isHQ;
-                isHQ=size_t(qual[0]>=minHQBaseScore); maxPosScore+=1+isHQ; pQuery[0]=bamSeq2ASCII[size_t(packedBases>>4)][isHQ];
-                isHQ=size_t(qual[1]>=minHQBaseScore); maxPosScore+=1+isHQ; pQuery[1]=bamSeq2ASCII[size_t(packedBases&15)][isHQ];
-            }
+            isHQ=bamRead->core.qual>=minHQAlignmentScore;
 
-            if(queryLen&1){ size_t isHQ=size_t(qual[0]>=minHQBaseScore); maxPosScore+=1+isHQ; pQuery[0]=bamSeq2ASCII[size_t(seq[0]>>4)][isHQ]; }
+            ReadSpan(bamRead,readBegin,readEnd); begin=readBegin; end=readEnd;
 
-            query[queryLen]='\0';
+            query=(char*)malloc((size_t(bamRead->core.l_qseq)+1)*sizeof(char));
+            maxPosScore=EncodeQuery(bamRead,minHQBaseScore,query);
         }
     };
 
@@ -419,14 +405,14 @@ void Thread::ProcessIndel(Job & job)
     public:
 
         Read reads[2];
-        map<VarEntry*,Score> scores;
+        map<Statistics*,Score> scores;
 
         void CountUnknown(size_t fileIndex)
         {
             for(auto itScore=scores.begin(),scoresEnd=scores.end();itScore!=scoresEnd;itScore++)
             {
                 if(itScore->second.inJobSet==false) continue;
-                auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.unknown++;
+                auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.unknown++;
             }
         }
 
@@ -437,11 +423,10 @@ void Thread::ProcessIndel(Job & job)
             for(auto itScore=scores.begin(),scoresEnd=scores.end();itScore!=scoresEnd;itScore++)
             {
                 if(itScore->second.inJobSet==false) continue;
-                auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
+                auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
             }
 
-            if(maxRef->inJobSet==false) return;
-            auto & statistics=maxRef->varEntry->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[strand]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[strand]+=isHQ;
+            auto & statistics=maxRef->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[strand]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[strand]+=isHQ;
         }
 
         void CountFragment(size_t fileIndex,Reference * maxRef)
@@ -451,22 +436,21 @@ void Thread::ProcessIndel(Job & job)
             for(auto itScore=scores.begin(),scoresEnd=scores.end();itScore!=scoresEnd;itScore++)
             {
                 if(itScore->second.inJobSet==false) continue;
-                auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
+                auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
             }
 
-            if(maxRef->inJobSet==false) return;
-            auto & statistics=maxRef->varEntry->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[0]++; statistics.altBias[1]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[0]+=isHQ; statistics.hqAltBias[1]+=isHQ;
+            auto & statistics=maxRef->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[0]++; statistics.altBias[1]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[0]+=isHQ; statistics.hqAltBias[1]+=isHQ;
         }
 
         uint32_t CountAmbigousRead(size_t fileIndex,size_t strand)
         {
-            int maxScore=0; size_t nMaxScore=0; map<VarEntry*,Score>::iterator itMaxScore;
+            int maxScore=0; size_t nMaxScore=0; map<Statistics*,Score>::iterator itMaxScore;
 
             auto scoresEnd=scores.end(); for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
             {
                 int score=itScore->second.reads[strand];
                 if(score>maxScore){ maxScore=score; nMaxScore=0;}
-                if(score==maxScore && itScore->first->statistics[fileIndex].altDepth>0 && ++nMaxScore==1) itMaxScore=itScore;
+                if(score==maxScore && itScore->first[fileIndex].altDepth>0 && ++nMaxScore==1) itMaxScore=itScore;
             }
 
             if(nMaxScore!=1)
@@ -474,7 +458,7 @@ void Thread::ProcessIndel(Job & job)
                 for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
                 {
                     if(itScore->second.inJobSet==false) continue;
-                    auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.ambiguous+=itScore->second.reads[strand]==maxScore;
+                    auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.ambiguous+=itScore->second.reads[strand]==maxScore;
                 }
                 return 0U;
             }
@@ -484,16 +468,16 @@ void Thread::ProcessIndel(Job & job)
             for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
             {
                 if(itScore->second.inJobSet==false) continue;
-                auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
+                auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
             }
 
-            if(itMaxScore->second.inJobSet==true){ auto & statistics=itMaxScore->first->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[strand]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[strand]+=isHQ; }
+            auto & statistics=itMaxScore->first[fileIndex]; statistics.altDepth++; statistics.altBias[strand]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[strand]+=isHQ;
             return 1U;
         }
 
         uint32_t CountAmbigousFragment(size_t fileIndex)
         {
-            int fwMaxScore=0,rvMaxScore=0; size_t fwNMaxScore=0,rvNMaxScore=0; map<VarEntry*,Score>::iterator fwITMaxScore,rvITMaxScore;
+            int fwMaxScore=0,rvMaxScore=0; size_t fwNMaxScore=0,rvNMaxScore=0; map<Statistics*,Score>::iterator fwITMaxScore,rvITMaxScore;
 
             auto scoresEnd=scores.end(); for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
             {
@@ -501,7 +485,7 @@ void Thread::ProcessIndel(Job & job)
                 if(fwScore>fwMaxScore){ fwMaxScore=fwScore; fwNMaxScore=0;}
                 if(rvScore>rvMaxScore){ rvMaxScore=rvScore; rvNMaxScore=0;}
 
-                if(itScore->first->statistics[fileIndex].altDepth>0)
+                if(itScore->first[fileIndex].altDepth>0)
                 {
                     if(fwScore==fwMaxScore && ++fwNMaxScore==1) fwITMaxScore=itScore;
                     if(rvScore==rvMaxScore && ++rvNMaxScore==1) rvITMaxScore=itScore;
@@ -517,7 +501,7 @@ void Thread::ProcessIndel(Job & job)
                     for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
                     {
                         if(itScore->second.inJobSet==false) continue;
-                        auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; auto reads=itScore->second.reads; statistics.ambiguous+=reads[0]==fwMaxScore || reads[1]==rvMaxScore;
+                        auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; auto reads=itScore->second.reads; statistics.ambiguous+=reads[0]==fwMaxScore || reads[1]==rvMaxScore;
                     }
 
                     return 0U;
@@ -526,10 +510,10 @@ void Thread::ProcessIndel(Job & job)
                 for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
                 {
                     if(itScore->second.inJobSet==false) continue;
-                    auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
+                    auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
                 }
 
-                if(rvITMaxScore->second.inJobSet==true){ auto & statistics=rvITMaxScore->first->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[1]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[1]+=isHQ; }
+                auto & statistics=rvITMaxScore->first[fileIndex]; statistics.altDepth++; statistics.altBias[1]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[1]+=isHQ;
                 return 1U;
             }
 
@@ -538,10 +522,10 @@ void Thread::ProcessIndel(Job & job)
                 for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
                 {
                     if(itScore->second.inJobSet==false) continue;
-                    auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
+                    auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
                 }
 
-                if(fwITMaxScore->second.inJobSet==true){ auto & statistics=fwITMaxScore->first->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[0]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[0]+=isHQ; }
+                auto & statistics=fwITMaxScore->first[fileIndex]; statistics.altDepth++; statistics.altBias[0]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[0]+=isHQ;
                 return 1U;
             }
 
@@ -550,7 +534,7 @@ void Thread::ProcessIndel(Job & job)
                 for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
                 {
                     if(itScore->second.inJobSet==false) continue;
-                    auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; auto reads=itScore->second.reads; statistics.ambiguous+=reads[0]==fwMaxScore || reads[1]==rvMaxScore;
+                    auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; auto reads=itScore->second.reads; statistics.ambiguous+=reads[0]==fwMaxScore || reads[1]==rvMaxScore;
                 }
                 return 0U;
             }
@@ -558,25 +542,29 @@ void Thread::ProcessIndel(Job & job)
             for(auto itScore=scores.begin();itScore!=scoresEnd;itScore++)
             {
                 if(itScore->second.inJobSet==false) continue;
-                auto & statistics=itScore->first->statistics[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
+                auto & statistics=itScore->first[fileIndex]; statistics.totalDepth++; statistics.hqDepth+=isHQ;
             }
 
-            if(fwITMaxScore->second.inJobSet==true){auto & statistics=fwITMaxScore->first->statistics[fileIndex]; statistics.altDepth++; statistics.altBias[0]++; statistics.altBias[1]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[0]+=isHQ; statistics.hqAltBias[1]+=isHQ;}
+            auto & statistics=fwITMaxScore->first[fileIndex]; statistics.altDepth++; statistics.altBias[0]++; statistics.altBias[1]++; statistics.hqAltDepth+=isHQ; statistics.hqAltBias[0]+=isHQ; statistics.hqAltBias[1]+=isHQ;
             return 1U;
         }
     };
 
-    map<string,Fragment> fragments;
+    FragmentMap<Fragment> fragments;
     vector<pair<hts_pos_t,hts_pos_t> > refIntervals; refIntervals.reserve(16);
     {
-        bam1_t * bamRead=bam_init1();
+        bam1_t * bamRead=bam_init1(); uint64_t nReads=0;
 
         if(bamFile.ReadRegion(bamRead)>=0)
         {
+            nReads++;
+
             hts_pos_t intervalBegin,intervalEnd; fragments[bam_get_qname(bamRead)].reads[bam_is_rev(bamRead)].Init(bamRead,minHQAlignmentScore,minHQBaseScore,intervalBegin,intervalEnd);
 
             while(bamFile.ReadRegion(bamRead)>=0)
             {
+                nReads++;
+
                 hts_pos_t bamReadBegin,bamReadEnd; fragments[bam_get_qname(bamRead)].reads[bam_is_rev(bamRead)].Init(bamRead,minHQAlignmentScore,minHQBaseScore,bamReadBegin,bamReadEnd);
 
                 if(bamReadBegin<=intervalEnd+1)
@@ -592,10 +580,10 @@ void Thread::ProcessIndel(Job & job)
             refIntervals.emplace_back(intervalBegin,intervalEnd);
         }
 
-        bam_destroy1(bamRead);
+        bam_destroy1(bamRead); counters.AddReads(nReads); trace.reads=nReads;
     }
 
-    if(fragments.size()==0) return;
+    trace.fragments=fragments.size(); if(fragments.size()==0) return;
 
     size_t nRefIntervals=refIntervals.size();
 
@@ -604,6 +592,8 @@ void Thread::ProcessIndel(Job & job)
     //----------------------------------------------------------------
 
     vector<Reference> allReferences; allReferences.reserve(1024);
+    vector<Statistics> refStatistics(nRefIntervals*nBamFiles);   //Discarded statistics of the reference sequences
+    map<size_t,vector<Statistics> > neighbourStatistics;         //Discarded statistics of the variants outside the job (Ties are broken on the reads of this job only, never on the live counts of other jobs)
     multimap<hts_pos_t,Reference*> references;  //References by position
     {
         for(size_t i=0;i<nRefIntervals;i++)
@@ -611,11 +601,11 @@ void Thread::ProcessIndel(Job & job)
             hts_pos_t intervalBegin=refIntervals[i].first;
             hts_pos_t intervalEnd=refIntervals[i].second;
 
-            string refSeq(fastaEntry.seq+intervalBegin,1+intervalEnd-intervalBegin);
-            allReferences.emplace_back(true,refSeq,new VarEntry(nBamFiles));
+            string refSeq(fastaEntry.Sequence(intervalBegin,1+intervalEnd-intervalBegin));
+            allReferences.emplace_back(true,refSeq,&refStatistics[i*nBamFiles]);
         }
 
-        set<VarEntry*> jobSet; for(auto entry : job.pos->second) if(jobPos1<=entry.first) jobSet.insert(entry.second);   //Jobset contains only the in job variants in normal orientation
+        set<uint32_t> jobSet; for(auto entry=job.begin;entry<job.end;entry++) if(jobPos1<=entry->other) jobSet.insert(entry->var);   //Jobset contains only the in job variants in normal orientation
 
         for(size_t i=0;i<nRefIntervals;i++)
         {
@@ -626,190 +616,227 @@ void Thread::ProcessIndel(Job & job)
             //Iterate over variants in the interval
             //----------------------------------------------------------------
 
-            auto & varEntriesByChr=varEntries.at(job.chr);
+            const auto & endpoints=variants.endpoints[size_t(job.contigID)];
 
-            for(auto var=varEntriesByChr.lower_bound(intervalBegin),varEnd=varEntriesByChr.upper_bound(intervalEnd);var!=varEnd;var++)
+            for(auto entry=VariantStore::LowerBound(endpoints,intervalBegin),entryEnd=VariantStore::UpperBound(endpoints,intervalEnd);entry<entryEnd;entry++)
             {
-                hts_pos_t pos1=var->first;
-
-                for(auto & entry : var->second)
-                {
-                    hts_pos_t pos2=entry.first;
+                hts_pos_t pos1=entry->pos; hts_pos_t pos2=entry->other;
 
-                    auto varEntry=entry.second;
+                size_t var=entry->var; bool inJobSet=jobSet.count(entry->var)==1; if(i>0 && inJobSet==true) continue;
 
-                    bool inJobSet=jobSet.count(varEntry)==1; if(i>0 && inJobSet==true) continue;
+                Statistics * statistics=inJobSet ? variants.GetStatistics(var) : neighbourStatistics.try_emplace(var,nBamFiles).first->second.data();
 
-                    hts_pos_t refSize=hts_pos_t(varEntry->ref.size()); string alt(varEntry->alt); hts_pos_t altSize=hts_pos_t(alt.size());
+                hts_pos_t refSize=hts_pos_t(variants.refLengths[var]); string alt(variants.Alt(var)); hts_pos_t altSize=hts_pos_t(alt.size());
 
-                    //----------------------------------------------------------------
-                    //Variant is SNV
-                    //----------------------------------------------------------------
+                //----------------------------------------------------------------
+                //Variant is SNV
+                //----------------------------------------------------------------
 
-                    if(varEntry->varType==SNV)
-                    {
-                        if(references.count(pos1)==0) references.emplace(pos1,&allReferences[i]);
+                if(variants.Type(var)==SNV)
+                {
+                    if(references.count(pos1)==0) references.emplace(pos1,&allReferences[i]);
 
-                        string altSeq(fastaEntry.seq+intervalBegin,1+intervalEnd-intervalBegin); altSeq[pos1-intervalBegin]=alt[0];
-                        references.emplace(pos1,&allReferences.emplace_back(inJobSet,altSeq,varEntry));
+                    string altSeq(fastaEntry.Sequence(intervalBegin,1+intervalEnd-intervalBegin)); altSeq[pos1-intervalBegin]=alt[0];
+                    references.emplace(pos1,&allReferences.emplace_back(inJobSet,altSeq,statistics));
 
-                        continue;
-                    }
+                    continue;
+                }
 
-                    //----------------------------------------------------------------
-                    //Variant is multibase substitution or deletion
-                    //----------------------------------------------------------------
+                //----------------------------------------------------------------
+                //Variant is multibase substitution or deletion
+                //----------------------------------------------------------------
 
-                    if(varEntry->varType==DEL)
+                if(variants.Type(var)==DEL)
+                {
+                    if(pos1<pos2)
                     {
-                        if(pos1<pos2)
-                        {
-                            if(pos1==intervalEnd) continue; //Deletion has no effect
-
-                            auto pReference=&allReferences[i];
-                            if(references.count(pos1)==0) references.emplace(pos1,pReference);
-                            if(references.count(pos2)==0) references.emplace(pos2,pReference);
-
-                            hts_pos_t padBegin=min(pos1,intervalBegin)-max(min(pos2-1,jobPos1-1)-max(pos1,intervalBegin)+1L-altSize,0L);
-                            hts_pos_t padEnd=max(pos2-1,intervalEnd)+max(min(pos2-1,intervalEnd)-max(pos1,jobPos2)+1L-hts_pos_t(pos1>=jobPos2)*altSize,0L);
-
-                            string altSeq(fastaEntry.seq+padBegin,1+padEnd-padBegin); altSeq.replace(pos1-padBegin,refSize,alt);
-                            pReference=&allReferences.emplace_back(inJobSet,altSeq,varEntry);
-                            references.emplace(pos1,pReference); references.emplace(pos2,pReference);
-
-                            continue;
-                        }
-
-                        if(pos1==intervalBegin || pos2>=intervalBegin) continue;    //Deletion has no effect or already in reference set
+                        if(pos1==intervalEnd) continue; //Deletion has no effect
 
                         auto pReference=&allReferences[i];
                         if(references.count(pos1)==0) references.emplace(pos1,pReference);
                         if(references.count(pos2)==0) references.emplace(pos2,pReference);
 
-                        hts_pos_t padBegin=pos2-max(min(pos1-1,jobPos1-1)-intervalBegin+1L-altSize,0L);
-                        hts_pos_t padEnd=max(pos1-1,intervalEnd)+max(min(pos1-1,intervalEnd)-max(pos2,jobPos2)+1L-hts_pos_t(pos1>=jobPos2)*altSize,0L);
+                        hts_pos_t padBegin=min(pos1,intervalBegin)-max(min(pos2-1,jobPos1-1)-max(pos1,intervalBegin)+1L-altSize,0L);
+                        hts_pos_t padEnd=max(pos2-1,intervalEnd)+max(min(pos2-1,intervalEnd)-max(pos1,jobPos2)+1L-hts_pos_t(pos1>=jobPos2)*altSize,0L);
 
-                        string altSeq(fastaEntry.seq+padBegin,1+padEnd-padBegin); altSeq.replace(pos1-padBegin,refSize,alt);
-                        pReference=&allReferences.emplace_back(inJobSet,altSeq,varEntry);
+                        string altSeq(fastaEntry.Sequence(padBegin,1+padEnd-padBegin)); altSeq.replace(pos1-padBegin,refSize,alt);
+                        pReference=&allReferences.emplace_back(inJobSet,altSeq,statistics);
                         references.emplace(pos1,pReference); references.emplace(pos2,pReference);
 
                         continue;
                     }
 
-                    //----------------------------------------------------------------
-                    //Variant is insertion or tandem duplication
-                    //----------------------------------------------------------------
+                    if(pos1==intervalBegin || pos2>=intervalBegin) continue;    //Deletion has no effect or already in reference set
 
-                    if(pos1<pos2)
-                    {
-                        if(pos1==intervalEnd) continue; //Insertion has no effect
+                    auto pReference=&allReferences[i];
+                    if(references.count(pos1)==0) references.emplace(pos1,pReference);
+                    if(references.count(pos2)==0) references.emplace(pos2,pReference);
 
-                        auto pReference=&allReferences[i];
-                        if(references.count(pos1)==0) references.emplace(pos1,pReference);
-                        if(references.count(pos2)==0) references.emplace(pos2,pReference);
+                    hts_pos_t padBegin=pos2-max(min(pos1-1,jobPos1-1)-intervalBegin+1L-altSize,0L);
+                    hts_pos_t padEnd=max(pos1-1,intervalEnd)+max(min(pos1-1,intervalEnd)-max(pos2,jobPos2)+1L-hts_pos_t(pos1>=jobPos2)*altSize,0L);
 
-                        string altSeq(fastaEntry.seq+intervalBegin,1+intervalEnd-intervalBegin); altSeq.replace(pos1-intervalBegin,refSize,alt);
-                        pReference=&allReferences.emplace_back(inJobSet,altSeq,varEntry);
-                        references.emplace(pos1,pReference); references.emplace(pos2,pReference);
+                    string altSeq(fastaEntry.Sequence(padBegin,1+padEnd-padBegin)); altSeq.replace(pos1-padBegin,refSize,alt);
+                    pReference=&allReferences.emplace_back(inJobSet,altSeq,statistics);
+                    references.emplace(pos1,pReference); references.emplace(pos2,pReference);
 
-                        continue;
-                    }
+                    continue;
+                }
+
+                //----------------------------------------------------------------
+                //Variant is insertion or tandem duplication
+                //----------------------------------------------------------------
+
+                if(pos1<pos2)
+                {
+                    if(pos1==intervalEnd) continue; //Insertion has no effect
+
+                    auto pReference=&allReferences[i];
+                    if(references.count(pos1)==0) references.emplace(pos1,pReference);
+                    if(references.count(pos2)==0) references.emplace(pos2,pReference);
+
+                    string altSeq(fastaEntry.Sequence(intervalBegin,1+intervalEnd-intervalBegin)); altSeq.replace(pos1-intervalBegin,refSize,alt);
+                    pReference=&allReferences.emplace_back(inJobSet,altSeq,statistics);
+                    references.emplace(pos1,pReference); references.emplace(pos2,pReference);
+
+                    continue;
                 }
             }
         }
     }
 
     //----------------------------------------------------------------
-    //Align and count first pass
+    //Align reads against the references (Deep loci are split in subtasks)
     //----------------------------------------------------------------
 
-    uint32_t assigned=0;
+    vector<Fragment*> fragmentList; fragmentList.reserve(fragments.size());
+    for(auto & fragment : fragments) fragmentList.push_back(&fragment.second);
 
-    auto fragmentsEnd=fragments.end();
+    double minAlignmentRate=this->minAlignmentRate;
 
-    for(auto itFragment=fragments.begin();itFragment!=fragmentsEnd;itFragment++)
-    {
-        Reference *fwMaxRef=nullptr,*rvMaxRef=nullptr;
+    ProgressCounters & counters=this->counters; atomic<uint64_t> jobAlignments(0);
 
-        auto & fragment=itFragment->second;
-        auto & fwRead=fragment.reads[0]; auto & rvRead=fragment.reads[1];
+    trace.references=allReferences.size();
 
-        if(fwRead.query!=nullptr)
+    function<void(size_t,size_t,size_t)> alignFragments=[&fragmentList,&references,&counters,&jobAlignments,minAlignmentRate](size_t begin,size_t end,size_t)
+    {
+        uint64_t nAlignments=0;
+
+        for(size_t i=begin;i<end;i++)
         {
-            int maxScore=0; size_t nMaxScore=0;
+            auto & fragment=*fragmentList[i];
 
-            for(auto itReference=references.lower_bound(fwRead.begin),referencesEnd=references.upper_bound(fwRead.end);itReference!=referencesEnd;itReference++)
+            for(size_t strand=0;strand<2;strand++)
             {
-                auto reference=itReference->second; auto & scorePair=fragment.scores[reference->varEntry]; auto & score=scorePair.reads[0]; if(score!=0) continue;
+                auto & read=fragment.reads[strand]; if(read.query==nullptr) continue;
 
-                scorePair.inJobSet=reference->inJobSet;
-                score=reference->ssw.Align(fwRead.query);
+                int maxScore=0; size_t nMaxScore=0; read.maxRef=nullptr;
 
-                if(score==maxScore) {nMaxScore++; continue;}
-                if(score>maxScore) {fwMaxRef=reference; maxScore=score; nMaxScore=1;}
-            }
+                for(auto itReference=references.lower_bound(read.begin),referencesEnd=references.upper_bound(read.end);itReference!=referencesEnd;itReference++)
+                {
+                    auto reference=itReference->second; auto & scorePair=fragment.scores[reference->statistics]; auto & score=scorePair.reads[strand]; if(score!=0) continue;
 
-            fwRead.isUnknown=double(maxScore)/double(fwRead.maxPosScore)<minAlignmentRate;
-            fwRead.isAmbiguous=nMaxScore>1;
+                    scorePair.inJobSet=reference->inJobSet;
+                    score=reference->ssw.Align(read.query); nAlignments++;
 
-            if(rvRead.query==nullptr)
-            {
-                if(fwRead.isUnknown) {fragment.CountUnknown(job.fileIndex); continue;}
-                if(fwRead.isAmbiguous) continue;
-                fragment.CountRead(job.fileIndex,fwMaxRef,0); assigned++; continue;
+                    if(score==maxScore) {nMaxScore++; continue;}
+                    if(score>maxScore) {read.maxRef=reference; maxScore=score; nMaxScore=1;}
+                }
+
+                read.isUnknown=double(maxScore)/double(read.maxPosScore)<minAlignmentRate;
+                read.isAmbiguous=nMaxScore>1;
             }
         }
 
-        int maxScore=0; size_t nMaxScore=0;
+        counters.AddAlignments(nAlignments); jobAlignments.fetch_add(nAlignments,memory_order_relaxed);
+    };
 
-        for(auto itReference=references.lower_bound(rvRead.begin),referencesEnd=references.upper_bound(rvRead.end);itReference!=referencesEnd;itReference++)
-        {
-            auto reference=itReference->second; auto & scorePair=fragment.scores[reference->varEntry]; auto & score=scorePair.reads[1]; if(score!=0) continue;
+    size_t nFragments=fragmentList.size();
+
+    if(nFragments>=DEEP_LOCUS_FRAGMENTS)
+    {
+        TaskGroup alignments; runtime.ForRange(alignments,0,nFragments,FRAGMENTS_PER_TASK,alignFragments); runtime.Wait(alignments);
+    }
+    else alignFragments(0,nFragments,0);
+
+    trace.alignments=jobAlignments.load();
 
-            scorePair.inJobSet=reference->inJobSet;
-            score=reference->ssw.Align(rvRead.query);
+    //----------------------------------------------------------------
+    //Estimate the state of the job while it is largest (Summed over the threads running indel jobs)
+    //----------------------------------------------------------------
 
-            if(score==maxScore) {nMaxScore++; continue;}
-            if(score>maxScore) {rvMaxRef=reference; maxScore=score; nMaxScore=1;}
+    MemoryCharge indelMemory(MEMORY_INDEL_STATE);
+
+    if(Instrumentation::Instance().IsMemoryEnabled())
+    {
+        size_t size=allReferences.capacity()*sizeof(Reference)+references.size()*(MAP_NODE_OVERHEAD+sizeof(pair<hts_pos_t,Reference*>))+fragmentList.capacity()*sizeof(Fragment*);
+
+        for(const auto & reference : allReferences) size+=reference.ssw.MemoryUsage();
+
+        for(const auto & fragment : fragments)
+        {
+            size+=MAP_NODE_OVERHEAD+sizeof(fragment)+fragment.first.size()+fragment.second.scores.size()*(MAP_NODE_OVERHEAD+sizeof(pair<Statistics*,Score>));
+            for(const auto & read : fragment.second.reads) if(read.query!=nullptr) size+=size_t(read.end-read.begin+2);     //Query is about as long as the span
         }
 
-        rvRead.isUnknown=double(maxScore)/double(rvRead.maxPosScore)<minAlignmentRate;
-        rvRead.isAmbiguous=nMaxScore>1;
+        indelMemory.Add(size);
+    }
+
+    //----------------------------------------------------------------
+    //Count first pass
+    //----------------------------------------------------------------
+
+    PhaseTimer countTimer(PHASE_COUNT);
+
+    uint32_t assigned=0;
+
+    auto fragmentsEnd=fragments.end();
+
+    for(auto itFragment=fragments.begin();itFragment!=fragmentsEnd;itFragment++)
+    {
+        auto & fragment=itFragment->second;
+        auto & fwRead=fragment.reads[0]; auto & rvRead=fragment.reads[1];
+
+        if(fwRead.query!=nullptr && rvRead.query==nullptr)
+        {
+            if(fwRead.isUnknown) {fragment.CountUnknown(job.fileIndex); continue;}
+            if(fwRead.isAmbiguous) continue;
+            fragment.CountRead(job.fileIndex,fwRead.maxRef,0); assigned++; continue;
+        }
 
         if(fwRead.query==nullptr)
         {
             if(rvRead.isUnknown) {fragment.CountUnknown(job.fileIndex); continue;}
             if(rvRead.isAmbiguous) continue;
-            fragment.CountRead(job.fileIndex,rvMaxRef,1); assigned++; continue;
+            fragment.CountRead(job.fileIndex,rvRead.maxRef,1); assigned++; continue;
         }
 
         if(rvRead.isUnknown)
         {
             if(fwRead.isUnknown) {fragment.CountUnknown(job.fileIndex); continue;}
             if(fwRead.isAmbiguous) continue;
-            fragment.CountRead(job.fileIndex,fwMaxRef,0); assigned++; continue;
+            fragment.CountRead(job.fileIndex,fwRead.maxRef,0); assigned++; continue;
         }
 
         if(fwRead.isUnknown)
         {
             if(rvRead.isAmbiguous) continue;
-            fragment.CountRead(job.fileIndex,rvMaxRef,1); assigned++; continue;
+            fragment.CountRead(job.fileIndex,rvRead.maxRef,1); assigned++; continue;
         }
 
         if(rvRead.isAmbiguous)
         {
             if(fwRead.isAmbiguous) continue;
-            fragment.CountRead(job.fileIndex,fwMaxRef,0); assigned++; continue;
+            fragment.CountRead(job.fileIndex,fwRead.maxRef,0); assigned++; continue;
         }
 
         if(fwRead.isAmbiguous)
         {
-            fragment.CountRead(job.fileIndex,rvMaxRef,1); assigned++; continue;
+            fragment.CountRead(job.fileIndex,rvRead.maxRef,1); assigned++; continue;
         }
 
-        if(fwMaxRef->varEntry!=rvMaxRef->varEntry) continue;
+        if(fwRead.maxRef->statistics!=rvRead.maxRef->statistics) continue;
 
-        fragment.CountFragment(job.fileIndex,fwMaxRef); assigned++;
+        fragment.CountFragment(job.fileIndex,fwRead.maxRef); assigned++;
     }
 
     //----------------------------------------------------------------
@@ -856,13 +883,13 @@ void Thread::ProcessIndel(Job & job)
     //Reestimate ITD/PTD VAF
     //----------------------------------------------------------------
 
-    for(auto entry=job.pos->second.begin(),entryEnd=job.pos->second.end();entry!=entryEnd;entry++)
+    for(auto entry=job.begin;entry<job.end;entry++)
     {
-        auto varEntry=entry->second; auto varType=varEntry->varType;
+        auto varType=variants.Type(entry->var);
 
         if(varType!=ITD && varType!=PTD) continue;
 
-        auto & statistics=varEntry->statistics[job.fileIndex];
+        auto & statistics=variants.GetStatistics(entry->var)[job.fileIndex];
 
         double MUTi=double(statistics.altDepth);
         double nonMUTi=max(0.0,0.5*double(statistics.ambiguous)-MUTi);
@@ -872,12 +899,6 @@ void Thread::ProcessIndel(Job & job)
         statistics.coeITD=nonMUTi/(nonMUTi+fAssigned-MUTi);
     }
 
-    //----------------------------------------------------------------
-    //Clean up ref intervals
-    //----------------------------------------------------------------
-
-    for(size_t i=0;i<nRefIntervals;i++) delete allReferences[i].varEntry;
-
     //----------------------------------------------------------------
     //Done
     //----------------------------------------------------------------
@@ -897,11 +918,13 @@ void Thread::RunJob(Job & job)
 
     bool isSNVOnly=true;
 
-    for(auto & entry : job.pos->second)
+    for(auto entry=job.begin;entry<job.end;entry++)
     {
-        if(entry.second->varType!=SNV) isSNVOnly=false;
+        if(variants.Type(entry->var)!=SNV) isSNVOnly=false;
     }
 
+    trace=JobTrace(); trace.isSNVOnly=isSNVOnly;
+
     //----------------------------------------------------------------
     //Variant is SNV
     //----------------------------------------------------------------
@@ -919,6 +942,8 @@ void Thread::RunJob(Job & job)
 #define VCF_FILE                        'V'
 #define ANNOVAR_FILE                    'a'
 #define VEP_FILE                        'e'
+#define OUTPUT_FILE                     'o'
+#define BINARY_FILE                     'B'
 #define BAM_FILES                       'b'
 #define MIN_MATCH_LENGTH                'm'
 #define PILEUP_TOLERANCE                'T'
@@ -928,9 +953,18 @@ void Thread::RunJob(Job & job)
 #define THREADS                         't'
 #define COUNT_DUPLICATES                'd'
 #define COUNT_SECONDARY                 'u'
+#define BLOCK_CACHE_SIZE                'c'
+#define PACKED_REFERENCE                'P'
+#define MAX_READ_SPAN                   'R'
+#define INSTRUMENTATION_FILE            'I'
+#define TRACE_FILE                      'L'
+#define DAEMON_SOCKET                   'D'
+#define CONNECT_SOCKET                  'C'
+#define RESULT_CACHE                    'K'
+#define BATCH_SIZE                      'N'
 #define VERBOSE                         'v'
 #define HELP                            'h'
-#define SHORT_OPTIONS                   "f:V:a:e:b:m:T:s:S:r:t:duvh"
+#define SHORT_OPTIONS                   "f:V:a:e:o:B:b:m:T:s:S:r:t:c:PR:I:L:D:C:K:N:duvh"
 //----------------------------------------------------------------
 struct option longOptions[] =
 {
@@ -938,6 +972,8 @@ struct option longOptions[] =
     {"vcf-file",required_argument,nullptr,VCF_FILE},
     {"annovar-file",required_argument,nullptr,ANNOVAR_FILE},
     {"vep-file",required_argument,nullptr,VEP_FILE},
+    {"output-file",required_argument,nullptr,OUTPUT_FILE},
+    {"binary-file",required_argument,nullptr,BINARY_FILE},
     {"bam-files",required_argument,nullptr,BAM_FILES},
     {"min-match-length",required_argument,nullptr,MIN_MATCH_LENGTH},
     {"pileup-tolerance",required_argument,nullptr,PILEUP_TOLERANCE},
@@ -945,6 +981,15 @@ struct option longOptions[] =
     {"min-hq-alignment-score",required_argument,nullptr,MIN_HQ_ALIGNMENT_SCORE},
     {"min-alignment-rate",required_argument,nullptr,MIN_ALIGNMENT_RATE},
     {"threads",required_argument,nullptr,THREADS},
+    {"block-cache-size",required_argument,nullptr,BLOCK_CACHE_SIZE},
+    {"packed-reference",no_argument,nullptr,PACKED_REFERENCE},
+    {"max-read-span",required_argument,nullptr,MAX_READ_SPAN},
+    {"instrumentation-file",required_argument,nullptr,INSTRUMENTATION_FILE},
+    {"trace-file",required_argument,nullptr,TRACE_FILE},
+    {"daemon-socket",required_argument,nullptr,DAEMON_SOCKET},
+    {"connect-socket",required_argument,nullptr,CONNECT_SOCKET},
+    {"result-cache",required_argument,nullptr,RESULT_CACHE},
+    {"batch-size",required_argument,nullptr,BATCH_SIZE},
     {"count-duplicates",no_argument,nullptr,COUNT_DUPLICATES},
     {"count-secondary",no_argument,nullptr,COUNT_SECONDARY},
     {"verbose",no_argument,nullptr,VERBOSE},
@@ -957,6 +1002,219 @@ void AnnotateBamStatistics::Tokenize(char * s,const char * d,vector<string> & v)
     v.clear(); for(char * t=strsep(&s,d);t!=nullptr;t=strsep(&s,d)) v.push_back(t);
 }
 //----------------------------------------------------------------
+vector<string> AnnotateBamStatistics::AbsoluteArguments(const vector<string> & arguments)  //File names of the options resolved against the working directory (A server runs its requests in the directory of the client)
+{
+    char * rawDirectory=getcwd(nullptr,0); if(rawDirectory==nullptr) throw runtime_error("Error: Could not get the working directory");
+    string directory(rawDirectory); free(rawDirectory);
+
+    auto absolute=[&directory](const string & filename){return filename.empty() || filename[0]=='/' ? filename : directory+'/'+filename;};
+
+    //----------------------------------------------------------------
+    //Parse a copy with the same options and rewrite the argument each file name was taken from (Attached as in -fx or --fasta-file=x or on its own)
+    //----------------------------------------------------------------
+
+    vector<string> result(arguments),buffers(arguments);
+
+    vector<char*> argv; for(auto & buffer : buffers) argv.push_back(&buffer[0]);
+    argv.push_back(nullptr);
+
+    int option,optionIndex,errors=opterr; opterr=0; optind=0;
+
+    while((option=getopt_long(int(argv.size()-1),argv.data(),SHORT_OPTIONS,longOptions,&optionIndex))>=0)
+    {
+        if(strchr("fVaeoBbILK",option)==nullptr || optarg==nullptr) continue;
+
+        size_t i=0; while(i<buffers.size() && (optarg<buffers[i].data() || optarg>buffers[i].data()+buffers[i].size())) i++;     //getopt reorders the pointers, not the strings
+        if(i==buffers.size()) continue;
+
+        vector<string> filenames; if(option==BAM_FILES) Tokenize(optarg,",",filenames); else filenames.emplace_back(optarg);
+
+        string value; for(size_t j=0;j<filenames.size();j++) value+=(j>0 ? "," : "")+absolute(filenames[j]);
+        result[i]=arguments[i].substr(0,size_t(optarg-buffers[i].data()))+value;
+    }
+
+    opterr=errors; optind=0;
+
+    return result;
+}
+//----------------------------------------------------------------
+void AnnotateBamStatistics::PrintBlockCacheStatistics(void)
+{
+    const BGZFBlockCache & blockCache=BGZFBlockCache::Instance();
+
+    uint64_t hits=blockCache.GetHits(); uint64_t misses=blockCache.GetMisses();
+    cerr << "Info: Block cache hits: " << hits << '/' << hits+misses << " (" << (100.0*double(hits))/double(max(hits+misses,uint64_t(1))) << "%), decompressed: " << (blockCache.GetBytesDecompressed()>>20) << "MB" << endl;
+}
+//----------------------------------------------------------------
+void AnnotateBamStatistics::CreateRuns(const vector<Job> & jobs,size_t nThreads,vector<pair<size_t,size_t> > & runs)
+{
+    //----------------------------------------------------------------
+    //Split the jobs in contiguous runs of loci on the same bam file and chromosome so neighbouring loci reuse the same bgzf blocks
+    //----------------------------------------------------------------
+
+    size_t nJobs=jobs.size(); size_t maxRunLength=max(size_t(1),min(size_t(256),nJobs/(nThreads*32)));
+
+    runs.clear();
+
+    for(size_t runBegin=0,i=1;i<=nJobs;i++)
+    {
+        if(i<nJobs && i-runBegin<maxRunLength && jobs[i].fileIndex==jobs[runBegin].fileIndex && jobs[i].contigID==jobs[runBegin].contigID) continue;
+        runs.emplace_back(runBegin,i); runBegin=i;
+    }
+}
+//----------------------------------------------------------------
+void AnnotateBamStatistics::CreateVCFRegions(const VariantFile & variantFile,hts_pos_t maxReadSpan,vector<vector<pair<hts_pos_t,hts_pos_t> > > & regions)
+{
+    //----------------------------------------------------------------
+    //Known SNPs are only used for reads that cover an SNV so merge the windows of maxReadSpan around every SNV
+    //----------------------------------------------------------------
+
+    const VariantStore & variants=variantFile.variants; size_t nContigs=variants.endpoints.size();
+
+    regions.assign(nContigs,vector<pair<hts_pos_t,hts_pos_t> >());
+
+    for(size_t contigID=0;contigID<nContigs;contigID++)
+    {
+        auto & contigRegions=regions[contigID];
+
+        for(const auto & endpoint : variants.endpoints[contigID])
+        {
+            if(variants.Type(endpoint.var)!=SNV) continue;
+
+            hts_pos_t begin=max(endpoint.pos-maxReadSpan,0L); hts_pos_t end=endpoint.pos+maxReadSpan;
+
+            if(contigRegions.empty()==false && begin<=contigRegions.back().second+1) contigRegions.back().second=max(contigRegions.back().second,end);
+            else contigRegions.emplace_back(begin,end);
+        }
+    }
+}
+//----------------------------------------------------------------
+void AnnotateBamStatistics::WriteTrace(const string & filename,const vector<Job> & jobs,const vector<JobTrace> & traces,const VariantFile & variantFile,const vector<string> & bamFilenames)
+{
+    //----------------------------------------------------------------
+    //One row per job in job order
+    //----------------------------------------------------------------
+
+    FILE * file=fopen(filename.c_str(),"w");
+    if(file==nullptr) throw runtime_error(string("Error: Could not open trace file: ")+filename);
+
+    fprintf(file,"chrom\tpos\tbam_index\tbam_file\tvar_types\treads\tfragments\treferences\talignments\tbytes_decompressed\twall_us\n");
+
+    uint64_t histograms[2][TRACE_HISTOGRAM_BINS]={};   //SNV only and indel jobs by floor(log2(wall_us))+1 (Bin 0 is below 1us)
+
+    for(size_t j=0,nJobs=jobs.size();j<nJobs;j++)
+    {
+        const Job & job=jobs[j]; const JobTrace & trace=traces[j];
+
+        bool hasType[5]={}; for(auto entry=job.begin;entry<job.end;entry++) hasType[variantFile.variants.Type(entry->var)]=true;
+        string varTypes; for(size_t type=0;type<5;type++) if(hasType[type]){if(varTypes.empty()==false) varTypes+=','; varTypes+=varStrings[type];}
+
+        uint64_t micros=trace.nanoseconds/1000; size_t bin=0; for(uint64_t value=micros;value>0 && bin+1<TRACE_HISTOGRAM_BINS;value>>=1) bin++;
+        histograms[trace.isSNVOnly ? 0 : 1][bin]++;
+
+        fprintf(file,"%s\t%ld\t%lu\t%s\t%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%.3f\n",variantFile.contigNames[size_t(job.contigID)].c_str(),long(job.begin->pos+1),job.fileIndex,bamFilenames[job.fileIndex].c_str(),varTypes.c_str(),
+                trace.reads,trace.fragments,trace.references,trace.alignments,trace.bytesDecompressed,double(trace.nanoseconds)*1e-3);
+    }
+
+    if(fclose(file)!=0) throw runtime_error(string("Error: Could not write trace file: ")+filename);
+
+    //----------------------------------------------------------------
+    //Log2 latency histograms of SNV only and indel jobs
+    //----------------------------------------------------------------
+
+    string histogramFilename=filename+string(".histogram.tsv");
+
+    file=fopen(histogramFilename.c_str(),"w");
+    if(file==nullptr) throw runtime_error(string("Error: Could not open trace histogram file: ")+histogramFilename);
+
+    fprintf(file,"job_class\tmin_us\tmax_us\tjobs\n");
+
+    static const char * jobClasses[2]={"snv_only","indel"};
+
+    for(size_t jobClass=0;jobClass<2;jobClass++)
+    {
+        size_t nBins=TRACE_HISTOGRAM_BINS; while(nBins>0 && histograms[jobClass][nBins-1]==0) nBins--;
+        for(size_t bin=0;bin<nBins;bin++) fprintf(file,"%s\t%lu\t%lu\t%lu\n",jobClasses[jobClass],bin==0 ? 0UL : 1UL<<(bin-1),1UL<<bin,histograms[jobClass][bin]);
+    }
+
+    if(fclose(file)!=0) throw runtime_error(string("Error: Could not write trace histogram file: ")+histogramFilename);
+}
+//----------------------------------------------------------------
+void AnnotateBamStatistics::MapContigs(const vector<string> & bamFilenames,const FastaFile & fastaFile,const VariantFile & variantFile,vector<vector<int> > & contigTids)
+{
+    size_t nBamFiles=bamFilenames.size(); size_t nContigs=fastaFile.entries.size();
+
+    contigTids.assign(nBamFiles,vector<int>(nContigs,-1));
+
+    for(size_t fileIndex=0;fileIndex<nBamFiles;fileIndex++)
+    {
+        BamFile bamFile(bamFilenames[fileIndex]);
+
+        for(size_t contigID=0;contigID<nContigs;contigID++)
+        {
+            int tid=contigTids[fileIndex][contigID]=bamFile.GetTid(fastaFile.names[contigID]);
+
+            if(variantFile.variants.endpoints[contigID].empty()) continue;
+
+            if(tid<0) throw runtime_error(string("Error: Contig with variants is missing in bam file: ")+fastaFile.names[contigID]+string(" ")+bamFilenames[fileIndex]);
+            if(bamFile.GetTargetLen(tid)!=fastaFile.entries[contigID].len) throw runtime_error(string("Error: Contig length in bam and fasta file must agree: ")+fastaFile.names[contigID]+string(" ")+bamFilenames[fileIndex]);
+        }
+    }
+}
+//----------------------------------------------------------------
+void AnnotateBamStatistics::CreateResultKeys(const vector<Job> & jobs,const VariantStore & variants,const vector<vector<KnownSNP> > & knownSNPs,const FastaFile & fastaFile,const vector<ResultKey> & fileKeys,const ResultKey & parameters,hts_pos_t pileupTolerance,hts_pos_t maxReadSpan,vector<ResultKey> & keys)
+{
+    //----------------------------------------------------------------
+    //A key holds all the statistics of a job depend on: the parameters, the bam file, the locus with its variants and whatever the reads around
+    //the locus can reach (Other variants for indels, known SNPs for SNVs). Without a maximum read span that is everything on the contig.
+    //----------------------------------------------------------------
+
+    auto addVariant=[&variants](ResultKeyHasher & hasher,const VarEndpoint & entry){hasher.Add(entry.pos); hasher.Add(entry.other); hasher.Add(variants.varTypes[entry.var]); hasher.AddText(variants.Ref(entry.var)); hasher.AddText(variants.Alt(entry.var));};
+    auto addKnownSNP=[](ResultKeyHasher & hasher,const KnownSNP & snp){hasher.Add(snp.pos); hasher.Add(snp.alleles);};
+
+    size_t nContigs=variants.endpoints.size(); vector<ResultKey> contigVariants(nContigs),contigSNPs(nContigs);
+
+    for(size_t contigID=0;maxReadSpan==0 && contigID<nContigs;contigID++)
+    {
+        ResultKeyHasher variantHasher; for(const auto & entry : variants.endpoints[contigID]) addVariant(variantHasher,entry);
+        ResultKeyHasher snpHasher; if(contigID<knownSNPs.size()) for(const auto & snp : knownSNPs[contigID]) addKnownSNP(snpHasher,snp);
+
+        contigVariants[contigID]=variantHasher.Key(); contigSNPs[contigID]=snpHasher.Key();
+    }
+
+    keys.resize(jobs.size());
+
+    for(size_t i=0,nJobs=jobs.size();i<nJobs;i++)
+    {
+        const Job & job=jobs[i]; size_t contigID=size_t(job.contigID);
+
+        ResultKeyHasher hasher; hasher.Add(parameters); hasher.Add(fileKeys[job.fileIndex]); hasher.AddText(fastaFile.names[contigID]);
+
+        bool isSNVOnly=true; hts_pos_t begin=job.begin->pos,end=job.begin->pos;
+
+        for(auto entry=job.begin;entry<job.end;entry++)
+        {
+            if(variants.Type(entry->var)!=SNV) isSNVOnly=false;
+            begin=min(begin,entry->other); end=max(end,entry->other); addVariant(hasher,*entry);
+        }
+
+        if(isSNVOnly)
+        {
+            if(maxReadSpan==0) hasher.Add(contigSNPs[contigID]);
+            else if(contigID<knownSNPs.size()) for(auto snp=VCFFile::LowerBound(knownSNPs[contigID],begin-maxReadSpan),snpEnd=knownSNPs[contigID].data()+knownSNPs[contigID].size();snp<snpEnd && snp->pos<=end+maxReadSpan;snp++) addKnownSNP(hasher,*snp);
+        }
+        else
+        {
+            const auto & endpoints=variants.endpoints[contigID];
+
+            if(maxReadSpan==0) hasher.Add(contigVariants[contigID]);
+            else for(auto entry=VariantStore::LowerBound(endpoints,begin-pileupTolerance-maxReadSpan),entryEnd=VariantStore::UpperBound(endpoints,end+pileupTolerance+maxReadSpan);entry<entryEnd;entry++) addVariant(hasher,*entry);
+        }
+
+        keys[i]=hasher.Key();
+    }
+}
+//----------------------------------------------------------------
 int AnnotateBamStatistics::Run(int argc,char * argv[])
 {
     try
@@ -968,21 +1226,27 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
         bool showHelp=(argc==1);
         int option,optionIndex;
 
+        vector<string> arguments(argv,argv+argc);   //Before getopt reorders and the bam file list is split in place
+
         bool verbose=true;
         bool countDuplicates=false;
         bool countSecondary=false;
+        bool packedReference=false;
 
         uint8_t minHQBaseScore=30;
         uint8_t minHQAlignmentScore=40;
 
         int nThreads=1;
+        size_t blockCacheSize=256;
+        size_t batchSize=0;
 
         hts_pos_t minMatchLength=15;
         hts_pos_t pileupTolerance=5;
+        hts_pos_t maxReadSpan=0;
 
         double minAlignmentRate=0.90;
 
-        string fastaFilename,vcfFilename,annovarFilename,vepFilename;
+        string fastaFilename,vcfFilename,annovarFilename,vepFilename,outputFilename,binaryFilename,instrumentationFilename,traceFilename,daemonSocket,connectSocket,resultCacheFilename;
         vector<string> bamFilenames;
 
         verbose=false;
@@ -995,6 +1259,8 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
             case VCF_FILE: vcfFilename=string(optarg); break;
             case ANNOVAR_FILE: annovarFilename=string(optarg); break;
             case VEP_FILE: vepFilename=string(optarg); break;
+            case OUTPUT_FILE: outputFilename=string(optarg); break;
+            case BINARY_FILE: binaryFilename=string(optarg); break;
             case BAM_FILES: Tokenize(optarg,",",bamFilenames); break;
             case MIN_MATCH_LENGTH: minMatchLength=atoll(optarg); break;
             case PILEUP_TOLERANCE: pileupTolerance=atoll(optarg); break;
@@ -1002,6 +1268,15 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
             case MIN_HQ_ALIGNMENT_SCORE: minHQAlignmentScore=atoi(optarg); break;
             case MIN_ALIGNMENT_RATE: minAlignmentRate=atof(optarg); break;
             case THREADS: nThreads=atoi(optarg); break;
+            case BLOCK_CACHE_SIZE: blockCacheSize=size_t(max(atoll(optarg),0LL)); break;
+            case PACKED_REFERENCE: packedReference=true; break;
+            case MAX_READ_SPAN: maxReadSpan=atoll(optarg); break;
+            case INSTRUMENTATION_FILE: instrumentationFilename=string(optarg); break;
+            case TRACE_FILE: traceFilename=string(optarg); break;
+            case DAEMON_SOCKET: daemonSocket=string(optarg); break;
+            case CONNECT_SOCKET: connectSocket=string(optarg); break;
+            case RESULT_CACHE: resultCacheFilename=string(optarg); break;
+            case BATCH_SIZE: batchSize=size_t(max(atoll(optarg),0LL)); break;
             case COUNT_DUPLICATES: countDuplicates=true; break;
             case COUNT_SECONDARY: countSecondary=true; break;
             case VERBOSE: verbose=true; break;
@@ -1021,12 +1296,14 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
 
         if(showHelp)
         {
-            cerr << "enhanced_ABS v2.0 [options] > output.txt (output always to std::out)"                                                              << endl;
+            cerr << "enhanced_ABS v2.0 [options] > output.txt (output to std::out unless an output file is given)"                                      << endl;
             cerr                                                                                                                                        << endl;
             cerr << "-f --fasta-file <text>             Single fasta file(required)"                                                                    << endl;
             cerr << "-V --vcf-file <text>               Single vcf file (optional)"                                                                     << endl;
             cerr << "-a --annovar-file <text>           Single annovar file (required either annovar-file or vep-file)"                                 << endl;
             cerr << "-e --vep-file <text>               Single VEP file (required either annovar-file or vep-file)"                                     << endl;
+            cerr << "-o --output-file <text>            Output file, bgzf compressed with tabix index if named *.gz (optional default=std::out)"        << endl;
+            cerr << "-B --binary-file <text>            Also write the raw counters as a memory mappable binary columnar file (optional)"               << endl;
             cerr << "-b --bam-files <text>              One or more bam files (required)"                                                               << endl;
             cerr << "-m --min-match-length <int>        Minimum match length (optional default=15)"                                                     << endl;
             cerr << "-T --pileup-tolerance <int>        Pileup tolerance number of extra bases around the variant position (optional default=5)"        << endl;
@@ -1034,6 +1311,15 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
             cerr << "-S --min-hq-alignment-score <int>  Minimum alignment score for filtered statistics (optional,default=40)"                          << endl;
             cerr << "-r --min-alignment-rate <float>    Minimum Smith-Waterman alignment rate (optional,default=0.95)"                                  << endl;
             cerr << "-t --threads <int>                 Number of threads to use (optional default=1)"                                                  << endl;
+            cerr << "-c --block-cache-size <int>        Size of the shared cache of decompressed bam blocks in MB (optional default=256)"               << endl;
+            cerr << "-P --packed-reference <void>       If specified cache the reference with two bits per base (optional default=false)"               << endl;
+            cerr << "-R --max-read-span <int>           Only load known SNPs within this distance of SNVs via the vcf index (optional default=0 all)"   << endl;
+            cerr << "-I --instrumentation-file <text>   Write timings per phase and thread and memory use as JSON to this file (optional)"              << endl;
+            cerr << "-L --trace-file <text>             Write one cost row per job and latency histograms to <text>.histogram.tsv (optional)"           << endl;
+            cerr << "-D --daemon-socket <text>          Serve requests on this Unix socket with warm reference, indexes and caches (optional)"          << endl;
+            cerr << "-C --connect-socket <text>         Send the other arguments as a request to the server on this socket (optional)"                  << endl;
+            cerr << "-K --result-cache <text>           Reuse statistics of unchanged loci and bam files from this shared cache file (optional)"        << endl;
+            cerr << "-N --batch-size <int>              Bam files per batch, each batch is spilled to TMPDIR (optional default=0 all)"                  << endl;
             cerr << "-d --count-duplicates <void>       If specified duplicates fragments are used in the statistics (optional default=false)"          << endl;
             cerr << "-u --count-secondary <void>        If specified secondary fragments are used in the statistics (optional default=false)"           << endl;
             cerr << "-v --verbose <void>                If specified be verbose (optional default=false)"                                               << endl;
@@ -1042,6 +1328,19 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
             return 0;
         }
 
+        //----------------------------------------------------------------
+        //Serve requests or send this one to a server (A server runs the requests it receives through this function again)
+        //----------------------------------------------------------------
+
+        AnnotationServer & server=AnnotationServer::Instance();
+
+        if(server.IsServing()) outputFilename=server.GetOutputFilename(outputFilename);
+        else
+        {
+            if(connectSocket.empty()==false) return AnnotationServer::Request(connectSocket,arguments,outputFilename);
+            if(daemonSocket.empty()==false) return server.Serve(daemonSocket,AbsoluteArguments(arguments),fastaFilename,packedReference,size_t(max(nThreads,1)));
+        }
+
         //----------------------------------------------------------------
         //Check input arguments
         //----------------------------------------------------------------
@@ -1061,36 +1360,166 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
 
         if(minMatchLength<10) minMatchLength=10;
         if(pileupTolerance<0) pileupTolerance=0;
+        if(maxReadSpan<0) maxReadSpan=0;
         if(nThreads<1) nThreads=1;
+        if(batchSize==0 || batchSize>nBamFiles) batchSize=nBamFiles;
+
+        bool spilling=batchSize<nBamFiles;   //Cohort mode
+
+        if(spilling && traceFilename.empty()==false)
+            throw runtime_error("Error: A trace file can not be combined with a batch size! (-h for help)");
+
+        const char * tempDirectory=getenv("TMPDIR"); string spillDirectory=(tempDirectory!=nullptr && tempDirectory[0]!='\0') ? tempDirectory : "/tmp";
 
         minAlignmentRate=min(max(minAlignmentRate,0.2),1.0);
 
+        BGZFBlockCache::Instance().SetMaxSize(blockCacheSize<<20);
+
+        TaskRuntime runtime(nThreads);
+
+        //----------------------------------------------------------------
+        //Enable instrumentation if requested (The summary is written when Run returns, also after errors, then reset for the next request of a server)
+        //----------------------------------------------------------------
+
+        class InstrumentationReport
+        {
+        private:
+
+            const string & filename;
+
+        public:
+
+            InstrumentationReport(const string & filename) : filename(filename)
+            {
+                Instrumentation::Instance().Reset();
+                if(filename.empty()==false) Instrumentation::Instance().Enable();
+            }
+
+            ~InstrumentationReport(void)
+            {
+                if(filename.empty()==false) try{Instrumentation::Instance().WriteJSON(filename);} catch(const runtime_error & error){cerr << error.what() << endl;}
+                Instrumentation::Instance().Reset();
+            }
+        };
+
+        InstrumentationReport instrumentationReport(instrumentationFilename);
+
+        //----------------------------------------------------------------
+        //Account memory per subsystem and sample the RSS at every phase boundary if verbose or instrumented
+        //----------------------------------------------------------------
+
+        Instrumentation & instrumentation=Instrumentation::Instance();
+
+        if(verbose || instrumentationFilename.empty()==false) instrumentation.EnableMemory();
+        instrumentation.SampleMemory("start",verbose);
+
+        //----------------------------------------------------------------
+        //Open output file (Before any work is done so an unwritable path fails early)
+        //----------------------------------------------------------------
+
+        OutputFile outputFile(outputFilename,size_t(nThreads));
+
         //----------------------------------------------------------------
         //Open fasta file
         //----------------------------------------------------------------
 
         if(verbose) cerr << "Info: Open fasta file" << endl;
-        FastaFile fastaFile(fastaFilename);
+
+        unique_ptr<FastaFile> ownFastaFile;
+        if(server.IsServing()==false) ownFastaFile.reset(new FastaFile(fastaFilename,packedReference,size_t(nThreads)));
+        FastaFile & fastaFile=server.IsServing() ? server.GetFastaFile(fastaFilename,packedReference,size_t(nThreads)) : *ownFastaFile;
+
+        instrumentation.SetMemory(MEMORY_REFERENCE,fastaFile.MemoryUsage()); instrumentation.SampleMemory("fasta",verbose);
 
         //----------------------------------------------------------------
-        //Open vcf file if specified
+        //Open annovar or VEP file
+        //----------------------------------------------------------------
+
+        PhaseTimer parseTimer(PHASE_PARSE);
+
+        unique_ptr<VariantFile> variantFile;
+
+        if(annovarFilename.empty()==false)
+        {
+            if(verbose) cerr << "Info: Open annovar file" << endl;
+            variantFile.reset(new AnnovarFile(annovarFilename,fastaFile,batchSize,size_t(nThreads)));
+        }
+        else
+        {
+            if(verbose) cerr << "Info: Open VEP file" << endl;
+            variantFile.reset(new VEPFile(vepFilename,fastaFile,batchSize,size_t(nThreads)));
+        }
+
+        for(size_t contigID=0;contigID<variantFile->variants.endpoints.size();contigID++) if(variantFile->variants.endpoints[contigID].empty()==false) fastaFile.WillNeed(int(contigID));   //Only read ahead the contigs that have variants
+
+        instrumentation.SetMemory(MEMORY_VARIANT_LINES,variantFile->LinesMemoryUsage()); instrumentation.SetMemory(MEMORY_VARIANT_STORE,variantFile->variants.MemoryUsage()); instrumentation.SetMemory(MEMORY_STATISTICS,variantFile->variants.statistics.MemoryUsage());
+        instrumentation.SampleMemory("variants",verbose);
+
+        //----------------------------------------------------------------
+        //Open vcf file if specified (Only the windows around the SNVs if the maximum read span is given)
         //----------------------------------------------------------------
 
         VCFFile vcfFile;
         if(vcfFilename.empty()==false)
         {
             if(verbose) cerr << "Info: Open vcf file" << endl;
-            vcfFile.Open(vcfFilename);
+
+            if(maxReadSpan>0)
+            {
+                vector<vector<pair<hts_pos_t,hts_pos_t> > > regions; CreateVCFRegions(*variantFile,maxReadSpan,regions);
+                vcfFile.Open(vcfFilename,fastaFile,regions,size_t(nThreads));
+            }
+            else vcfFile.Open(vcfFilename,fastaFile);
+
+            instrumentation.SetMemory(MEMORY_KNOWN_SNPS,vcfFile.MemoryUsage()); instrumentation.SampleMemory("vcf",verbose);
         }
 
+        parseTimer.Stop();
+
         //----------------------------------------------------------------
-        //Use annovar file
+        //Map contigs to the targets of every bam file (Mismatches are reported before any work is done)
         //----------------------------------------------------------------
 
-        if(annovarFilename.empty()==false)
+        if(verbose) cerr << "Info: Map contigs" << endl;
+
+        vector<vector<int> > contigTids; MapContigs(bamFilenames,fastaFile,*variantFile,contigTids);
+
+        //----------------------------------------------------------------
+        //Open the result cache if specified (Results of every batch are appended once its pileup is done)
+        //----------------------------------------------------------------
+
+        ResultCache resultCache; ResultKey parameterKey;
+
+        if(resultCacheFilename.empty()==false)
         {
-            if(verbose) cerr << "Info: Open annovar file" << endl;
-            AnnovarFile annovarFile(annovarFilename,fastaFile.entries,nBamFiles);
+            if(verbose) cerr << "Info: Open result cache" << endl;
+
+            resultCache.Open(resultCacheFilename);
+
+            ResultKeyHasher hasher; hasher.Add(uint32_t(RESULT_CACHE_VERSION)); hasher.Add(ResultCache::FileKey(fastaFilename));
+            hasher.Add(countDuplicates); hasher.Add(countSecondary); hasher.Add(minHQBaseScore); hasher.Add(minHQAlignmentScore); hasher.Add(minMatchLength); hasher.Add(pileupTolerance); hasher.Add(minAlignmentRate); hasher.Add(maxReadSpan);
+
+            parameterKey=hasher.Key();
+        }
+
+        //----------------------------------------------------------------
+        //Process the bam files in batches of samples (One batch unless a batch size is given, in cohort mode the statistics of every batch are spilled to disk)
+        //----------------------------------------------------------------
+
+        for(size_t batchBegin=0;batchBegin<nBamFiles;batchBegin+=batchSize)
+        {
+            size_t batchEnd=min(batchBegin+batchSize,nBamFiles); size_t nBatchFiles=batchEnd-batchBegin;
+
+            vector<string> batchFilenames(bamFilenames.begin()+ptrdiff_t(batchBegin),bamFilenames.begin()+ptrdiff_t(batchEnd));
+            vector<vector<int> > batchTids(contigTids.begin()+ptrdiff_t(batchBegin),contigTids.begin()+ptrdiff_t(batchEnd));
+
+            if(spilling)
+            {
+                if(verbose) cerr << "Info: Batch of bam files " << batchBegin+1 << "-" << batchEnd << " of " << nBamFiles << endl;
+
+                if(batchBegin>0) variantFile->variants.statistics.Init(variantFile->variants.Size(),nBatchFiles);    //The first batch was allocated with the variants
+                instrumentation.SetMemory(MEMORY_STATISTICS,variantFile->variants.statistics.MemoryUsage());
+            }
 
             //----------------------------------------------------------------
             //Create jobs
@@ -1098,192 +1527,186 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
 
             if(verbose) cerr << "Info: Create jobs" << endl;
 
+            PhaseTimer jobsTimer(PHASE_JOBS);
+
             vector<Job> jobs;
 
-            for(size_t fileIndex=0;fileIndex<nBamFiles;fileIndex++)
+            for(size_t fileIndex=0;fileIndex<nBatchFiles;fileIndex++)
             {
-                for(auto entry=annovarFile.entries.begin(),entriesEnd=annovarFile.entries.end();entry!=entriesEnd;entry++)
+                for(size_t contigID=0,nContigs=variantFile->variants.endpoints.size();contigID<nContigs;contigID++)
                 {
-                    for(auto pos=entry->second.begin(),posEnd=entry->second.end();pos!=posEnd;pos++)
+                    const auto & endpoints=variantFile->variants.endpoints[contigID];
+
+                    for(const VarEndpoint * pos=endpoints.data(),*posEnd=pos+endpoints.size(),*next;pos<posEnd;pos=next)
                     {
                         bool isPos2Only=true;
 
-                        hts_pos_t pos1=pos->first;
-
-                        for(auto varEntry : pos->second)
+                        for(next=pos;next<posEnd && next->pos==pos->pos;next++)
                         {
-                            if(pos1<=varEntry.first) isPos2Only=false;
+                            if(next->pos<=next->other) isPos2Only=false;
                         }
 
                         if(isPos2Only==true) continue;
 
-                        jobs.emplace_back(fileIndex,entry->first.c_str(),pos);
+                        jobs.emplace_back(fileIndex,int(contigID),pos,next);
                     }
                 }
             }
 
-            size_t nJobs=jobs.size();
-
             //----------------------------------------------------------------
-            //Pileup variants
+            //Restore the statistics of jobs found in the result cache and only keep the others
             //----------------------------------------------------------------
 
-            if(verbose)
+            vector<ResultKey> jobKeys;
+
+            if(resultCache.IsOpen())
             {
-                cerr << "Info: Pileup variants" << endl;
-                cerr << progressBar[0] << flush;
-            }
+                vector<ResultKey> fileKeys; for(const auto & bamFilename : batchFilenames) fileKeys.push_back(ResultCache::FileKey(bamFilename));
+                CreateResultKeys(jobs,variantFile->variants,vcfFile.entries,fastaFile,fileKeys,parameterKey,pileupTolerance,maxReadSpan,jobKeys);
 
-            bool errorOccured=false;
-            size_t prevProgress=0;
+                size_t nKept=0;
 
-            omp_set_num_threads(nThreads);
+                for(size_t i=0,nAllJobs=jobs.size();i<nAllJobs;i++)
+                {
+                    const Job & job=jobs[i];
 
-            #pragma omp parallel
-            {
-                Thread thread(countDuplicates,countSecondary,minHQBaseScore,minHQAlignmentScore,minMatchLength,pileupTolerance,nBamFiles,minAlignmentRate,bamFilenames,fastaFile.entries,vcfFile.entries,annovarFile.entries);
+                    size_t nStatistics=0; for(auto entry=job.begin;entry<job.end;entry++) nStatistics+=size_t(entry->pos<=entry->other);   //Variants of the job in normal orientation
+                    const Statistics * statistics=resultCache.Find(jobKeys[i],nStatistics);
 
-                #pragma omp for schedule(dynamic)
-                for(size_t i=0;i<nJobs;i++)
-                {
-                    try
-                    {
-                        thread.RunJob(jobs[i]);
+                    if(statistics==nullptr) {jobs[nKept]=job; jobKeys[nKept]=jobKeys[i]; nKept++; continue;}
 
-                        if(verbose)
-                        {
-                            size_t progress=(i*100)/nJobs;
-                            #pragma omp critical
-                            {
-                                if(progress>prevProgress)
-                                {
-                                    prevProgress=progress;
-                                    cerr << progressBar[progress] << flush;
-                                }
-                            }
-                        }
-                    }
-                    catch(const runtime_error & error)
-                    {
-                        errorOccured=true;
-                        cerr << error.what() << endl;
-                    }
+                    for(auto entry=job.begin;entry<job.end;entry++) if(entry->pos<=entry->other) variantFile->variants.GetStatistics(entry->var)[job.fileIndex]=*statistics++;
                 }
+
+                if(verbose) cerr << "Info: Result cache holds " << resultCache.Size() << " results, " << jobs.size()-nKept << " of " << jobs.size() << " jobs restored" << endl;
+
+                jobs.erase(jobs.begin()+ptrdiff_t(nKept),jobs.end()); jobKeys.resize(nKept);
             }
 
-            if(errorOccured) return 1;
-            if(verbose) cerr << progressBar[100] << endl;
+            size_t nJobs=jobs.size();
 
-            //----------------------------------------------------------------
-            //Output resulting annovar file
-            //----------------------------------------------------------------
+            vector<pair<size_t,size_t> > runs; CreateRuns(jobs,size_t(nThreads),runs);
+            size_t nRuns=runs.size();
+
+            jobsTimer.Stop();
 
-            if(verbose) cerr << "Info: Output results" << endl;
-            annovarFile.Write(bamFilenames);
+            instrumentation.SetMemory(MEMORY_JOBS,jobs.capacity()*sizeof(Job)+runs.capacity()*sizeof(pair<size_t,size_t>)); instrumentation.SampleMemory("jobs",verbose);
 
             //----------------------------------------------------------------
-            //Done
+            //Pileup variants
             //----------------------------------------------------------------
 
-            if(verbose) cerr << "Info: Done" << endl;
-            return 0;
-        }
-
-        //----------------------------------------------------------------
-        //Open VEP file
-        //----------------------------------------------------------------
+            if(verbose) cerr << "Info: Pileup variants" << endl;
 
-        if(verbose) cerr << "Info: Open VEP file" << endl;
-        VEPFile vepFile(vepFilename,fastaFile.entries,nBamFiles);
+            size_t nWorkers=runtime.GetNumWorkers();
+            ProgressReporter progressReporter(nWorkers,nJobs,verbose);
 
-        //----------------------------------------------------------------
-        //Create jobs
-        //----------------------------------------------------------------
+            vector<unique_ptr<Thread> > threads;
+            for(size_t i=0;i<nWorkers;i++) threads.emplace_back(new Thread(countDuplicates,countSecondary,minHQBaseScore,minHQAlignmentScore,minMatchLength,pileupTolerance,nBatchFiles,minAlignmentRate,batchFilenames,fastaFile.entries,vcfFile.entries,variantFile->variants,batchTids,runtime,progressReporter.GetCounters(i)));
 
-        if(verbose) cerr << "Info: Create jobs" << endl;
+            atomic<bool> errorOccured(false);
+            mutex errorLock;
 
-        vector<Job> jobs;
+            bool tracing=traceFilename.empty()==false;
+            vector<JobTrace> traces(tracing ? nJobs : 0);   //Filled by the worker that runs the job
 
-        for(size_t fileIndex=0;fileIndex<nBamFiles;fileIndex++)
-        {
-            for(auto entry=vepFile.entries.begin(),entriesEnd=vepFile.entries.end();entry!=entriesEnd;entry++)
+            function<void(size_t,size_t,size_t)> runJobs=[&](size_t begin,size_t end,size_t workerIndex)
             {
-                for(auto pos=entry->second.begin(),posEnd=entry->second.end();pos!=posEnd;pos++)
-                {
-                    bool isPos2Only=true;
-
-                    hts_pos_t pos1=pos->first;
+                Thread & thread=*threads[workerIndex]; ProgressCounters & counters=progressReporter.GetCounters(workerIndex);
 
-                    for(auto varEntry : pos->second)
+                for(size_t i=begin;i<end;i++)
+                {
+                    for(size_t j=runs[i].first,jEnd=runs[i].second;j<jEnd;j++)
                     {
-                        if(pos1<=varEntry.first) isPos2Only=false;
-                    }
+                        auto startTime=chrono::steady_clock::now(); uint64_t bytesDecompressed=BGZFBlockCache::GetThreadBytesDecompressed();
 
-                    if(isPos2Only==true) continue;
+                        try //Catch errors within the same thread
+                        {
+                            thread.RunJob(jobs[j]);
+                        }
+                        catch(const runtime_error & error)
+                        {
+                            errorOccured=true;
+                            lock_guard<mutex> guard(errorLock);
+                            cerr << error.what() << endl;
+                        }
+
+                        if(tracing)
+                        {
+                            traces[j]=thread.trace; traces[j].bytesDecompressed=BGZFBlockCache::GetThreadBytesDecompressed()-bytesDecompressed;
+                            traces[j].nanoseconds=uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-startTime).count());
+                        }
 
-                    jobs.emplace_back(fileIndex,entry->first.c_str(),pos);
+                        counters.AddJob();
+                    }
                 }
-            }
-        }
+            };
 
-        size_t nJobs=jobs.size();
+            progressReporter.Start();
+            TaskGroup pileup; runtime.ForRange(pileup,0,nRuns,1,runJobs); runtime.Wait(pileup);
+            progressReporter.Stop();
 
-        //----------------------------------------------------------------
-        //Pileup variants
-        //----------------------------------------------------------------
+            if(errorOccured) return 1;
+            if(verbose) PrintBlockCacheStatistics();
 
-        if(verbose)
-        {
-            cerr << "Info: Pileup variants" << endl;
-            cerr << progressBar[0] << flush;
-        }
+            if(resultCache.IsOpen())
+            {
+                vector<Statistics> statistics;
 
-        bool errorOccured=false;
-        size_t prevProgress=0;
+                for(size_t i=0;i<nJobs;i++)
+                {
+                    const Job & job=jobs[i]; statistics.clear();
+                    for(auto entry=job.begin;entry<job.end;entry++) if(entry->pos<=entry->other) statistics.push_back(variantFile->variants.GetStatistics(entry->var)[job.fileIndex]);
 
-        omp_set_num_threads(nThreads);
+                    resultCache.Add(jobKeys[i],statistics);
+                }
 
-        #pragma omp parallel
-        {
-            Thread thread(countDuplicates,countSecondary,minHQBaseScore,minHQAlignmentScore,minMatchLength,pileupTolerance,nBamFiles,minAlignmentRate,bamFilenames,fastaFile.entries,vcfFile.entries,vepFile.entries);
+                size_t nAppended=resultCache.Flush();
+                if(verbose) cerr << "Info: Result cache appended " << nAppended << " results" << endl;
+            }
 
-            #pragma omp for schedule(dynamic)
-            for(size_t i=0;i<nJobs;i++)
+            if(instrumentation.IsMemoryEnabled())
             {
-                try //Catch errors within the same thread
-                {
-                    thread.RunJob(jobs[i]);
+                instrumentation.SetMemory(MEMORY_JOBS,jobs.capacity()*sizeof(Job)+runs.capacity()*sizeof(pair<size_t,size_t>)+traces.capacity()*sizeof(JobTrace));
+                instrumentation.SetMemory(MEMORY_BLOCK_CACHE,BGZFBlockCache::Instance().GetSize()); instrumentation.SampleMemory("pileup",verbose);
+            }
 
-                    if(verbose)
-                    {
-                        size_t progress=(i*100)/nJobs;
-                        #pragma omp critical
-                        {
-                            if(progress>prevProgress)
-                            {
-                                prevProgress=progress;
-                                cerr << progressBar[progress] << flush;
-                            }
-                        }
-                    }
-                }
-                catch(const runtime_error & error)
-                {
-                    errorOccured=true;
-                    cerr << error.what() << endl;
-                }
+            if(tracing)
+            {
+                if(verbose) cerr << "Info: Write trace" << endl;
+                WriteTrace(traceFilename,jobs,traces,*variantFile,batchFilenames);
             }
-        }
 
-        if(errorOccured) return 1;
-        if(verbose) cerr << progressBar[100] << endl;
+            //----------------------------------------------------------------
+            //Spill the statistics of the batch (Merged by variant when the output is written)
+            //----------------------------------------------------------------
+
+            if(spilling)
+            {
+                if(verbose) cerr << "Info: Spill statistics" << endl;
+                variantFile->variants.SpillStatistics(spillDirectory); instrumentation.SetMemory(MEMORY_STATISTICS,0);
+            }
+        }
 
         //----------------------------------------------------------------
-        //Output resulting annovar file
+        //Output results
         //----------------------------------------------------------------
 
         if(verbose) cerr << "Info: Output results" << endl;
-        vepFile.Write(bamFilenames);
+
+        PhaseTimer writeTimer(PHASE_WRITE);
+        variantFile->Write(outputFile,bamFilenames,size_t(nThreads)); outputFile.Close();
+
+        if(binaryFilename.empty()==false)
+        {
+            if(verbose) cerr << "Info: Output binary statistics" << endl;
+            variantFile->WriteStatistics(binaryFilename,bamFilenames);
+        }
+
+        writeTimer.Stop();
+
+        instrumentation.SampleMemory("write",verbose);
+        if(verbose) instrumentation.PrintMemory();
 
         //----------------------------------------------------------------
         //Done
@@ -1291,7 +1714,6 @@ int AnnotateBamStatistics::Run(int argc,char * argv[])
 
         if(verbose) cerr << "Info: Done" << endl;
         return 0;
-
     }
     catch(const runtime_error & error)
     {
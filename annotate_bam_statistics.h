@@ -4,14 +4,30 @@
 //----------------------------------------------------------------
 #include <vector>
 #include <string>
+#include "hts.h"
 //----------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------
+class Job;
+class JobTrace;
+class FastaFile;
+class VariantFile;
+class VariantStore;
+class KnownSNP;
+class ResultKey;
+//----------------------------------------------------------------
 class AnnotateBamStatistics
 {
 private:
 
    static void Tokenize(char * s,const char * d,vector<string> & v);
+   static vector<string> AbsoluteArguments(const vector<string> & arguments);
+   static void PrintBlockCacheStatistics(void);
+   static void CreateRuns(const vector<Job> & jobs,size_t nThreads,vector<pair<size_t,size_t> > & runs);
+   static void CreateVCFRegions(const VariantFile & variantFile,hts_pos_t maxReadSpan,vector<vector<pair<hts_pos_t,hts_pos_t> > > & regions);
+   static void WriteTrace(const string & filename,const vector<Job> & jobs,const vector<JobTrace> & traces,const VariantFile & variantFile,const vector<string> & bamFilenames);
+   static void MapContigs(const vector<string> & bamFilenames,const FastaFile & fastaFile,const VariantFile & variantFile,vector<vector<int> > & contigTids);
+   static void CreateResultKeys(const vector<Job> & jobs,const VariantStore & variants,const vector<vector<KnownSNP> > & knownSNPs,const FastaFile & fastaFile,const vector<ResultKey> & fileKeys,const ResultKey & parameters,hts_pos_t pileupTolerance,hts_pos_t maxReadSpan,vector<ResultKey> & keys);
 
 public:
 
@@ -0,0 +1,443 @@
+//----------------------------------------------------------------
+// Name        : annotation_server.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Serve annotation requests on a Unix socket with warm caches and send them from the command line
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <iostream>
+#include <streambuf>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "ssw.h"
+#include "bam_file.h"
+#include "annotate_bam_statistics.h"
+#include "annotation_server.h"
+//----------------------------------------------------------------
+#define SOCKET_BACKLOG      64
+#define MAX_REQUEST_SIZE    (1UL<<20)   //Bytes of a request line
+#define WARM_BAM_INDEXES    4096        //Bam indexes kept loaded
+#define PROFILE_CACHE_SIZE  256         //MB of alignment profiles kept
+#define TRANSFER_SIZE       (1UL<<20)
+#define REQUEST_TIMEOUT     60          //Seconds a connection may stall sending or receiving before it is dropped
+//----------------------------------------------------------------
+static volatile sig_atomic_t stopRequested=0;
+//----------------------------------------------------------------
+static void RequestStop(int)
+{
+    stopRequested=1;
+}
+//----------------------------------------------------------------
+class MessageBuffer : public streambuf  //Collects what the threads of a request write to std::err
+{
+private:
+
+    mutex lock;
+
+protected:
+
+    int overflow(int c) override
+    {
+        lock_guard<mutex> guard(lock);
+        if(c!=EOF) text+=char(c);
+        return c;
+    }
+
+    streamsize xsputn(const char * s,streamsize n) override
+    {
+        lock_guard<mutex> guard(lock);
+        text.append(s,size_t(n));
+        return n;
+    }
+
+public:
+
+    string text;
+};
+//----------------------------------------------------------------
+static sockaddr_un SocketAddress(const string & socketFilename)
+{
+    sockaddr_un address; memset(&address,0,sizeof(address)); address.sun_family=AF_UNIX;
+
+    if(socketFilename.size()>=sizeof(address.sun_path)) throw runtime_error(string("Error: Socket path too long: ")+socketFilename);
+    memcpy(address.sun_path,socketFilename.c_str(),socketFilename.size());
+
+    return address;
+}
+//----------------------------------------------------------------
+static string WorkingDirectory(void)
+{
+    char * directory=getcwd(nullptr,0); if(directory==nullptr) throw runtime_error("Error: Could not get the working directory");
+    string result(directory); free(directory);
+    return result;
+}
+//----------------------------------------------------------------
+AnnotationServer::AnnotationServer(void) : serving(false) {}
+//----------------------------------------------------------------
+AnnotationServer & AnnotationServer::Instance(void)
+{
+    static AnnotationServer instance;
+    return instance;
+}
+//----------------------------------------------------------------
+void AnnotationServer::SendAll(int fd,const void * data,size_t size)
+{
+    const char * p=(const char*)data;
+
+    while(size>0)
+    {
+        ssize_t sent=send(fd,p,size,MSG_NOSIGNAL);
+
+        if(sent<0)
+        {
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK) throw runtime_error("Error: Timed out sending over socket");
+            throw runtime_error("Error: Could not send over socket");
+        }
+
+        p+=sent; size-=size_t(sent);
+    }
+}
+//----------------------------------------------------------------
+bool AnnotationServer::ReceiveAll(int fd,void * data,size_t size)
+{
+    char * p=(char*)data;
+
+    while(size>0)
+    {
+        ssize_t received=recv(fd,p,size,0);
+
+        if(received<0)
+        {
+            if(errno==EINTR) continue;
+            if(errno==EAGAIN || errno==EWOULDBLOCK) throw runtime_error("Error: Timed out receiving from socket");
+            throw runtime_error("Error: Could not receive from socket");
+        }
+
+        if(received==0) return false;
+        p+=received; size-=size_t(received);
+    }
+
+    return true;
+}
+//----------------------------------------------------------------
+bool AnnotationServer::ReceiveLine(int fd,string & line)
+{
+    line.clear();
+
+    for(char c;;)
+    {
+        if(ReceiveAll(fd,&c,1)==false) return false;
+        if(c=='\n') return true;
+
+        if(line.size()>=MAX_REQUEST_SIZE) throw runtime_error("Error: Request too long");
+        line+=c;
+    }
+}
+//----------------------------------------------------------------
+string AnnotationServer::GetOutputFilename(const string & filename)
+{
+    bool compressed=filename.size()>3 && filename.compare(filename.size()-3,3,".gz")==0;
+    return outputFilename=outputDirectory+"/output"+(compressed ? ".gz" : "");
+}
+//----------------------------------------------------------------
+FastaFile & AnnotationServer::GetFastaFile(const string & filename,bool packed,size_t nThreads)
+{
+    char * rawPath=realpath(filename.c_str(),nullptr); struct stat fileStat;     //Requests run in the directory of the client, the same name can be another file
+    if(rawPath==nullptr) throw runtime_error(string("Error: Could not open fasta file: ")+filename);
+
+    string path(rawPath); free(rawPath);
+    if(stat(path.c_str(),&fileStat)!=0) throw runtime_error(string("Error: Could not open fasta file: ")+filename);
+
+    string identity=BamIndexRegistry::Identity(path,fileStat);
+
+    for(auto it=fastaFiles.begin();it!=fastaFiles.end();)   //A rewritten reference replaces the one opened before
+    {
+        if(it->first.second==packed && it->first.first!=identity && it->first.first.compare(0,path.size()+1,path+'\t')==0) it=fastaFiles.erase(it);
+        else it++;
+    }
+
+    auto & fastaFile=fastaFiles[make_pair(identity,packed)];
+    if(fastaFile==nullptr) fastaFile.reset(new FastaFile(path,packed,nThreads));
+    return *fastaFile;
+}
+//----------------------------------------------------------------
+void AnnotationServer::ServeRequest(int connection,const vector<string> & arguments,const string & directory)
+{
+    //----------------------------------------------------------------
+    //Receive request
+    //----------------------------------------------------------------
+
+    string requestDirectory,line;
+    if(ReceiveLine(connection,requestDirectory)==false || ReceiveLine(connection,line)==false) throw runtime_error("Error: Incomplete request");
+
+    vector<string> requestArguments(arguments);
+    if(line.empty()==false) for(char * pLine=&line[0],*argument;(argument=strsep(&pLine,"\t"))!=nullptr;) requestArguments.emplace_back(argument);
+
+    vector<char*> argv; for(auto & argument : requestArguments) argv.push_back(&argument[0]);
+    argv.push_back(nullptr);
+
+    //----------------------------------------------------------------
+    //Run in the working directory of the client with std::err collected
+    //----------------------------------------------------------------
+
+    MessageBuffer messages; int status=1;
+
+    outputFilename.clear();
+
+    {
+        class Redirect  //Restores std::err and the working directory also after errors
+        {
+        private:
+
+            streambuf * buffer; const string & directory;
+
+        public:
+
+            Redirect(streambuf * messages,const string & directory) : buffer(cerr.rdbuf(messages)),directory(directory) {}
+            ~Redirect(void) {cerr.rdbuf(buffer); if(chdir(directory.c_str())!=0) cerr << "Error: Could not return to working directory: " << directory << endl;}
+        };
+
+        Redirect redirect(&messages,directory);
+
+        try
+        {
+            if(chdir(requestDirectory.c_str())!=0) throw runtime_error(string("Error: Could not change to working directory: ")+requestDirectory);
+
+            optind=0;   //Run parses the arguments with getopt (Zero also resets the internal state of glibc getopt)
+            status=AnnotateBamStatistics::Run(int(argv.size()-1),argv.data());
+        }
+        catch(const exception & error)
+        {
+            cerr << error.what() << endl;
+        }
+    }
+
+    //----------------------------------------------------------------
+    //Send response
+    //----------------------------------------------------------------
+
+    int outputFile=outputFilename.empty() ? -1 : open(outputFilename.c_str(),O_RDONLY);
+    struct stat outputStat; size_t outputSize=(outputFile!=-1 && fstat(outputFile,&outputStat)==0) ? size_t(outputStat.st_size) : 0;
+
+    try
+    {
+        string header=to_string(status)+'\t'+to_string(outputSize)+'\t'+to_string(messages.text.size())+'\n';
+        SendAll(connection,header.data(),header.size());
+
+        for(off_t offset=0;size_t(offset)<outputSize;)
+        {
+            ssize_t sent=sendfile(connection,outputFile,&offset,min(outputSize-size_t(offset),TRANSFER_SIZE));
+            if(sent<0 && errno==EINTR) continue;
+            if(sent<=0) throw runtime_error("Error: Could not send output over socket");
+        }
+
+        SendAll(connection,messages.text.data(),messages.text.size());
+    }
+    catch(const runtime_error &)
+    {
+        if(outputFile!=-1) close(outputFile);
+        if(outputFilename.empty()==false){remove(outputFilename.c_str()); remove((outputFilename+".tbi").c_str());}
+        throw;
+    }
+
+    if(outputFile!=-1) close(outputFile);
+
+    if(outputFilename.empty()==false){remove(outputFilename.c_str()); remove((outputFilename+".tbi").c_str());}
+
+    cerr << "Info: Request in " << requestDirectory << " finished with exit status " << status << endl;
+}
+//----------------------------------------------------------------
+int AnnotationServer::Serve(const string & socketFilename,const vector<string> & arguments,const string & fastaFilename,bool packed,size_t nThreads)
+{
+    if(fastaFilename.empty()) throw runtime_error("Error: Please specify a single fasta file (-h for help)");
+
+    string directory=WorkingDirectory();
+    this->socketFilename=socketFilename[0]=='/' ? socketFilename : directory+'/'+socketFilename;
+
+    //----------------------------------------------------------------
+    //Warm up (The reference is opened once, bam indexes and alignment profiles are kept between requests)
+    //----------------------------------------------------------------
+
+    cerr << "Info: Open fasta file" << endl;
+    GetFastaFile(fastaFilename,packed,nThreads);
+
+    BamIndexRegistry::Instance().SetMaxFiles(WARM_BAM_INDEXES);
+    SSW::SetProfileCacheSize(size_t(PROFILE_CACHE_SIZE)<<20);
+
+    //----------------------------------------------------------------
+    //Listen on the socket (A left over socket of a previous server that stopped is replaced)
+    //----------------------------------------------------------------
+
+    sockaddr_un address=SocketAddress(this->socketFilename);
+
+    struct stat socketStat;
+
+    if(lstat(this->socketFilename.c_str(),&socketStat)==0)   //Only a socket nobody listens on is left over (Never remove other files or take over a running server)
+    {
+        if(S_ISSOCK(socketStat.st_mode)==false) throw runtime_error(string("Error: Socket path is in use by another file: ")+this->socketFilename);
+
+        int probe=socket(AF_UNIX,SOCK_STREAM,0);
+        bool isLeftOver=probe!=-1 && connect(probe,(const sockaddr*)&address,sizeof(address))!=0 && errno==ECONNREFUSED;
+        if(probe!=-1) close(probe);
+
+        if(isLeftOver==false) throw runtime_error(string("Error: Socket is already in use: ")+this->socketFilename);
+
+        unlink(this->socketFilename.c_str());
+    }
+
+    int listener=socket(AF_UNIX,SOCK_STREAM,0);
+    if(listener==-1) throw runtime_error(string("Error: Could not create socket: ")+this->socketFilename);
+
+    mode_t mask=umask(0177); bool isBound=bind(listener,(const sockaddr*)&address,sizeof(address))==0; umask(mask);    //Mode 0600, requests write files as the server user
+
+    if(isBound==false || chmod(this->socketFilename.c_str(),0600)!=0 || listen(listener,SOCKET_BACKLOG)!=0)
+    {
+        close(listener);
+        throw runtime_error(string("Error: Could not listen on socket: ")+this->socketFilename);
+    }
+
+    const char * tempDirectory=getenv("TMPDIR"); outputDirectory=string((tempDirectory!=nullptr && tempDirectory[0]!='\0') ? tempDirectory : "/tmp")+"/enhanced_ABS.XXXXXX";
+
+    if(mkdtemp(&outputDirectory[0])==nullptr)   //Only the server can create files in it (Outputs of requests can not be redirected with a planted link)
+    {
+        close(listener); unlink(this->socketFilename.c_str());
+        throw runtime_error(string("Error: Could not create output directory: ")+outputDirectory);
+    }
+
+    struct sigaction action; memset(&action,0,sizeof(action)); action.sa_handler=RequestStop;     //No SA_RESTART so accept returns on a signal
+    sigaction(SIGINT,&action,nullptr); sigaction(SIGTERM,&action,nullptr);
+
+    //----------------------------------------------------------------
+    //Serve requests
+    //----------------------------------------------------------------
+
+    serving=true; stopRequested=0;
+    cerr << "Info: Serving requests on " << this->socketFilename << endl;
+
+    while(stopRequested==0)
+    {
+        int connection=accept(listener,nullptr,nullptr);
+
+        if(connection==-1)
+        {
+            if(errno==EINTR || errno==ECONNABORTED) continue;
+            break;
+        }
+
+        struct ucred peer; socklen_t peerSize=sizeof(peer);
+
+        if(getsockopt(connection,SOL_SOCKET,SO_PEERCRED,&peer,&peerSize)!=0 || peer.uid!=getuid())
+        {
+            cerr << "Error: Refused request of another user" << endl;
+            close(connection); continue;
+        }
+
+        struct timeval timeout; timeout.tv_sec=REQUEST_TIMEOUT; timeout.tv_usec=0;     //A stalled client would block all requests after it
+        setsockopt(connection,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout)); setsockopt(connection,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+
+        try{ServeRequest(connection,arguments,directory);} catch(const runtime_error & error){cerr << error.what() << endl;}
+        close(connection);
+    }
+
+    serving=false;
+
+    close(listener); unlink(this->socketFilename.c_str()); rmdir(outputDirectory.c_str());
+    cerr << "Info: Stopped serving requests" << endl;
+
+    return stopRequested!=0 ? 0 : 1;
+}
+//----------------------------------------------------------------
+int AnnotationServer::Request(const string & socketFilename,const vector<string> & arguments,const string & outputFilename)
+{
+    //----------------------------------------------------------------
+    //Send request (The server ignores this socket option and writes the output to a file of its own)
+    //----------------------------------------------------------------
+
+    string request=WorkingDirectory()+'\n';
+
+    for(size_t i=1;i<arguments.size();i++)
+    {
+        if(arguments[i].find_first_of("\t\n")!=string::npos) throw runtime_error(string("Error: Argument contains a tab or line end: ")+arguments[i]);
+        if(i>1) request+='\t';
+        request+=arguments[i];
+    }
+
+    request+='\n';
+
+    sockaddr_un address=SocketAddress(socketFilename);
+
+    int connection=socket(AF_UNIX,SOCK_STREAM,0);
+
+    if(connection==-1 || connect(connection,(const sockaddr*)&address,sizeof(address))!=0)
+    {
+        if(connection!=-1) close(connection);
+        throw runtime_error(string("Error: Could not connect to socket: ")+socketFilename);
+    }
+
+    //----------------------------------------------------------------
+    //Receive output and messages
+    //----------------------------------------------------------------
+
+    int outputFile=-1;
+
+    try
+    {
+        SendAll(connection,request.data(),request.size());
+
+        string header; int status; unsigned long outputSize,messageSize;
+        if(ReceiveLine(connection,header)==false || sscanf(header.c_str(),"%d\t%lu\t%lu",&status,&outputSize,&messageSize)!=3) throw runtime_error(string("Error: Invalid response from socket: ")+socketFilename);
+
+        if(outputSize>0)
+        {
+            outputFile=(outputFilename.empty() || outputFilename=="-") ? STDOUT_FILENO : open(outputFilename.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0666);
+            if(outputFile==-1) throw runtime_error(string("Error: Could not open output file: ")+outputFilename);
+        }
+
+        vector<char> buffer(TRANSFER_SIZE);
+
+        for(size_t remaining=outputSize;remaining>0;)
+        {
+            size_t n=min(remaining,buffer.size());
+            if(ReceiveAll(connection,buffer.data(),n)==false) throw runtime_error(string("Error: Incomplete response from socket: ")+socketFilename);
+
+            for(const char * p=buffer.data(),*pEnd=p+n;p<pEnd;)
+            {
+                ssize_t written=write(outputFile,p,size_t(pEnd-p));
+                if(written<0 && errno==EINTR) continue;
+                if(written<0) throw runtime_error(string("Error: Could not write output: ")+outputFilename);
+                p+=written;
+            }
+
+            remaining-=n;
+        }
+
+        string messages(messageSize,'\0');
+        if(messageSize>0 && ReceiveAll(connection,&messages[0],messageSize)==false) throw runtime_error(string("Error: Incomplete response from socket: ")+socketFilename);
+        cerr << messages << flush;
+
+        if(outputFile>STDOUT_FILENO && close(outputFile)!=0){outputFile=-1; throw runtime_error(string("Error: Could not write output: ")+outputFilename);}
+        close(connection);
+
+        return status;
+    }
+    catch(const runtime_error &)
+    {
+        if(outputFile>STDOUT_FILENO) close(outputFile);
+        close(connection);
+        throw;
+    }
+}
+//----------------------------------------------------------------
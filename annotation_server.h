@@ -0,0 +1,50 @@
+//----------------------------------------------------------------
+#ifndef ANNOTATION_SERVER_H
+#define ANNOTATION_SERVER_H
+//----------------------------------------------------------------
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "fasta_file.h"
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+// Protocol of the Unix socket (One request per connection, requests are served one after the other with all threads):
+//
+// Request:     <working directory>\n<argument>\t<argument>...\n      Command line arguments added to the arguments of the server
+// Response:    <exit status>\t<output bytes>\t<message bytes>\n       Followed by the output (What -o would contain) and the messages (std::err)
+//----------------------------------------------------------------
+class AnnotationServer  //Long running annotation with the reference, the bam indexes, the bgzf blocks and the alignment profiles kept warm between requests
+{
+private:
+
+    bool serving;
+    string socketFilename;      //Absolute (Requests change the working directory)
+    string outputDirectory;     //Private (Mode 0700) directory of the temporary outputs
+    string outputFilename;      //Temporary output of the current request
+
+    map<pair<string,bool>,unique_ptr<FastaFile> > fastaFiles;  //By identity of the resolved path (Name, inode, size and modification time) and packing
+
+    AnnotationServer(void);
+
+    static void SendAll(int fd,const void * data,size_t size);
+    static bool ReceiveAll(int fd,void * data,size_t size);
+    static bool ReceiveLine(int fd,string & line);
+
+    void ServeRequest(int connection,const vector<string> & arguments,const string & directory);
+
+public:
+
+    static AnnotationServer & Instance(void);
+
+    bool IsServing(void) const {return serving;}
+
+    string GetOutputFilename(const string & filename);     //Temporary output of the current request (Compressed if the requested name ends with .gz)
+    FastaFile & GetFastaFile(const string & filename,bool packed,size_t nThreads);   //Opened once
+
+    int Serve(const string & socketFilename,const vector<string> & arguments,const string & fastaFilename,bool packed,size_t nThreads);  //Until SIGINT or SIGTERM
+    static int Request(const string & socketFilename,const vector<string> & arguments,const string & outputFilename);                    //Exit status of the request
+};
+//----------------------------------------------------------------
+#endif // ANNOTATION_SERVER_H
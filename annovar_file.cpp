@@ -3,154 +3,181 @@
 // Author      : Remco Hoogenboezem
 // Version     :
 // Copyright   :
-// Description : Open a single annovar file (Can be compressed) and store variants in upper case characters human readable
+// Description : Map a single annovar file (Can be compressed) and store variants in upper case characters human readable
 //----------------------------------------------------------------
 #include <iostream>
 #include <cstring>
+#include <thread>
+#include <unistd.h>
 #include <parasail.h>
 #include "annovar_file.h"
 //----------------------------------------------------------------
-void AnnovarFile::Clear(void)
-{
-    for(const auto & chr : entries)
-    {
-        for(const auto & pos : chr.second)
-        {
-            for(const auto & entry : pos.second)
-            {
-                if(pos.first<=entry.first) delete entry.second;
-            }
-        }
-    }
-}
+#define MIN_CHUNK_SIZE      1048576     //Smallest part of the file parsed by one thread
 //----------------------------------------------------------------
 AnnovarFile::AnnovarFile(void) {}
 //----------------------------------------------------------------
-AnnovarFile::AnnovarFile(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples)
+AnnovarFile::AnnovarFile(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads)
 {
-    Open(filename,fastaEntries,nSamples);
+    Open(filename,fastaFile,nSamples,nThreads);
 }
 //----------------------------------------------------------------
-AnnovarFile::~AnnovarFile(void)
+static inline bool ParsePos(const char * p,const char * end,hts_pos_t & pos)    //Decimal digits only
 {
-    Clear();
+    if(p==end || end-p>18) return false;
+
+    pos=0; for(;p<end;p++)
+    {
+        unsigned digit=unsigned(*p)-unsigned('0');
+        if(digit>9) return false;
+        pos=pos*10+hts_pos_t(digit);
+    }
+
+    return true;
 }
 //----------------------------------------------------------------
-void AnnovarFile::Open(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples)
+static void ParseChunk(const char * p,const char * end,const string & filename,const FastaFile & fastaFile,VariantStore & variants)
 {
-    //----------------------------------------------------------------
-    //Open annovar file
-    //----------------------------------------------------------------
+    string chr; int contigID=-1;   //Contig of the previous line (Lines are usually grouped by contig)
 
-    FILE * annovarFile=fopen(filename.c_str(),"r");
+    for(const char * lineEnd;p<end;p=lineEnd+1)
+    {
+        lineEnd=FindChar(p,end,'\n');
 
-    if(annovarFile==nullptr) throw runtime_error(string("Error: Could not open annovar file: ")+filename);  //Test open annovar file
+        const char * lineLast=lineEnd; if(lineLast>p && lineLast[-1]=='\r') lineLast--;
 
-    fclose(annovarFile);
+        if(lineLast==p) {if(lineEnd==end) break; continue;}
 
-    annovarFile=popen((string("bzcat -f ")+filename+string(" | zcat -f")).c_str(),"r");
+        const char * fields[6]; fields[0]=p; size_t nFields=1;
 
-    //----------------------------------------------------------------
-    //Read and check annovar header
-    //----------------------------------------------------------------
+        for(const char * q=p;nFields<6;nFields++)
+        {
+            q=FindChar(q,lineLast,'\t'); if(q==lineLast) break;
+            fields[nFields]=++q;
+        }
 
-    #define LINE_LEN 16777216   //16MB per line max
-    char * line=(char*)malloc(LINE_LEN*sizeof(char));
+        if(nFields<5) throw runtime_error(string("Error: Insufficient number of columns in annovar file: ")+filename);
 
-    if(fgets(line,LINE_LEN,annovarFile)==nullptr)
-    {
-        free(line); pclose(annovarFile);
-        throw runtime_error(string("Error: Could not read header from annovar file: ")+filename);
-    }
+        string_view pChr(fields[0],size_t(fields[1]-fields[0]-1));
+        const char * pPos=fields[1]; const char * pPosEnd=fields[2]-1;
+        string_view pRef(fields[3],size_t(fields[4]-fields[3]-1));
+        string_view pAlt(fields[4],size_t((nFields==6 ? fields[5]-1 : lineLast)-fields[4]));
 
-    if(strcasestr(line,"Chr\tStart\tEnd\tRef\tAlt")==nullptr)
-    {
-        free(line); pclose(annovarFile);
-        throw runtime_error(string("Error: Invalid annovar file header: ")+filename);
-    }
+        if(pRef.empty() || pAlt.empty() || (pRef[0]=='-' && pAlt[0]=='-')) throw runtime_error(string("Error: Invalid variant type in annovar file: ")+filename);
+
+        if(chr!=pChr){chr=pChr; contigID=fastaFile.GetContigID(chr);}
 
-    line[strcspn(line,"\n")]='\0';    //Remove new line
-    string header(line);
+        if(contigID<0) throw runtime_error(string("Error: Chromosome names in annovar and fasta file must agree: ")+filename);
 
+        const FastaEntry & fastaEntry=fastaFile.entries[size_t(contigID)];
+
+        hts_pos_t pos1; if(ParsePos(pPos,pPosEnd,pos1)==false) throw runtime_error(string("Error: Invalid variant position in annovar file: ")+filename);
+
+        pos1--;
+
+        if(pos1<0 || (pos1 + hts_pos_t(pRef.size()))>fastaEntry.len) throw runtime_error(string("Error: Variant position outside fasta reference sequence: ")+filename);
+
+        if(pAlt[0]=='-') pos1--;
+
+        string ref(pRef),alt(pAlt);
+
+        if(pRef[0]=='-'){ref=fastaEntry.Base(pos1); alt=ref+alt;}
+        if(pAlt[0]=='-'){alt=fastaEntry.Base(pos1); ref=alt+ref;}
+
+        for(auto & c : ref) c=toupper(c);
+        for(auto & c : alt) c=toupper(c);
+
+        hts_pos_t refLen=hts_pos_t(ref.length()); hts_pos_t altLen=hts_pos_t(alt.length());
+
+        VarType varType; hts_pos_t pos2;
+
+        if(refLen+altLen==2) {varType=SNV; pos2=pos1;}
+        else if(refLen>=altLen) {varType=DEL; pos2=pos1+refLen;}
+        else varType=AssessTandem(pos1,alt,fastaEntry,pos2);
+
+        variants.AddEndpoints(size_t(contigID),pos1,pos2,variants.Add(uint64_t(p-variants.lineData),size_t(lineLast-p),varType,ref,alt));
+
+        if(lineEnd==end) break;
+    }
+}
+//----------------------------------------------------------------
+void AnnovarFile::Open(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads)
+{
     //----------------------------------------------------------------
-    //Read annovar entries
+    //Map annovar file
     //----------------------------------------------------------------
 
-    map<string,map<hts_pos_t,vector<pair<hts_pos_t,VarEntry*> > > > entries;
+    if(access(filename.c_str(),R_OK)!=0) throw runtime_error(string("Error: Could not open annovar file: ")+filename);
 
-    while(fgets(line,LINE_LEN,annovarFile)!=nullptr)
-    {
-        if(line[0]=='\0' || line[0]=='\n') continue;
+    unique_ptr<TextFile> text(new TextFile(filename,nThreads));    //Plain files are mapped, compressed files decompressed once
 
-        line[strcspn(line,"\n")]='\0';
-        VarEntry * entry=new VarEntry(nSamples,line);
+    const char * p=text->data; const char * end=p+text->size;
 
-        char * pLine=line; char * pChr=strsep(&pLine,"\t"); char * pPos=strsep(&pLine,"\t"); strsep(&pLine,"\t"); char * pRef=strsep(&pLine,"\t"); char * pAlt=strsep(&pLine,"\t");
+    //----------------------------------------------------------------
+    //Read and check annovar header
+    //----------------------------------------------------------------
 
-        if(pAlt==nullptr)
-        {
-            free(line); pclose(annovarFile);
-            throw runtime_error(string("Error: Insufficient number of columns in annovar file: ")+filename);
-        }
+    if(p==end) throw runtime_error(string("Error: Could not read header from annovar file: ")+filename);
 
-        if(pRef[0]=='-' && pAlt[0]=='-')
-        {
-            free(line); pclose(annovarFile);
-            throw runtime_error(string("Error: Invalid variant type in annovar file: ")+filename);
-        }
+    const char * lineEnd=FindChar(p,end,'\n');
 
-        string chr(pChr);
+    string header(p,size_t(lineEnd-p)); p=lineEnd<end ? lineEnd+1 : end;
 
-        if(fastaEntries.count(chr)==0)
-        {
-            free(line); pclose(annovarFile);
-            throw runtime_error(string("Error: Chromosome names in annovar and fasta file must agree: ")+filename);
-        }
+    if(!header.empty() && header.back()=='\r') header.pop_back();
 
-        const FastaEntry & fastaEntry=fastaEntries.at(chr);
+    if(strcasestr(header.c_str(),"Chr\tStart\tEnd\tRef\tAlt")==nullptr) throw runtime_error(string("Error: Invalid annovar file header: ")+filename);
 
-        hts_pos_t pos1=atoll(pPos)-1;
+    //----------------------------------------------------------------
+    //Split the entries into newline aligned chunks
+    //----------------------------------------------------------------
 
-        if(pos1<0 || (pos1 + hts_pos_t(strlen(pRef)))>fastaEntry.len)
-        {
-            free(line); pclose(annovarFile);
-            throw runtime_error(string("Error: Variant position outside fasta reference sequence: ")+filename);
-        }
+    nThreads=max(nThreads,size_t(1)); size_t nContigs=fastaFile.entries.size();
 
-        if(pAlt[0]=='-') pos1--;
+    size_t nChunks=min(nThreads,max(size_t(end-p)/MIN_CHUNK_SIZE,size_t(1)));
+
+    vector<const char*> bounds(1,p);
 
-        entry->ref=pRef; entry->alt=pAlt;
+    for(size_t i=1;i<nChunks;i++)
+    {
+        const char * bound=max(p+(size_t(end-p)*i)/nChunks,bounds.back());
+        bound=FindChar(bound,end,'\n'); bounds.push_back(bound<end ? bound+1 : end);
+    }
+
+    bounds.push_back(end);
 
-        if(pRef[0]=='-'){entry->ref=fastaEntry.seq[pos1]; entry->alt=entry->ref+entry->alt;}
-        if(pAlt[0]=='-'){entry->alt=fastaEntry.seq[pos1]; entry->ref=entry->alt+entry->ref;}
+    //----------------------------------------------------------------
+    //Parse chunks in parallel (Every chunk into its own partial store)
+    //----------------------------------------------------------------
 
-        for(auto & c : entry->ref) c=toupper(c);
-        for(auto & c : entry->alt) c=toupper(c);
+    vector<VariantStore> partials(nChunks); vector<exception_ptr> errors(nChunks);
 
-        hts_pos_t refLen=hts_pos_t(entry->ref.length()); hts_pos_t altLen=hts_pos_t(entry->alt.length());
+    for(auto & partial : partials) {partial.Init(nContigs,nSamples); partial.lineData=text->data;}
 
-        if(refLen+altLen==2)
+    auto parse=[&](size_t chunk)
+    {
+        try
         {
-            entry->varType=SNV;
-            entries[chr][pos1].emplace_back(pos1,entry);
-            continue;
+            ParseChunk(bounds[chunk],bounds[chunk+1],filename,fastaFile,partials[chunk]);
         }
-
-        if(refLen>=altLen)
+        catch(...)
         {
-            entry->varType=DEL;
-            hts_pos_t pos2=pos1+refLen;
-            entries[chr][pos1].emplace_back(pos2,entry);
-            entries[chr][pos2].emplace_back(pos1,entry);
-            continue;
+            errors[chunk]=current_exception();
         }
+    };
 
-        hts_pos_t pos2=entry->AssessTandem(pos1,fastaEntry.seq+pos1);
-        entries[chr][pos1].emplace_back(pos2,entry);
-        entries[chr][pos2].emplace_back(pos1,entry);
-    }
+    vector<thread> threads; for(size_t i=1;i<nChunks;i++) threads.emplace_back(parse,i);
+    parse(0); for(auto & thread : threads) thread.join();
 
-    free(line); pclose(annovarFile);
+    for(size_t i=0;i<nChunks;i++) if(errors[i]!=nullptr) rethrow_exception(errors[i]);  //First error in file order
+
+    //----------------------------------------------------------------
+    //Append partial stores in chunk order and sort the endpoints (Keeps the input order of variants at the same position)
+    //----------------------------------------------------------------
+
+    VariantStore variants(move(partials[0]));
+
+    for(size_t i=1;i<nChunks;i++) {variants.Append(partials[i]); partials[i].Clear();}
+
+    variants.Finalize(nThreads);
 
     //----------------------------------------------------------------
     //Keep results in object
@@ -159,37 +186,27 @@ void AnnovarFile::Open(const string & filename,const map<string,FastaEntry> & fa
     Clear();
 
     this->header=header;
-    this->entries=entries;
+    this->contigNames=fastaFile.names;
+    this->variants=move(variants);
+    this->text=move(text);
 }
 //----------------------------------------------------------------
-void AnnovarFile::Write(const vector<string> & bamFilenames)
+void AnnovarFile::Write(OutputFile & output,const vector<string> & bamFilenames,size_t nThreads)
 {
     //----------------------------------------------------------------
     //Write header
     //----------------------------------------------------------------
 
-    cout << header << "\tvar_type";
-    size_t nBamFiles=bamFilenames.size(); for(size_t i=0;i<nBamFiles;i++) Statistics::PrintHeader(bamFilenames[i]);
-    cout << '\n';
+    string text=header+"\tvar_type";
+    size_t nBamFiles=bamFilenames.size(); for(size_t i=0;i<nBamFiles;i++) Statistics::RenderHeader(bamFilenames[i],text);
+    text+='\n'; output.Write(text);
+
+    output.BeginIndex(1,2,3,1);     //Tabix index on the Chr, Start and End columns if the output is compressed
 
     //----------------------------------------------------------------
     //Write entries
     //----------------------------------------------------------------
 
-    for(const auto & chr : entries)
-    {
-        for(const auto & pos : chr.second)
-        {
-            for(const auto & entry : pos.second)
-            {
-                if(pos.first<=entry.first)
-                {
-                    cout << entry.second->line << '\t' << varStrings[entry.second->varType];
-                    const auto & statistics=entry.second->statistics; for(size_t i=0;i<nBamFiles;i++) statistics[i].PrintEntry();
-                    cout << '\n';
-                }
-            }
-        }
-    }
+    WriteEntries(output,nBamFiles,nThreads);
 }
 //----------------------------------------------------------------
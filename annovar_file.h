@@ -2,28 +2,24 @@
 #ifndef AnnovarFileH
 #define	AnnovarFileH
 //----------------------------------------------------------------
-#include <map>
-#include "fasta_file.h"
-#include "variant_entry.h"
+#include <memory>
+#include "variant_file.h"
+#include "text_reader.h"
 //----------------------------------------------------------------
-class AnnovarFile
+class AnnovarFile : public VariantFile
 {
 private:
 
-    void Clear(void);
+    unique_ptr<TextFile> text;  //Mapped input (The entry lines point into it)
 
 public:
 
-    string                                                          header;
-    map<string,map<hts_pos_t,vector<pair<hts_pos_t,VarEntry*> > > > entries;
-
     AnnovarFile(void);
-    AnnovarFile(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples);
-
-    ~AnnovarFile(void);
+    AnnovarFile(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads=1);
 
-    void Open(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples);
-    void Write(const vector<string> & bamFilenames);
+    void Open(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads) override;
+    void Write(OutputFile & output,const vector<string> & bamFilenames,size_t nThreads=1) override;
+    size_t LinesMemoryUsage(void) const override {return text==nullptr ? 0 : text->size;}
 };
 //----------------------------------------------------------------
 #endif
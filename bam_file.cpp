@@ -5,6 +5,10 @@
 // Copyright   :
 // Description : Open a single bam file to read regions
 //----------------------------------------------------------------
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 #include "bam_file.h"
 //----------------------------------------------------------------
 void BamFile::Close(void)
@@ -14,12 +18,55 @@ void BamFile::Close(void)
     if(initialized)
     {
         initialized=false;
-        hts_idx_destroy(index); sam_hdr_destroy(header); sam_close(handle);
+        index.reset(); sam_hdr_destroy(header); sam_close(handle);
+
+        if(useBlockCache){close(fd); block.reset(); chunks.clear(); useBlockCache=false;}
+    }
+}
+//----------------------------------------------------------------
+BamIndexRegistry::BamIndexRegistry(void) : maxFiles(0) {}
+//----------------------------------------------------------------
+BamIndexRegistry & BamIndexRegistry::Instance(void)
+{
+    static BamIndexRegistry instance;
+    return instance;
+}
+//----------------------------------------------------------------
+string BamIndexRegistry::Identity(const string & filename,const struct stat & fileStat)
+{
+    return filename+'\t'+to_string(fileStat.st_ino)+'\t'+to_string(fileStat.st_size)+'\t'+to_string(fileStat.st_mtim.tv_sec)+'.'+to_string(fileStat.st_mtim.tv_nsec);
+}
+//----------------------------------------------------------------
+void BamIndexRegistry::SetMaxFiles(size_t maxFiles)
+{
+    lock_guard<mutex> guard(lock);
+    this->maxFiles=maxFiles; if(maxFiles==0) indexes.clear();
+}
+//----------------------------------------------------------------
+shared_ptr<hts_idx_t> BamIndexRegistry::Load(htsFile * handle,const string & filename,const struct stat & fileStat)
+{
+    string identity=Identity(filename,fileStat);
+
+    {
+        lock_guard<mutex> guard(lock);
+        if(maxFiles==0) return shared_ptr<hts_idx_t>(sam_index_load(handle,filename.c_str()),hts_idx_destroy);
+
+        auto it=indexes.find(filename); if(it!=indexes.end() && it->second.first==identity) return it->second.second;
     }
+
+    shared_ptr<hts_idx_t> index(sam_index_load(handle,filename.c_str()),hts_idx_destroy);   //Loaded outside the lock (Readers of other files do not wait)
+    if(index==nullptr) return index;
+
+    lock_guard<mutex> guard(lock);
+
+    if(indexes.size()>=maxFiles && indexes.count(filename)==0) indexes.erase(indexes.begin());     //Arbitrary victim (Readers keep their own reference)
+    indexes[filename]=make_pair(identity,index);
+
+    return index;
 }
 //----------------------------------------------------------------
-BamFile::BamFile(void) : initialized(false),readIterator(nullptr) {}
-BamFile::BamFile(const string & filename,bool countDuplicates,bool countSecondary) : initialized(false),readIterator(nullptr) {Open(filename,countDuplicates,countSecondary);}
+BamFile::BamFile(void) : initialized(false),readIterator(nullptr),useBlockCache(false) {}
+BamFile::BamFile(const string & filename,bool countDuplicates,bool countSecondary) : initialized(false),readIterator(nullptr),useBlockCache(false) {Open(filename,countDuplicates,countSecondary);}
 BamFile::~BamFile(void) {Close();}
 //----------------------------------------------------------------
 void BamFile::Open(const string & filename,bool countDuplicates,bool countSecondary)
@@ -46,13 +93,30 @@ void BamFile::Open(const string & filename,bool countDuplicates,bool countSecond
     }
 
     //----------------------------------------------------------------
-    //Load index
+    //Bgzf compressed bam files are read through the shared block cache
     //----------------------------------------------------------------
 
-    hts_idx_t * index=sam_index_load(handle,filename.c_str());
+    const htsFormat * format=hts_get_format(handle);
+    bool useBlockCache=format->format==bam && format->compression==bgzf;
+
+    int fd=-1; struct stat fileStat;
+
+    if(useBlockCache && ((fd=open(filename.c_str(),O_RDONLY))==-1 || fstat(fd,&fileStat)==-1))
+    {
+        if(fd!=-1) close(fd);
+        sam_hdr_destroy(header); sam_close(handle);
+        throw runtime_error(string("Error: Could not open bam file: ")+filename);
+    }
+
+    //----------------------------------------------------------------
+    //Load index (Through the registry for bgzf bam files, other formats keep the index with their handle)
+    //----------------------------------------------------------------
+
+    shared_ptr<hts_idx_t> index=useBlockCache ? BamIndexRegistry::Instance().Load(handle,filename,fileStat) : shared_ptr<hts_idx_t>(sam_index_load(handle,filename.c_str()),hts_idx_destroy);
 
     if(index==nullptr)
     {
+        if(fd!=-1) close(fd);
         sam_hdr_destroy(header); sam_close(handle);
         throw runtime_error(string("Error: Could not read bam index: ")+filename);
     }
@@ -67,6 +131,10 @@ void BamFile::Open(const string & filename,bool countDuplicates,bool countSecond
     this->header=header;
     this->index=index;
 
+    this->useBlockCache=useBlockCache;
+    this->fd=fd;
+    if(useBlockCache) this->fileID=BGZFBlockCache::Instance().RegisterFile(filename,BamIndexRegistry::Identity(filename,fileStat));  //A rewritten file gets new blocks
+
     excludeFlags=BAM_FQCFAIL;
     if(countDuplicates==false) excludeFlags|=BAM_FDUP;
     if(countSecondary==false) excludeFlags|=BAM_FSECONDARY;
@@ -88,8 +156,202 @@ const string & BamFile::GetFileName(void)
     return fileName;
 }
 //----------------------------------------------------------------
-void BamFile::SetRegion(const string & chr,hts_pos_t pos,hts_pos_t len)
+void BamFile::Seek(uint64_t offset)
+{
+    block=BGZFBlockCache::Instance().Get(fileID,fd,offset>>16); blockOffset=size_t(offset&0xFFFF);
+    if(block==nullptr || blockOffset>block->data.size()) throw runtime_error(string("Error: Could not seek in bam file: ")+handle->fn);
+}
+//----------------------------------------------------------------
+uint64_t BamFile::Tell(void) const
+{
+    if(blockOffset==block->data.size()) return (block->coffset+block->csize)<<16;  //End of block equals the start of the next block
+    return (block->coffset<<16)|uint64_t(blockOffset);
+}
+//----------------------------------------------------------------
+bool BamFile::ReadBytes(void * dest,size_t nBytes)
+{
+    uint8_t * pDest=(uint8_t*)dest;
+
+    while(nBytes>0)
+    {
+        if(blockOffset==block->data.size())
+        {
+            shared_ptr<const BGZFBlock> nextBlock=BGZFBlockCache::Instance().Get(fileID,fd,block->coffset+block->csize);
+            if(nextBlock==nullptr) return false;
+            block=nextBlock; blockOffset=0;
+            continue;
+        }
+
+        size_t n=min(nBytes,block->data.size()-blockOffset);
+        memcpy(pDest,block->data.data()+blockOffset,n); pDest+=n; blockOffset+=n; nBytes-=n;
+    }
+
+    return true;
+}
+//----------------------------------------------------------------
+int BamFile::ReadRecord(bam1_t * read)  //Decode a single bam record (Little endian) in the same layout as bam_read1, including the CG tag fix-up
+{
+    uint8_t core[36];
+
+    if(ReadBytes(core,4)==false) return -1;
+    if(ReadBytes(core+4,32)==false) throw runtime_error(string("Error: Truncated bam record: ")+handle->fn);
+
+    int32_t blockSize,refID,pos,lSeq,nextRefID,nextPos,tLen; uint16_t bin,nCigar,flag;
+
+    memcpy(&blockSize,core,4); memcpy(&refID,core+4,4); memcpy(&pos,core+8,4); memcpy(&bin,core+14,2); memcpy(&nCigar,core+16,2); memcpy(&flag,core+18,2); memcpy(&lSeq,core+20,4); memcpy(&nextRefID,core+24,4); memcpy(&nextPos,core+28,4); memcpy(&tLen,core+32,4);
+
+    size_t lReadName=core[12]; size_t lVarData=size_t(blockSize)-32;
+
+    if(blockSize<32 || lReadName==0 || lSeq<0 || lReadName+4*size_t(nCigar)+size_t(lSeq+1)/2+size_t(lSeq)>lVarData) throw runtime_error(string("Error: Invalid bam record: ")+handle->fn);
+
+    size_t lExtraNul=(4-(lReadName&3))&3;   //Keep the cigar 32 bit aligned
+    size_t lData=lVarData+lExtraNul;
+
+    if(read->m_data<lData)
+    {
+        size_t mData=lData; mData--; mData|=mData>>1; mData|=mData>>2; mData|=mData>>4; mData|=mData>>8; mData|=mData>>16; mData++;
+        uint8_t * data=(uint8_t*)realloc(read->data,mData);
+        if(data==nullptr) throw runtime_error("Error: Could not allocate memory for bam record");
+        read->data=data; read->m_data=uint32_t(mData);
+    }
+
+    if(ReadBytes(read->data,lReadName)==false) throw runtime_error(string("Error: Truncated bam record: ")+handle->fn);
+    memset(read->data+lReadName,0,lExtraNul);
+    if(ReadBytes(read->data+lReadName+lExtraNul,lVarData-lReadName)==false) throw runtime_error(string("Error: Truncated bam record: ")+handle->fn);
+
+    read->l_data=int(lData);
+
+    bam1_core_t & c=read->core;
+    c.tid=refID; c.pos=pos; c.bin=bin; c.qual=core[13]; c.l_extranul=uint8_t(lExtraNul); c.flag=flag; c.l_qname=uint16_t(lReadName+lExtraNul);
+    c.n_cigar=nCigar; c.l_qseq=lSeq; c.mtid=nextRefID; c.mpos=nextPos; c.isize=tLen;
+
+    CigarFromTag(read);
+
+    return blockSize;
+}
+//----------------------------------------------------------------
+void BamFile::CigarFromTag(bam1_t * read)    //Records with more than 65535 cigar operations keep them in a CG tag behind a <lseq>S<reflen>N placeholder (Same conversion as bam_read1)
 {
+    bam1_core_t & c=read->core;
+
+    if(c.n_cigar==0 || c.tid<0 || c.pos<0) return;
+
+    uint32_t * cigar=bam_get_cigar(read);
+    if(bam_cigar_op(cigar[0])!=BAM_CSOFT_CLIP || bam_cigar_oplen(cigar[0])!=uint32_t(c.l_qseq)) return;
+
+    uint8_t * tag=bam_aux_get(read,"CG");
+    if(tag==nullptr || tag[0]!='B' || (tag[1]!='I' && tag[1]!='i')) return;
+
+    uint32_t nTagCigar; memcpy(&nTagCigar,tag+2,4);
+    if(nTagCigar<c.n_cigar || nTagCigar>=(1U<<29)) return;
+
+    size_t tagBegin=size_t(tag-read->data)-2; size_t tagEnd=tagBegin+8+4*size_t(nTagCigar);     //Tag name, type, subtype, count and values
+    if(tagEnd>size_t(read->l_data)) throw runtime_error(string("Error: Invalid CG tag in bam record: ")+handle->fn);
+
+    //----------------------------------------------------------------
+    //Remove the tag, then widen the cigar and copy the real operations in (The record shrinks by the placeholder and the tag header)
+    //----------------------------------------------------------------
+
+    vector<uint8_t> tagCigar(tag+6,tag+6+4*size_t(nTagCigar));
+
+    size_t lData=size_t(read->l_data);
+    memmove(read->data+tagBegin,read->data+tagEnd,lData-tagEnd); lData-=tagEnd-tagBegin;
+
+    size_t cigarBegin=size_t(c.l_qname); size_t cigarEnd=cigarBegin+4*size_t(c.n_cigar);
+    memmove(read->data+cigarBegin+tagCigar.size(),read->data+cigarEnd,lData-cigarEnd); lData+=tagCigar.size()-4*size_t(c.n_cigar);
+    memcpy(read->data+cigarBegin,tagCigar.data(),tagCigar.size());
+
+    read->l_data=int(lData); c.n_cigar=nTagCigar;
+}
+//----------------------------------------------------------------
+int BamFile::NextRecord(bam1_t * read)  //Same semantics as the htslib (multi region) iterator
+{
+    while(chunkIndex<chunks.size())
+    {
+        if(currentOffset>=chunks[chunkIndex].second)
+        {
+            if(++chunkIndex==chunks.size()) break;
+            Seek(chunks[chunkIndex].first); currentOffset=chunks[chunkIndex].first;
+            continue;
+        }
+
+        int ret=ReadRecord(read); if(ret<0) break;
+        currentOffset=Tell();
+
+        hts_pos_t begin=read->core.pos;
+        if(read->core.tid!=regionTid || begin>=regionsEnd) break;
+
+        hts_pos_t end=bam_endpos(read);
+        for(const auto & region : regions) if(end>region.first && region.second>begin) return ret;
+    }
+
+    chunkIndex=chunks.size();
+    return -1;
+}
+//----------------------------------------------------------------
+void BamFile::InitIterator(int tid,const vector<pair<hts_pos_t,hts_pos_t> > & regions)
+{
+    //----------------------------------------------------------------
+    //Merge regions
+    //----------------------------------------------------------------
+
+    vector<pair<hts_pos_t,hts_pos_t> > sortedRegions(regions); sort(sortedRegions.begin(),sortedRegions.end());
+
+    this->regions.clear();
+
+    for(const auto & region : sortedRegions)
+    {
+        if(this->regions.empty()==false && region.first<=this->regions.back().second) {this->regions.back().second=max(this->regions.back().second,region.second); continue;}
+        this->regions.push_back(region);
+    }
+
+    regionTid=tid; regionsEnd=this->regions.empty() ? 0 : this->regions.back().second;
+
+    //----------------------------------------------------------------
+    //Gather and merge the index chunks of all regions
+    //----------------------------------------------------------------
+
+    vector<pair<uint64_t,uint64_t> > offsets;
+
+    for(const auto & region : this->regions)
+    {
+        hts_itr_t * readIterator=sam_itr_queryi(index.get(),tid,region.first,region.second);
+        if(readIterator==nullptr) throw runtime_error(string("Error: Could not init read iterator: ")+handle->fn);
+
+        for(int i=0;i<readIterator->n_off;i++) offsets.emplace_back(readIterator->off[i].u,readIterator->off[i].v);
+        sam_itr_destroy(readIterator);
+    }
+
+    sort(offsets.begin(),offsets.end());
+
+    chunks.clear();
+
+    for(const auto & offset : offsets)
+    {
+        if(chunks.empty()==false && offset.first<=chunks.back().second) {chunks.back().second=max(chunks.back().second,offset.second); continue;}
+        chunks.push_back(offset);
+    }
+
+    chunkIndex=0; if(chunks.empty()) return;
+    Seek(chunks[0].first); currentOffset=chunks[0].first;
+}
+//----------------------------------------------------------------
+int BamFile::GetTid(const string & chr) const
+{
+    if(initialized==false) throw runtime_error("Error: No open bam file");
+    return sam_hdr_name2tid(header,chr.c_str());
+}
+//----------------------------------------------------------------
+hts_pos_t BamFile::GetTargetLen(int tid) const
+{
+    if(initialized==false) throw runtime_error("Error: No open bam file");
+    return hts_pos_t(sam_hdr_tid2len(header,tid));
+}
+//----------------------------------------------------------------
+void BamFile::SetRegion(int tid,hts_pos_t pos,hts_pos_t len)
+{
+    PhaseTimer timer(PHASE_SEEK);
+
     //----------------------------------------------------------------
     //Check if the bam file is initialized
     //----------------------------------------------------------------
@@ -100,18 +362,27 @@ void BamFile::SetRegion(const string & chr,hts_pos_t pos,hts_pos_t len)
     //Create iterator
     //----------------------------------------------------------------
 
-    string region(chr+string(":")+to_string(pos+1)+string("-")+to_string(pos+len));
-    hts_itr_t * readIterator=sam_itr_querys(index,header,region.c_str());
+    if(tid<0 || tid>=sam_hdr_nref(header)) throw runtime_error(string("Error: Could not init read iterator: ")+handle->fn);
+
+    if(useBlockCache)
+    {
+        InitIterator(tid,vector<pair<hts_pos_t,hts_pos_t> >(1,make_pair(pos,pos+len)));
+        return;
+    }
+
+    hts_itr_t * readIterator=sam_itr_queryi(index.get(),tid,pos,pos+len);
 
-    if(readIterator==nullptr) throw runtime_error(string("Error: Could not init read iterator: ") + region);
+    if(readIterator==nullptr) throw runtime_error(string("Error: Could not init read iterator: ")+sam_hdr_tid2name(header,tid)+string(":")+to_string(pos+1)+string("-")+to_string(pos+len));
 
     if(this->readIterator!=nullptr) sam_itr_destroy(this->readIterator);
 
     this->readIterator=readIterator;
 }
 //----------------------------------------------------------------
-void BamFile::SetRegions(size_t nRegions,char ** regions)
+void BamFile::SetRegions(int tid,const vector<pair<hts_pos_t,hts_pos_t> > & regions)
 {
+    PhaseTimer timer(PHASE_SEEK);
+
     //----------------------------------------------------------------
     //Check if the bam file is initialized
     //----------------------------------------------------------------
@@ -122,7 +393,25 @@ void BamFile::SetRegions(size_t nRegions,char ** regions)
     //Create iterator
     //----------------------------------------------------------------
 
-    hts_itr_t * readIterator=sam_itr_regarray(index,header,regions,uint(nRegions));
+    if(tid<0 || tid>=sam_hdr_nref(header)) throw runtime_error(string("Error: Could not init read iterator for multiple regions: ")+handle->fn);
+
+    if(useBlockCache)
+    {
+        InitIterator(tid,regions);
+        return;
+    }
+
+    string chr(sam_hdr_tid2name(header,tid));
+
+    size_t nRegions=regions.size(); vector<string> regionStrings(nRegions); vector<char*> regionArray(nRegions);
+
+    for(size_t i=0;i<nRegions;i++)
+    {
+        regionStrings[i]=chr+string(":")+to_string(regions[i].first+1)+string("-")+to_string(regions[i].second);
+        regionArray[i]=&regionStrings[i][0];
+    }
+
+    hts_itr_t * readIterator=sam_itr_regarray(index.get(),header,regionArray.data(),uint(nRegions));
 
     if(readIterator==nullptr) throw runtime_error("Error: Could not init read iterator for multiple regions");
 
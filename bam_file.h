@@ -2,11 +2,37 @@
 #ifndef BAM_FILE_H
 #define	BAM_FILE_H
 //----------------------------------------------------------------
+#include <memory>
+#include <mutex>
+#include <vector>
 #include <stdexcept>
+#include <unordered_map>
+#include <sys/stat.h>
 #include "sam.h"
+#include "bgzf_block_cache.h"
+#include "instrumentation.h"
 //----------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------
+class BamIndexRegistry  //Process wide indexes of bgzf bam files shared by all readers (Disabled unless a maximum is set, an index is reloaded when its bam file changes)
+{
+private:
+
+    mutex lock;
+    size_t maxFiles;
+    unordered_map<string,pair<string,shared_ptr<hts_idx_t> > > indexes;   //Identity and index by file name
+
+    BamIndexRegistry(void);
+
+public:
+
+    static BamIndexRegistry & Instance(void);
+    static string Identity(const string & filename,const struct stat & fileStat);  //Name, inode, size and modification time
+
+    void SetMaxFiles(size_t maxFiles);     //Zero disables the registry
+    shared_ptr<hts_idx_t> Load(htsFile * handle,const string & filename,const struct stat & fileStat);
+};
+//----------------------------------------------------------------
 class BamFile
 {
 private:
@@ -17,9 +43,33 @@ private:
 
     htsFile *   handle;
     bam_hdr_t * header;
-    hts_idx_t * index;
+    shared_ptr<hts_idx_t> index;
 
-    hts_itr_t * readIterator;
+    hts_itr_t * readIterator;   //Only used if the file can not be read through the block cache (e.g. cram)
+
+    //----------------------------------------------------------------
+    //Block cache reader state
+    //----------------------------------------------------------------
+
+    bool        useBlockCache;
+    int         fd;
+    uint32_t    fileID;
+
+    shared_ptr<const BGZFBlock> block; size_t blockOffset;
+
+    int regionTid; hts_pos_t regionsEnd;
+    vector<pair<hts_pos_t,hts_pos_t> > regions;     //Sorted and merged [begin,end) regions
+    vector<pair<uint64_t,uint64_t> > chunks;        //Sorted and merged virtual offset chunks
+    size_t chunkIndex; uint64_t currentOffset;
+
+    void Seek(uint64_t offset);
+    uint64_t Tell(void) const;
+    bool ReadBytes(void * dest,size_t nBytes);
+    int ReadRecord(bam1_t * read);
+    void CigarFromTag(bam1_t * read);
+    int NextRecord(bam1_t * read);
+
+    void InitIterator(int tid,const vector<pair<hts_pos_t,hts_pos_t> > & regions);
 
 public:
 
@@ -32,8 +82,11 @@ public:
 
     const string & GetFileName(void);
 
-    void SetRegion(const string & chr,hts_pos_t pos,hts_pos_t len);
-    void SetRegions(size_t nRegions,char ** regions);
+    int GetTid(const string & chr) const;      //-1 if the contig is not in the header
+    hts_pos_t GetTargetLen(int tid) const;
+
+    void SetRegion(int tid,hts_pos_t pos,hts_pos_t len);
+    void SetRegions(int tid,const vector<pair<hts_pos_t,hts_pos_t> > & regions);   //Zero based [begin,end) regions
 
     inline int Read(bam1_t * read)
     {
@@ -44,6 +97,14 @@ public:
 
     inline int ReadRegion(bam1_t * read)
     {
+        PhaseTimer timer(PHASE_DECODE);
+
+        if(useBlockCache)
+        {
+            int ret; for(ret=NextRecord(read);ret>=0 && (read->core.flag&excludeFlags)!=0;ret=NextRecord(read));
+            return ret;
+        }
+
         int ret; for(ret=sam_itr_next(handle,readIterator,read);ret>=0 && (read->core.flag&excludeFlags)!=0;ret=sam_itr_next(handle,readIterator,read));
         if(ret<-1) throw runtime_error(string("Error: Could not read region: ")+handle->fn);
         return ret;
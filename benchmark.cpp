@@ -0,0 +1,263 @@
+//----------------------------------------------------------------
+// Name        : benchmark.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Microbenchmark of the pileup kernels on generated reads (Tab separated results to std::out)
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <getopt.h>
+#include "ssw.h"
+#include "pileup_kernels.h"
+//----------------------------------------------------------------
+#define SHORT_OPTIONS "t:k:h"
+#define POOL_BASES      (64UL<<20)  //Bases of generated reads kept in memory per case (Deeper cases reuse the reads)
+#define KNOWN_SNP_RATE  1000        //One known SNP every this many bases
+#define ERROR_RATE      100         //One sequencing error every this many bases
+#define SOFT_CLIP       5
+//----------------------------------------------------------------
+static const size_t readLengths[]={100,150,250,10000,20000};
+static const size_t nReferences[]={2,8,64};
+static const size_t depths[]={100,1000,10000,50000};
+//----------------------------------------------------------------
+static volatile uint64_t sink;  //Keeps the results of the kernels alive
+//----------------------------------------------------------------
+class BenchmarkCase     //Reads of one length and depth on a generated reference window
+{
+private:
+public:
+
+    string reference;
+    FastaEntry fastaEntry;
+    vector<KnownSNP> knownSNPs;
+    vector<unique_ptr<bam1_t,void(*)(bam1_t*)> > reads;     //Pool, read i of the depth is reads[i%reads.size()]
+    vector<string> qnames;                                  //One per fragment of the depth
+
+    BenchmarkCase(size_t readLength,size_t depth,mt19937_64 & random)
+    {
+        static const char bases[]="ACGT";
+
+        hts_pos_t windowLen=hts_pos_t(4*readLength+2*SOFT_CLIP);
+        reference.resize(size_t(windowLen)); for(auto & base : reference) base=bases[random()&3];
+        fastaEntry=FastaEntry(windowLen,reference.data());
+
+        for(hts_pos_t pos=KNOWN_SNP_RATE/2;pos<windowLen;pos+=KNOWN_SNP_RATE) knownSNPs.push_back({pos,{reference[size_t(pos)],bases[random()&3],'\0','\0'}});
+
+        size_t nReads=min(depth,max(size_t(1),POOL_BASES/readLength)); string seq(readLength,'N'),qual(readLength,'\0');
+
+        for(size_t i=0;i<nReads;i++)
+        {
+            bool isClipped=(i&3)==0; hts_pos_t pos=SOFT_CLIP+hts_pos_t(random()%uint64_t(windowLen-hts_pos_t(readLength)-2*SOFT_CLIP));
+
+            for(size_t j=0;j<readLength;j++)
+            {
+                seq[j]=random()%ERROR_RATE==0 ? bases[random()&3] : reference[size_t(pos)-(isClipped ? SOFT_CLIP : 0)+j];
+                qual[j]=char(random()%4==0 ? 20 : 37);
+            }
+
+            uint32_t cigar[2]; size_t nCigar=0;
+            if(isClipped) cigar[nCigar++]=bam_cigar_gen(SOFT_CLIP,BAM_CSOFT_CLIP);
+            cigar[nCigar++]=bam_cigar_gen(readLength-(isClipped ? SOFT_CLIP : 0),BAM_CMATCH);
+
+            char qname[64]; snprintf(qname,sizeof(qname),"BENCH:1:FLOWCELL:1:%lu:%lu",i/2,i);
+
+            unique_ptr<bam1_t,void(*)(bam1_t*)> read(bam_init1(),bam_destroy1);
+            if(read==nullptr || bam_set1(read.get(),strlen(qname),qname,uint16_t((i&1) ? BAM_FREVERSE : 0),0,pos,60,nCigar,cigar,0,pos,0,readLength,seq.data(),qual.data(),0)<0) throw runtime_error("Error: Could not create read");
+            reads.push_back(move(read));
+        }
+
+        for(size_t i=0,nFragments=(depth+1)/2;i<nFragments;i++){char qname[64]; snprintf(qname,sizeof(qname),"BENCH:1:FLOWCELL:1:%lu:%lu",i,random()%100000); qnames.emplace_back(qname);}
+    }
+};
+//----------------------------------------------------------------
+class Result
+{
+private:
+public:
+
+    uint64_t ops;
+    uint64_t alignments;
+    uint64_t bases;
+    double seconds;
+
+    Result(void) : ops(0),alignments(0),bases(0),seconds(0) {}
+};
+//----------------------------------------------------------------
+template<class F> static Result Measure(double minSeconds,F pass)   //Repeats a pass until minSeconds have passed, a pass adds to the result
+{
+    Result result; auto startTime=chrono::steady_clock::now();
+
+    do
+    {
+        pass(result); result.seconds=chrono::duration<double>(chrono::steady_clock::now()-startTime).count();
+    }
+    while(result.seconds<minSeconds);
+
+    return result;
+}
+//----------------------------------------------------------------
+static void PrintResult(const char * kernel,size_t readLength,size_t references,size_t depth,const Result & result)
+{
+    printf("%s\t%lu\t%lu\t%lu\t%lu\t%.3f\t%.1f\t%.1f\n",kernel,readLength,references,depth,result.ops,1e9*result.seconds/double(result.ops),double(result.alignments)/result.seconds,double(result.bases)/result.seconds);
+    fflush(stdout);
+}
+//----------------------------------------------------------------
+static void BenchmarkReads(size_t readLength,size_t depth,double minSeconds,const string & kernel,mt19937_64 & random)
+{
+    BenchmarkCase benchmarkCase(readLength,depth,random); size_t nReads=benchmarkCase.reads.size();
+
+    //----------------------------------------------------------------
+    //Read::Init of the indel pileup (Span and SSW query)
+    //----------------------------------------------------------------
+
+    if(kernel.empty() || kernel=="read_init")
+    {
+        vector<char> query(readLength+1);
+
+        PrintResult("read_init",readLength,0,depth,Measure(minSeconds,[&](Result & result)
+        {
+            for(size_t i=0;i<depth;i++)
+            {
+                const bam1_t * read=benchmarkCase.reads[i%nReads].get(); hts_pos_t readBegin,readEnd;
+                ReadSpan(read,readBegin,readEnd); sink+=uint64_t(readEnd-readBegin)+uint64_t(EncodeQuery(read,30,query.data()));
+            }
+
+            result.ops+=depth; result.bases+=depth*readLength;
+        }));
+    }
+
+    //----------------------------------------------------------------
+    //Mismatch loop of the SNV pileup
+    //----------------------------------------------------------------
+
+    if(kernel.empty() || kernel=="snp_mismatches")
+    {
+        PrintResult("snp_mismatches",readLength,0,depth,Measure(minSeconds,[&](Result & result)
+        {
+            for(size_t i=0;i<depth;i++)
+            {
+                const bam1_t * read=benchmarkCase.reads[i%nReads].get();
+
+                hts_pos_t refPos=read->core.pos; size_t queryPos=0; size_t nMismatches=0;
+
+                for(const uint32_t * cigar=bam_get_cigar(read),*cigarEnd=cigar+read->core.n_cigar;cigar!=cigarEnd;cigar++)
+                {
+                    hts_pos_t opLen=bam_cigar_oplen(*cigar);
+                    if(bam_cigar_op(*cigar)==BAM_CSOFT_CLIP){queryPos+=size_t(opLen); continue;}
+
+                    FastaCursor fastaCursor(benchmarkCase.fastaEntry,refPos);
+                    const KnownSNP * vcfEntry=VCFFile::LowerBound(benchmarkCase.knownSNPs,refPos),* vcfEntryEnd=benchmarkCase.knownSNPs.data()+benchmarkCase.knownSNPs.size();
+
+                    nMismatches+=CountMismatches(bam_get_seq(read),queryPos,fastaCursor,refPos,opLen,vcfEntry,vcfEntryEnd);
+                    refPos+=opLen; queryPos+=size_t(opLen);
+                }
+
+                sink+=nMismatches;
+            }
+
+            result.ops+=depth; result.bases+=depth*readLength;
+        }));
+    }
+
+    //----------------------------------------------------------------
+    //Fragment pairing by query name
+    //----------------------------------------------------------------
+
+    if(kernel.empty() || kernel=="fragment_pairing")
+    {
+        PrintResult("fragment_pairing",readLength,0,depth,Measure(minSeconds,[&](Result & result)
+        {
+            FragmentMap<const bam1_t*[2]> fragments;
+            for(size_t i=0;i<depth;i++) fragments[benchmarkCase.qnames[i/2]][i&1]=benchmarkCase.reads[i%nReads].get();
+            sink+=fragments.size();
+
+            result.ops+=depth;
+        }));
+    }
+}
+//----------------------------------------------------------------
+static void BenchmarkAlign(size_t readLength,size_t references,double minSeconds,mt19937_64 & random)
+{
+    BenchmarkCase benchmarkCase(readLength,1,random); const bam1_t * read=benchmarkCase.reads[0].get();
+
+    //----------------------------------------------------------------
+    //References span the read like the merged read intervals, every other one with an SNV
+    //----------------------------------------------------------------
+
+    hts_pos_t readBegin,readEnd; ReadSpan(read,readBegin,readEnd);
+    hts_pos_t refBegin=max(hts_pos_t(0),readBegin-hts_pos_t(readLength/4)),refEnd=min(benchmarkCase.fastaEntry.len,readEnd+1+hts_pos_t(readLength/4));
+
+    vector<unique_ptr<SSW> > ssws;
+
+    for(size_t i=0;i<references;i++)
+    {
+        string refSeq(benchmarkCase.reference,size_t(refBegin),size_t(refEnd-refBegin));
+        if(i&1) refSeq[random()%refSeq.size()]="ACGT"[random()&3];
+        ssws.emplace_back(new SSW(refSeq));
+    }
+
+    vector<char> query(readLength+1); EncodeQuery(read,30,query.data());
+
+    PrintResult("ssw_align",readLength,references,0,Measure(minSeconds,[&](Result & result)
+    {
+        for(auto & ssw : ssws) sink+=uint64_t(ssw->Align(readLength,query.data()));
+        result.ops+=references; result.alignments+=references; result.bases+=references*readLength;
+    }));
+}
+//----------------------------------------------------------------
+int main(int argc,char * argv[])
+{
+    static struct option longOptions[]=
+    {
+        {"min-time",required_argument,nullptr,'t'},
+        {"kernel",required_argument,nullptr,'k'},
+        {"help",no_argument,nullptr,'h'},
+        {nullptr,0,nullptr,0}
+    };
+
+    double minSeconds=0.2; string kernel;
+
+    try
+    {
+        for(int option;(option=getopt_long(argc,argv,SHORT_OPTIONS,longOptions,nullptr))!=-1;)
+        {
+            switch(option)
+            {
+            case 't': minSeconds=stod(optarg); break;
+            case 'k': kernel=optarg; break;
+            default:
+
+                cerr << "enhanced_ABS_benchmark [options] > results.tsv" << endl;
+                cerr << "-t --min-time <float>  Minimum time per case in seconds (optional default=0.2)" << endl;
+                cerr << "-k --kernel <text>     Only this kernel: read_init, snp_mismatches, fragment_pairing or ssw_align (optional)" << endl;
+                cerr << "-h --help              This help" << endl;
+                return option=='h' ? 0 : 1;
+            }
+        }
+
+        mt19937_64 random(42);
+
+        printf("kernel\tread_length\treferences\tdepth\tops\tns_per_op\talignments_per_s\tbases_per_s\n");
+
+        for(size_t readLength : readLengths)
+        {
+            for(size_t depth : depths) BenchmarkReads(readLength,depth,minSeconds,kernel,random);
+            if(kernel.empty() || kernel=="ssw_align") for(size_t references : nReferences) BenchmarkAlign(readLength,references,minSeconds,random);
+        }
+    }
+    catch(const exception & e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
+//----------------------------------------------------------------
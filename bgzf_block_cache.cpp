@@ -0,0 +1,186 @@
+//----------------------------------------------------------------
+// Name        : bgzf_block_cache.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Process wide cache of decompressed bgzf blocks shared by all bam files in all threads
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <cstring>
+#include <unistd.h>
+#include <libdeflate.h>
+#include "bgzf_block_cache.h"
+//----------------------------------------------------------------
+#define BGZF_MAX_BLOCK_SIZE 65536
+#define BGZF_HEADER_SIZE    18
+#define BGZF_FOOTER_SIZE    8
+//----------------------------------------------------------------
+class Decompressor  //One libdeflate decompressor per thread
+{
+private:
+public:
+
+    libdeflate_decompressor * handle;
+    uint8_t * compressed;
+
+    Decompressor(void) : handle(libdeflate_alloc_decompressor()),compressed((uint8_t*)malloc(BGZF_MAX_BLOCK_SIZE)) {}
+    ~Decompressor(void) {libdeflate_free_decompressor(handle); free(compressed);}
+};
+//----------------------------------------------------------------
+static inline uint16_t LoadU16(const uint8_t * p){return uint16_t(p[0])|uint16_t(p[1]<<8);}
+static inline uint32_t LoadU32(const uint8_t * p){return uint32_t(p[0])|(uint32_t(p[1])<<8)|(uint32_t(p[2])<<16)|(uint32_t(p[3])<<24);}
+//----------------------------------------------------------------
+static thread_local uint64_t threadBytesDecompressed=0;
+//----------------------------------------------------------------
+BGZFBlockCache::BGZFBlockCache(void) : maxShardSize(0),hits(0),misses(0),bytesDecompressed(0),nextFileID(0) {}
+//----------------------------------------------------------------
+BGZFBlockCache & BGZFBlockCache::Instance(void)
+{
+    static BGZFBlockCache instance;
+    return instance;
+}
+//----------------------------------------------------------------
+void BGZFBlockCache::SetMaxSize(size_t maxSize)
+{
+    maxShardSize.store(maxSize/nShards,memory_order_relaxed);
+}
+//----------------------------------------------------------------
+void BGZFBlockCache::Clear(void)
+{
+    for(auto & shard : shards)
+    {
+        lock_guard<mutex> guard(shard.lock);
+        shard.blocks.clear(); shard.index.clear(); shard.size=0;
+    }
+}
+//----------------------------------------------------------------
+size_t BGZFBlockCache::GetSize(void)
+{
+    size_t size=0;
+
+    for(auto & shard : shards)
+    {
+        lock_guard<mutex> guard(shard.lock);
+        size+=shard.size;
+    }
+
+    return size;
+}
+//----------------------------------------------------------------
+uint32_t BGZFBlockCache::RegisterFile(const string & filename,const string & identity)
+{
+    lock_guard<mutex> guard(filesLock);
+
+    auto & file=files[filename]; if(file.first==identity && file.first.empty()==false) return file.second;
+    if(nextFileID==UINT32_MAX) throw runtime_error("Error: Too many bam file versions registered in the block cache");
+
+    file.first=identity; file.second=nextFileID++;
+    return file.second;
+}
+//----------------------------------------------------------------
+shared_ptr<const BGZFBlock> BGZFBlockCache::Load(int fd,uint64_t coffset)
+{
+    static thread_local Decompressor decompressor;
+
+    //----------------------------------------------------------------
+    //Read the compressed block (A bgzf block is never larger than 64KB)
+    //----------------------------------------------------------------
+
+    uint8_t * compressed=decompressor.compressed;
+
+    ssize_t nBytes=pread(fd,compressed,BGZF_MAX_BLOCK_SIZE,off_t(coffset));
+
+    if(nBytes==0) return nullptr;   //End of file
+    if(nBytes<BGZF_HEADER_SIZE) throw runtime_error("Error: Truncated bgzf block");
+
+    if(compressed[0]!=31 || compressed[1]!=139 || compressed[2]!=8 || (compressed[3]&4)==0) throw runtime_error("Error: Invalid bgzf block header");
+
+    size_t xLen=LoadU16(compressed+10); size_t blockSize=0;
+
+    for(size_t i=12,iEnd=min(size_t(nBytes),12+xLen);i+4<=iEnd;i+=4+LoadU16(compressed+i+2))
+    {
+        if(compressed[i]==66 && compressed[i+1]==67 && LoadU16(compressed+i+2)==2) {blockSize=size_t(LoadU16(compressed+i+4))+1; break;}
+    }
+
+    if(blockSize==0) throw runtime_error("Error: Invalid bgzf block header (No BC field)");
+    if(blockSize>size_t(nBytes) || blockSize<12+xLen+BGZF_FOOTER_SIZE) throw runtime_error("Error: Truncated bgzf block");
+
+    //----------------------------------------------------------------
+    //Inflate
+    //----------------------------------------------------------------
+
+    const uint8_t * footer=compressed+blockSize-BGZF_FOOTER_SIZE;
+    uint32_t crc=LoadU32(footer); size_t iSize=LoadU32(footer+4);
+
+    if(iSize>BGZF_MAX_BLOCK_SIZE) throw runtime_error("Error: Invalid bgzf block size");
+
+    auto block=make_shared<BGZFBlock>(); block->coffset=coffset; block->csize=blockSize; block->data.resize(iSize);
+
+    if(iSize>0)
+    {
+        size_t actualSize;
+        if(libdeflate_deflate_decompress(decompressor.handle,compressed+12+xLen,blockSize-12-xLen-BGZF_FOOTER_SIZE,block->data.data(),iSize,&actualSize)!=LIBDEFLATE_SUCCESS || actualSize!=iSize) throw runtime_error("Error: Could not inflate bgzf block");
+        if(libdeflate_crc32(0,block->data.data(),iSize)!=crc) throw runtime_error("Error: CRC mismatch in bgzf block");
+    }
+
+    bytesDecompressed.fetch_add(iSize,memory_order_relaxed); threadBytesDecompressed+=iSize;
+    return block;
+}
+//----------------------------------------------------------------
+uint64_t BGZFBlockCache::GetThreadBytesDecompressed(void)
+{
+    return threadBytesDecompressed;
+}
+//----------------------------------------------------------------
+shared_ptr<const BGZFBlock> BGZFBlockCache::Get(uint32_t fileID,int fd,uint64_t coffset)
+{
+    BGZFBlockKey key(fileID,coffset);
+    Shard & shard=shards[BGZFBlockKeyHash()(key)>>58];
+
+    //----------------------------------------------------------------
+    //Lookup
+    //----------------------------------------------------------------
+
+    {
+        lock_guard<mutex> guard(shard.lock);
+
+        auto it=shard.index.find(key);
+
+        if(it!=shard.index.end())
+        {
+            shard.blocks.splice(shard.blocks.begin(),shard.blocks,it->second);
+            hits.fetch_add(1,memory_order_relaxed);
+            return it->second->second;
+        }
+    }
+
+    misses.fetch_add(1,memory_order_relaxed);
+
+    //----------------------------------------------------------------
+    //Load outside the lock so other threads can keep using the shard
+    //----------------------------------------------------------------
+
+    shared_ptr<const BGZFBlock> block=Load(fd,coffset);
+
+    size_t maxSize=maxShardSize.load(memory_order_relaxed);
+    if(block==nullptr || maxSize==0) return block;
+
+    //----------------------------------------------------------------
+    //Insert and evict least recently used blocks
+    //----------------------------------------------------------------
+
+    lock_guard<mutex> guard(shard.lock);
+
+    if(shard.index.count(key)!=0) return block;     //Another thread inflated the same block in the mean time
+
+    shard.blocks.emplace_front(key,block); shard.index.emplace(key,shard.blocks.begin()); shard.size+=block->data.size();
+
+    while(shard.size>maxSize && shard.blocks.size()>1)
+    {
+        auto & last=shard.blocks.back();
+        shard.size-=last.second->data.size(); shard.index.erase(last.first); shard.blocks.pop_back();
+    }
+
+    return block;
+}
+//----------------------------------------------------------------
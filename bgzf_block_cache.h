@@ -0,0 +1,101 @@
+//----------------------------------------------------------------
+#ifndef BGZF_BLOCK_CACHE_H
+#define BGZF_BLOCK_CACHE_H
+//----------------------------------------------------------------
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+class BGZFBlock
+{
+private:
+public:
+
+    uint64_t coffset;       //Compressed offset of the block in the file
+    uint64_t csize;         //Compressed size of the block (Next block starts at coffset+csize)
+    vector<uint8_t> data;   //Decompressed block
+};
+//----------------------------------------------------------------
+class BGZFBlockKey
+{
+private:
+public:
+
+    uint32_t fileID;
+    uint64_t coffset;
+
+    BGZFBlockKey(uint32_t fileID,uint64_t coffset) : fileID(fileID),coffset(coffset) {}
+
+    bool operator==(const BGZFBlockKey & key) const {return fileID==key.fileID && coffset==key.coffset;}
+};
+//----------------------------------------------------------------
+class BGZFBlockKeyHash
+{
+private:
+public:
+
+    size_t operator()(const BGZFBlockKey & key) const {return size_t((key.coffset^(uint64_t(key.fileID)*0xC2B2AE3D27D4EB4FULL))*0x9E3779B97F4A7C15ULL);}
+};
+//----------------------------------------------------------------
+class BGZFBlockCache    //Process wide size bounded LRU cache of decompressed bgzf blocks keyed by (file,compressed offset)
+{
+private:
+
+    typedef list<pair<BGZFBlockKey,shared_ptr<const BGZFBlock> > > BlockList;
+
+    class Shard
+    {
+    private:
+    public:
+
+        mutex lock;
+        size_t size;
+        BlockList blocks;   //Most recently used first
+        unordered_map<BGZFBlockKey,BlockList::iterator,BGZFBlockKeyHash> index;
+
+        Shard(void) : size(0) {}
+    };
+
+    static const size_t nShards=64;
+
+    atomic<size_t> maxShardSize;
+    atomic<uint64_t> hits;
+    atomic<uint64_t> misses;
+    atomic<uint64_t> bytesDecompressed;
+
+    Shard shards[nShards];
+
+    mutex filesLock;
+    uint32_t nextFileID;
+    unordered_map<string,pair<string,uint32_t> > files;    //Identity and ID by file name (A rewritten file gets a new ID, the blocks of the old one age out)
+
+    BGZFBlockCache(void);
+
+    shared_ptr<const BGZFBlock> Load(int fd,uint64_t coffset);
+
+public:
+
+    static BGZFBlockCache & Instance(void);
+
+    void SetMaxSize(size_t maxSize);
+    void Clear(void);   //Drop all cached blocks (Files stay registered)
+    uint32_t RegisterFile(const string & filename,const string & identity);
+
+    shared_ptr<const BGZFBlock> Get(uint32_t fileID,int fd,uint64_t coffset);
+
+    uint64_t GetHits(void) const {return hits.load(memory_order_relaxed);}
+    uint64_t GetMisses(void) const {return misses.load(memory_order_relaxed);}
+    uint64_t GetBytesDecompressed(void) const {return bytesDecompressed.load(memory_order_relaxed);}
+    size_t GetSize(void);   //Bytes of the cached blocks
+
+    static uint64_t GetThreadBytesDecompressed(void);   //Bytes inflated by the calling thread
+};
+//----------------------------------------------------------------
+#endif // BGZF_BLOCK_CACHE_H
@@ -6,155 +6,527 @@
 // Description : Memory mapped fasta file implementation (Posix)
 //----------------------------------------------------------------
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <errno.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <immintrin.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "faidx.h"
 #include "fasta_file.h"
 //----------------------------------------------------------------
-FastaFile::FastaFile(void) : rawFile(MAP_FAILED){}
+//Reference cache layout: header, contig table (fai order), contig names, then the sequence data (Page aligned)
+//Raw caches hold one byte per base, packed caches four bases per byte with the N/IUPAC runs appended after all contigs
 //----------------------------------------------------------------
-FastaFile::FastaFile(const string & filename) : rawFile(MAP_FAILED) {Open(filename);}
+#define CACHE_MAGIC "EABSREF\0"
+#define CACHE_VERSION 1
+#define CACHE_ALIGNMENT 4096
 //----------------------------------------------------------------
-FastaFile::~FastaFile(void)
+class CacheHeader
 {
-    if(this->rawFile!=MAP_FAILED) munmap(this->rawFile,this->totalSize);
+private:
+public:
+
+    char magic[8];
+    uint32_t version;
+    uint32_t packed;
+    uint64_t sourceSize;    //Size and modification time of the fasta file the cache was built from
+    int64_t sourceMTime;
+    int64_t sourceMTimeNs;
+    uint64_t nContigs;
+    uint64_t namesSize;
+    uint64_t checksum;      //Over all fields above, the contig table and the names
+};
+//----------------------------------------------------------------
+class CacheContig
+{
+private:
+public:
+
+    uint64_t nameOffset;
+    uint64_t len;
+    uint64_t seqOffset;
+    uint64_t masksOffset;
+    uint64_t nMasks;
+};
+//----------------------------------------------------------------
+static uint64_t Checksum(const CacheHeader & header,const CacheContig * contigs,const char * names)     //64 bit FNV-1a
+{
+    uint64_t checksum=14695981039346656037ULL;
+
+    auto update=[&checksum](const void * data,size_t size){for(const uint8_t *p=(const uint8_t*)data,*pEnd=p+size;p<pEnd;p++){checksum^=*p; checksum*=1099511628211ULL;}};
+
+    update(&header,offsetof(CacheHeader,checksum));
+    update(contigs,size_t(header.nContigs)*sizeof(CacheContig));
+    update(names,size_t(header.namesSize));
+
+    return checksum;
+}
+//----------------------------------------------------------------
+static uint64_t InitCache(faidx_t * fai,const struct stat & sourceStat,bool packed,CacheHeader & header,vector<CacheContig> & contigs,string & names)   //Returns the offset of the sequence data
+{
+    size_t nSeq=size_t(faidx_nseq(fai));
+
+    memset(&header,0,sizeof(header)); memcpy(header.magic,CACHE_MAGIC,8);
+    header.version=CACHE_VERSION; header.packed=packed;
+    header.sourceSize=uint64_t(sourceStat.st_size); header.sourceMTime=int64_t(sourceStat.st_mtim.tv_sec); header.sourceMTimeNs=int64_t(sourceStat.st_mtim.tv_nsec);
+    header.nContigs=nSeq;
+
+    contigs.assign(nSeq,CacheContig()); names.clear();
+
+    for(size_t i=0;i<nSeq;i++)
+    {
+        const char * entryName=faidx_iseq(fai,int(i));
+
+        CacheContig & contig=contigs[i]; memset(&contig,0,sizeof(contig));
+        contig.nameOffset=names.size(); contig.len=uint64_t(faidx_seq_len64(fai,entryName));
+        names.append(entryName,strlen(entryName)+1);
+    }
+
+    header.namesSize=names.size();
+
+    return (sizeof(CacheHeader)+nSeq*sizeof(CacheContig)+names.size()+CACHE_ALIGNMENT-1)&~uint64_t(CACHE_ALIGNMENT-1);
+}
+//----------------------------------------------------------------
+size_t FastaEntry::FindMask(hts_pos_t pos) const
+{
+    return size_t(upper_bound(masks,masks+nMasks,pos,[](hts_pos_t pos,const FastaMask & mask){return pos<mask.end;})-masks);
 }
 //----------------------------------------------------------------
-void FastaFile::Open(const string & filename)
+char FastaEntry::Base(hts_pos_t pos) const
 {
-    string prefix=filename.substr(0,filename.find_last_of('.'));
+    if(packed==nullptr) return seq[pos];
+
+    size_t mask=FindMask(pos);
+    if(mask<nMasks && masks[mask].begin<=pos) return masks[mask].base;
+
+    return "ACGT"[(packed[pos>>2]>>((pos&3)<<1))&3];
+}
+//----------------------------------------------------------------
+string FastaEntry::Sequence(hts_pos_t begin,hts_pos_t len) const
+{
+    if(packed==nullptr) return string(seq+begin,size_t(len));
 
     //----------------------------------------------------------------
-    //Try to create a lock file (Try it for 2 minutes)
+    //Expand four bases per byte
     //----------------------------------------------------------------
 
-    int lockFileID;
-    string lockFilename=prefix+".raw.lock";
-
-    for(size_t attempts=120;;)
+    static const struct Table
     {
-        if((lockFileID=open(lockFilename.c_str(),O_EXCL|O_CREAT|O_WRONLY,0664))!=-1) break;
-        if(--attempts==0) throw runtime_error(string("Error: Could not create lock file (Maybe it already exists): ")+lockFilename);
-        sleep(1);
+        char bases[256][4];
+        Table(void){for(size_t i=0;i<256;i++) for(size_t j=0;j<4;j++) bases[i][j]="ACGT"[(i>>(j<<1))&3];}
     }
+    table;
+
+    string sequence(size_t(len),'N'); char * dest=&sequence[0];
+
+    hts_pos_t pos=begin,end=begin+len;
+
+    for(;pos<end && (pos&3)!=0;pos++,dest++) *dest=table.bases[packed[pos>>2]][pos&3];
+    for(;pos+4<=end;pos+=4,dest+=4) memcpy(dest,table.bases[packed[pos>>2]],4);
+    for(;pos<end;pos++,dest++) *dest=table.bases[packed[pos>>2]][pos&3];
 
     //----------------------------------------------------------------
-    //Open fasta index
+    //Apply N/IUPAC runs
     //----------------------------------------------------------------
 
-    faidx_t * fai=fai_load(filename.c_str());
+    for(size_t mask=FindMask(begin);mask<nMasks && masks[mask].begin<end;mask++)
+    {
+        hts_pos_t maskBegin=max(masks[mask].begin,begin),maskEnd=min(masks[mask].end,end);
+        memset(&sequence[size_t(maskBegin-begin)],masks[mask].base,size_t(maskEnd-maskBegin));
+    }
 
-    if(fai==nullptr)
+    return sequence;
+}
+//----------------------------------------------------------------
+static void UpperCase(const char * src,size_t len,char * dest)   //dest may equal src
+{
+    const __m256i lowerA=_mm256_set1_epi8('a'-1),lowerZ=_mm256_set1_epi8('z'+1),caseBit=_mm256_set1_epi8(0x20);
+
+    size_t i=0;
+
+    for(;i+32<=len;i+=32)
     {
-        close(lockFileID); remove(lockFilename.c_str());
-        throw runtime_error(string("Error: Could not open fasta index: ")+filename);
+        __m256i bases=_mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i isLower=_mm256_and_si256(_mm256_cmpgt_epi8(bases,lowerA),_mm256_cmpgt_epi8(lowerZ,bases));
+        _mm256_storeu_si256((__m256i*)(dest+i),_mm256_xor_si256(bases,_mm256_and_si256(isLower,caseBit)));
     }
 
-    int nSeq=faidx_nseq(fai); size_t totalSize=0;
-    for(int i=0;i<nSeq;i++) totalSize+=size_t(faidx_seq_len64(fai,faidx_iseq(fai,i)));
+    for(;i<len;i++) dest[i]=char(toupper(src[i]));
+}
+//----------------------------------------------------------------
+static bool WriteAt(int fileID,const void * data,size_t size,off_t offset)
+{
+    for(const char * p=(const char*)data;size>0;)
+    {
+        ssize_t written=pwrite(fileID,p,size,offset);
+        if(written<=0) return false;
+        p+=written; size-=size_t(written); offset+=written;
+    }
 
+    return true;
+}
+//----------------------------------------------------------------
+static int CreateTemp(const string & filename,string & tempFilename)   //Unique temporary file next to filename (Published later with rename)
+{
+    tempFilename=filename+".XXXXXX";
+
+    int tempFileID=mkstemp(&tempFilename[0]);
+
+    if(tempFileID==-1) throw runtime_error(string("Error: Could not create temporary file: ")+tempFilename);
+
+    fchmod(tempFileID,0664);
+    return tempFileID;
+}
+//----------------------------------------------------------------
+static bool IsReplaceable(const string & filename)     //True if filename does not exist or starts with the cache magic (Never replace a file this tool did not write)
+{
+    int fileID=open(filename.c_str(),O_RDONLY);
+
+    if(fileID==-1) return errno==ENOENT;
+
+    char magic[8]; bool isCache=pread(fileID,magic,8,0)==8 && memcmp(magic,CACHE_MAGIC,8)==0;
+    close(fileID);
+
+    return isCache;
+}
+//----------------------------------------------------------------
+static void Publish(int tempFileID,const string & tempFilename,const string & filename)
+{
+    if(fsync(tempFileID)==-1 || close(tempFileID)==-1 || rename(tempFilename.c_str(),filename.c_str())==-1)
+    {
+        remove(tempFilename.c_str());
+        throw runtime_error(string("Error: Could not write file: ")+filename);
+    }
+}
+//----------------------------------------------------------------
+FastaFile::FastaFile(void) : rawFile(MAP_FAILED){}
+//----------------------------------------------------------------
+FastaFile::FastaFile(const string & filename,bool packed,size_t nThreads) : rawFile(MAP_FAILED) {Open(filename,packed,nThreads);}
+//----------------------------------------------------------------
+FastaFile::~FastaFile(void)
+{
+    if(this->rawFile!=MAP_FAILED) munmap(this->rawFile,this->totalSize);
+}
+//----------------------------------------------------------------
+void FastaFile::FetchContigs(const string & filename,faidx_t * fai,size_t nThreads,const function<void(size_t,char*,hts_pos_t)> & process)
+{
     //----------------------------------------------------------------
-    //Create new raw file to only hold the sequence
+    //Fetch and uppercase contigs in parallel (Every thread has its own fasta index handle, largest contigs first)
     //----------------------------------------------------------------
 
-    map<string,FastaEntry> entries;
+    size_t nSeq=size_t(faidx_nseq(fai));
 
-    string rawFilename=prefix+".raw"; int rawFileID=open(rawFilename.c_str(),O_RDONLY);
+    vector<size_t> order(nSeq); for(size_t i=0;i<nSeq;i++) order[i]=i;
+    sort(order.begin(),order.end(),[fai](size_t a,size_t b){return faidx_seq_len64(fai,faidx_iseq(fai,int(a)))>faidx_seq_len64(fai,faidx_iseq(fai,int(b)));});
 
-    if(rawFileID==-1)
-    {
-        rawFileID=open(rawFilename.c_str(),O_RDWR|O_CREAT|O_TRUNC,0664);
+    atomic<size_t> next(0); exception_ptr error; mutex errorLock;
 
-        if(rawFileID==-1)
+    auto fetch=[&](void)
+    {
+        try
         {
-            fai_destroy(fai);
-            close(lockFileID); remove(lockFilename.c_str());
-            throw runtime_error(string("Error: Could not create raw file: ")+rawFilename);
-        }
+            faidx_t * threadFai=fai_load(filename.c_str());
+
+            if(threadFai==nullptr) throw runtime_error(string("Error: Could not open fasta index: ")+filename);
 
-        if(ftruncate(rawFileID,__off_t(totalSize))==-1)
+            for(size_t i;(i=next.fetch_add(1))<nSeq;)
+            {
+                const char * entryName=faidx_iseq(threadFai,int(order[i]));
+                hts_pos_t entryLen; char * tempSeq=fai_fetch64(threadFai,entryName,&entryLen);
+
+                if(tempSeq==nullptr)
+                {
+                    fai_destroy(threadFai);
+                    throw runtime_error(string("Error: Could not fetch sequence: ")+entryName);
+                }
+
+                try
+                {
+                    process(order[i],tempSeq,entryLen);
+                }
+                catch(...)
+                {
+                    free(tempSeq); fai_destroy(threadFai);
+                    throw;
+                }
+
+                free(tempSeq);
+            }
+
+            fai_destroy(threadFai);
+        }
+        catch(...)
         {
-            close(rawFileID);
-            fai_destroy(fai);
-            close(lockFileID); remove(lockFilename.c_str());
-            throw runtime_error(string("Error: Could not truncate raw file: ")+rawFilename);
+            next=nSeq;
+            lock_guard<mutex> guard(errorLock); if(error==nullptr) error=current_exception();
         }
+    };
 
-        void * rawFile=mmap(nullptr,totalSize,PROT_READ|PROT_WRITE,MAP_SHARED,rawFileID,0);
+    vector<thread> threads; for(size_t i=1;i<min(max(nThreads,size_t(1)),nSeq);i++) threads.emplace_back(fetch);
+    fetch(); for(auto & thread : threads) thread.join();
 
-        close(rawFileID);
+    if(error!=nullptr) rethrow_exception(error);
+}
+//----------------------------------------------------------------
+void FastaFile::CreateRaw(const string & filename,const string & rawFilename,faidx_t * fai,size_t nThreads,const struct stat & sourceStat)
+{
+    CacheHeader header; vector<CacheContig> contigs; string names;
 
-        if(rawFile==MAP_FAILED)
-        {
-            fai_destroy(fai);
-            close(lockFileID); remove(lockFilename.c_str());
-            throw runtime_error(string("Error: Could not memory map raw file: ")+rawFilename);
-        }
+    uint64_t offset=InitCache(fai,sourceStat,false,header,contigs,names);
+    for(auto & contig : contigs){contig.seqOffset=offset; offset+=contig.len;}
+
+    header.checksum=Checksum(header,contigs.data(),names.data());
+
+    size_t totalSize=size_t(offset);
+
+    //----------------------------------------------------------------
+    //Create temporary raw file
+    //----------------------------------------------------------------
+
+    string tempFilename; int tempFileID=CreateTemp(rawFilename,tempFilename);
+
+    void * rawFile=ftruncate(tempFileID,__off_t(totalSize))==-1 ? MAP_FAILED : mmap(nullptr,totalSize,PROT_READ|PROT_WRITE,MAP_SHARED,tempFileID,0);
+
+    if(rawFile==MAP_FAILED)
+    {
+        close(tempFileID); remove(tempFilename.c_str());
+        throw runtime_error(string("Error: Could not create raw file: ")+rawFilename);
+    }
+
+    char * data=(char*)rawFile;
+
+    memcpy(data,&header,sizeof(header));
+    memcpy(data+sizeof(header),contigs.data(),contigs.size()*sizeof(CacheContig));
+    memcpy(data+sizeof(header)+contigs.size()*sizeof(CacheContig),names.data(),names.size());
+
+    try
+    {
+        FetchContigs(filename,fai,nThreads,[data,&contigs](size_t i,char * seq,hts_pos_t len){UpperCase(seq,size_t(len),data+contigs[i].seqOffset);});
+    }
+    catch(...)
+    {
+        munmap(rawFile,totalSize); close(tempFileID); remove(tempFilename.c_str());
+        throw;
+    }
+
+    munmap(rawFile,totalSize);
+    Publish(tempFileID,tempFilename,rawFilename);
+}
+//----------------------------------------------------------------
+void FastaFile::CreatePacked(const string & filename,const string & packedFilename,faidx_t * fai,size_t nThreads,const struct stat & sourceStat)
+{
+    //----------------------------------------------------------------
+    //Packed bases of every contig are placed first (Sizes known up front), the N/IUPAC runs are appended once all contigs are done
+    //----------------------------------------------------------------
+
+    CacheHeader header; vector<CacheContig> contigs; string names;
+
+    uint64_t offset=InitCache(fai,sourceStat,true,header,contigs,names);
+    for(auto & contig : contigs){contig.seqOffset=offset; offset=(offset+((contig.len+3)>>2)+7)&~uint64_t(7);}
 
-        char * entrySeq=(char*)rawFile;
+    size_t nSeq=contigs.size(); vector<vector<FastaMask> > masks(nSeq);
 
-        for(int i=0;i<nSeq;i++)
+    string tempFilename; int tempFileID=CreateTemp(packedFilename,tempFilename);
+
+    try
+    {
+        FetchContigs(filename,fai,nThreads,[tempFileID,&contigs,&masks,&packedFilename](size_t i,char * seq,hts_pos_t len)
         {
-            const char * entryName=faidx_iseq(fai,i);
-            hts_pos_t entryLen; char * tempSeq=fai_fetch64(fai,entryName,&entryLen);
+            UpperCase(seq,size_t(len),seq);
+
+            vector<uint8_t> packed(size_t((len+3)>>2),0); vector<FastaMask> & contigMasks=masks[i];
 
-            if(tempSeq==nullptr)
+            for(hts_pos_t pos=0;pos<len;pos++)
             {
-                fai_destroy(fai);
-                close(lockFileID); remove(lockFilename.c_str());
-                throw runtime_error(string("Error: Could not fetch sequence: ")+entryName);
+                char base=seq[pos]; uint8_t code=fastaBase2Code[uint8_t(base)];
+
+                if(code<4) {packed[size_t(pos>>2)]|=uint8_t(code<<((pos&3)<<1)); continue;}
+
+                if(contigMasks.empty()==false && contigMasks.back().end==pos && contigMasks.back().base==base) {contigMasks.back().end++; continue;}
+
+                FastaMask mask; memset(&mask,0,sizeof(mask)); mask.begin=pos; mask.end=pos+1; mask.base=base;
+                contigMasks.push_back(mask);
             }
 
-            for(char *src=tempSeq,*srcEnd=tempSeq+entryLen,*dest=entrySeq;src<srcEnd;src++,dest++){*dest=toupper(*src);}
+            if(WriteAt(tempFileID,packed.data(),packed.size(),off_t(contigs[i].seqOffset))==false) throw runtime_error(string("Error: Could not write packed reference file: ")+packedFilename);
+        });
 
-            free(tempSeq);
+        //----------------------------------------------------------------
+        //Append runs, then write header, contig table and names
+        //----------------------------------------------------------------
 
-            entries.emplace(entryName,FastaEntry(entryLen,entrySeq));
-            entrySeq+=entryLen;
+        for(size_t i=0;i<nSeq;i++)
+        {
+            CacheContig & contig=contigs[i];
+            contig.masksOffset=offset; contig.nMasks=masks[i].size(); offset+=masks[i].size()*sizeof(FastaMask);
+
+            if(WriteAt(tempFileID,masks[i].data(),masks[i].size()*sizeof(FastaMask),off_t(contig.masksOffset))==false) throw runtime_error(string("Error: Could not write packed reference file: ")+packedFilename);
         }
 
-        fai_destroy(fai);
+        header.checksum=Checksum(header,contigs.data(),names.data());
+
+        off_t tableOffset=off_t(sizeof(header)),namesOffset=off_t(sizeof(header)+nSeq*sizeof(CacheContig));
+
+        if(ftruncate(tempFileID,off_t(offset))==-1 || WriteAt(tempFileID,&header,sizeof(header),0)==false || WriteAt(tempFileID,contigs.data(),nSeq*sizeof(CacheContig),tableOffset)==false || WriteAt(tempFileID,names.data(),names.size(),namesOffset)==false)
+            throw runtime_error(string("Error: Could not write packed reference file: ")+packedFilename);
+    }
+    catch(...)
+    {
+        close(tempFileID); remove(tempFilename.c_str());
+        throw;
+    }
+
+    Publish(tempFileID,tempFilename,packedFilename);
+}
+//----------------------------------------------------------------
+bool FastaFile::OpenCache(const string & cacheFilename,bool packed,const struct stat & sourceStat)
+{
+    //----------------------------------------------------------------
+    //Returns false if the cache does not exist or is stale (Built from another version of the fasta file) or damaged
+    //----------------------------------------------------------------
+
+    int cacheFileID=open(cacheFilename.c_str(),O_RDONLY);
+
+    if(cacheFileID==-1) return false;
+
+    struct stat cacheFileStat;
+
+    if(fstat(cacheFileID,&cacheFileStat)==-1 || size_t(cacheFileStat.st_size)<sizeof(CacheHeader)) {close(cacheFileID); return false;}
 
-        if(this->rawFile!=MAP_FAILED) munmap(this->rawFile,this->totalSize);
-        this->totalSize=totalSize; this->rawFile=rawFile;
-        this->entries=entries;
+    size_t totalSize=size_t(cacheFileStat.st_size);
+    void * rawFile=mmap(nullptr,totalSize,PROT_READ,MAP_SHARED,cacheFileID,0);
+
+    close(cacheFileID);
+
+    if(rawFile==MAP_FAILED) throw runtime_error(string("Error: Could not memory map reference cache: ")+cacheFilename);
+
+    madvise(rawFile,totalSize,MADV_RANDOM);  //Only pull in what is touched until WillNeed is called for a contig
+
+    //----------------------------------------------------------------
+    //Check header, then every contig against the file size
+    //----------------------------------------------------------------
 
-        close(lockFileID); remove(lockFilename.c_str());
+    const char * data=(const char*)rawFile;
+    const CacheHeader & header=*(const CacheHeader*)data;
 
-        return;
+    bool valid=memcmp(header.magic,CACHE_MAGIC,8)==0 && header.version==CACHE_VERSION && header.packed==uint32_t(packed) &&
+               header.sourceSize==uint64_t(sourceStat.st_size) && header.sourceMTime==int64_t(sourceStat.st_mtim.tv_sec) && header.sourceMTimeNs==int64_t(sourceStat.st_mtim.tv_nsec) &&
+               header.nContigs<=(totalSize-sizeof(CacheHeader))/sizeof(CacheContig) && header.namesSize<=totalSize-sizeof(CacheHeader)-header.nContigs*sizeof(CacheContig);
+
+    const CacheContig * contigs=(const CacheContig*)(data+sizeof(CacheHeader));
+    const char * names=data+sizeof(CacheHeader)+header.nContigs*sizeof(CacheContig);
+
+    valid=valid && (header.namesSize==0 || names[header.namesSize-1]=='\0') && Checksum(header,contigs,names)==header.checksum;
+
+    for(size_t i=0;valid && i<size_t(header.nContigs);i++)
+    {
+        const CacheContig & contig=contigs[i];
+        uint64_t seqSize=packed ? (contig.len+3)>>2 : contig.len;
+
+        valid=contig.nameOffset<header.namesSize && contig.seqOffset<=totalSize && seqSize<=totalSize-contig.seqOffset &&
+              (packed==false || (contig.masksOffset<=totalSize && contig.nMasks<=(totalSize-contig.masksOffset)/sizeof(FastaMask)));
     }
 
+    if(valid==false) {munmap(rawFile,totalSize); return false;}
+
     //----------------------------------------------------------------
-    //Open existing raw file
+    //Create entries straight from the contig table
     //----------------------------------------------------------------
 
-    void * rawFile=mmap(nullptr,size_t(totalSize),PROT_READ,MAP_SHARED,rawFileID,0);
+    size_t nContigs=size_t(header.nContigs);
 
-    close(rawFileID);
+    this->names.clear(); this->entries.clear(); this->contigIDs.clear();
+    this->names.reserve(nContigs); this->entries.reserve(nContigs); this->contigIDs.reserve(nContigs);
 
-    if(rawFile==MAP_FAILED)
+    for(size_t i=0;i<nContigs;i++)
     {
-        fai_destroy(fai);
-        close(lockFileID); remove(lockFilename.c_str());
-        throw runtime_error(string("Error: Could not memory map raw file: ")+rawFilename);
+        const CacheContig & contig=contigs[i];
+
+        this->names.emplace_back(names+contig.nameOffset); this->contigIDs.emplace(this->names.back(),int(i));
+
+        if(packed) this->entries.emplace_back(hts_pos_t(contig.len),(const uint8_t*)data+contig.seqOffset,(const FastaMask*)(data+contig.masksOffset),size_t(contig.nMasks));
+        else this->entries.emplace_back(hts_pos_t(contig.len),data+contig.seqOffset);
     }
 
-    char * entrySeq=(char*)rawFile;
+    if(this->rawFile!=MAP_FAILED) munmap(this->rawFile,this->totalSize);
+    this->totalSize=totalSize; this->rawFile=rawFile;
+
+    return true;
+}
+//----------------------------------------------------------------
+void FastaFile::Open(const string & filename,bool packed,size_t nThreads)
+{
+    struct stat sourceStat;
+
+    if(stat(filename.c_str(),&sourceStat)==-1) throw runtime_error(string("Error: Could not open fasta file: ")+filename);
+
+    //----------------------------------------------------------------
+    //Open the raw (One byte per base) or packed (Two bits per base) cache without touching the fasta index if it is up to date
+    //----------------------------------------------------------------
+
+    string cacheFilename=filename.substr(0,filename.find_last_of('.'))+(packed ? ".eabs.2bit" : ".raw");   //Not .2bit, that name belongs to the UCSC files often found next to the fasta file
 
-    for(int i=0;i<nSeq;i++)
+    if(OpenCache(cacheFilename,packed,sourceStat)) return;
+
+    //----------------------------------------------------------------
+    //(Re)build the cache (Published with an atomic rename so no lock is needed)
+    //----------------------------------------------------------------
+
+    if(IsReplaceable(cacheFilename)==false) throw runtime_error(string("Error: Reference cache path is in use by another file: ")+cacheFilename);
+
+    faidx_t * fai=fai_load(filename.c_str());
+
+    if(fai==nullptr) throw runtime_error(string("Error: Could not open fasta index: ")+filename);
+
+    try
+    {
+        if(packed) CreatePacked(filename,cacheFilename,fai,nThreads,sourceStat);
+        else CreateRaw(filename,cacheFilename,fai,nThreads,sourceStat);
+    }
+    catch(...)
     {
-        const char * entryName=faidx_iseq(fai,i); hts_pos_t entryLen=faidx_seq_len64(fai,entryName);
-        entries.emplace(entryName,FastaEntry(entryLen,entrySeq));
-        entrySeq+=entryLen;
+        fai_destroy(fai);
+        throw;
     }
 
     fai_destroy(fai);
 
-    if(this->rawFile!=MAP_FAILED) munmap(this->rawFile,this->totalSize);
-    this->totalSize=totalSize; this->rawFile=rawFile;
-    this->entries=entries;
+    if(OpenCache(cacheFilename,packed,sourceStat)==false) throw runtime_error(string("Error: Could not open reference cache: ")+cacheFilename);
+}
+//----------------------------------------------------------------
+int FastaFile::GetContigID(const string & name) const
+{
+    auto contigID=contigIDs.find(name);
+    return contigID!=contigIDs.end() ? contigID->second : -1;
+}
+//----------------------------------------------------------------
+void FastaFile::WillNeed(int contigID) const
+{
+    auto advise=[](const void * begin,size_t size)
+    {
+        if(size==0) return;
+
+        uintptr_t pageSize=uintptr_t(sysconf(_SC_PAGESIZE)); uintptr_t pageBegin=uintptr_t(begin)&~(pageSize-1);
+        madvise((void*)pageBegin,uintptr_t(begin)+size-pageBegin,MADV_WILLNEED);
+    };
 
-    close(lockFileID); remove(lockFilename.c_str());
+    const FastaEntry & fastaEntry=entries.at(size_t(contigID));
+
+    if(fastaEntry.packed==nullptr) {advise(fastaEntry.seq,size_t(fastaEntry.len)); return;}
+
+    advise(fastaEntry.packed,size_t((fastaEntry.len+3)>>2));
+    advise(fastaEntry.masks,fastaEntry.nMasks*sizeof(FastaMask));
+}
+//----------------------------------------------------------------
+size_t FastaFile::MemoryUsage(void) const
+{
+    return rawFile==MAP_FAILED ? 0 : totalSize;
 }
 //----------------------------------------------------------------
@@ -2,22 +2,77 @@
 #ifndef FASTA_FILE_H
 #define FASTA_FILE_H
 //----------------------------------------------------------------
-#include <map>
+#include <unordered_map>
+#include <functional>
 #include <string>
+#include <vector>
+#include <sys/stat.h>
 #include "hts.h"
 //----------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------
+struct faidx_t;
+//----------------------------------------------------------------
+class FastaMask     //Run of identical non ACGT bases (N or IUPAC) in the packed reference
+{
+private:
+public:
+
+    hts_pos_t begin;
+    hts_pos_t end;
+    char base;
+};
+//----------------------------------------------------------------
+inline const uint8_t fastaBase2Code[256]=  //A=0 C=1 G=2 T=3 N=4 other=5 (Same codes as bamSeq2Code)
+{
+    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+    5,0,5,1,5,5,5,2,5,5,5,5,5,5,4,5, 5,5,5,5,3,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5, 5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
+inline const uint8_t bamSeq2Code[16]={4,0,1,4,2,4,4,4,3,4,4,4,4,4,4,4};    //Bam 4 bit bases to the codes above
+//----------------------------------------------------------------
 class FastaEntry
 {
 private:
 public:
 
     hts_pos_t len;
-    char * seq;
+    const char * seq;           //One byte per base (Raw reference) or nullptr
+    const uint8_t * packed;     //Two bits per base (Packed reference) or nullptr
+    const FastaMask * masks;    //Sorted N/IUPAC runs (Packed reference only)
+    size_t nMasks;
 
     FastaEntry(void){}
-    FastaEntry(hts_pos_t len,char * seq) : len(len),seq(seq){}
+    FastaEntry(hts_pos_t len,const char * seq) : len(len),seq(seq),packed(nullptr),masks(nullptr),nMasks(0){}
+    FastaEntry(hts_pos_t len,const uint8_t * packed,const FastaMask * masks,size_t nMasks) : len(len),seq(nullptr),packed(packed),masks(masks),nMasks(nMasks){}
+
+    size_t FindMask(hts_pos_t pos) const;   //First mask that ends after pos
+
+    char Base(hts_pos_t pos) const;
+    string Sequence(hts_pos_t begin,hts_pos_t len) const;
+};
+//----------------------------------------------------------------
+class FastaCursor   //Fast base code access for non decreasing positions
+{
+private:
+
+    const FastaEntry & entry;
+    size_t mask;
+
+public:
+
+    FastaCursor(const FastaEntry & entry,hts_pos_t pos) : entry(entry),mask(entry.packed!=nullptr ? entry.FindMask(pos) : 0) {}
+
+    inline uint8_t Code(hts_pos_t pos)
+    {
+        if(entry.packed==nullptr) return fastaBase2Code[uint8_t(entry.seq[pos])];
+
+        while(mask<entry.nMasks && entry.masks[mask].end<=pos) mask++;
+        if(mask<entry.nMasks && entry.masks[mask].begin<=pos) return entry.masks[mask].base=='N' ? 4 : 5;
+
+        return (entry.packed[pos>>2]>>((pos&3)<<1))&3;
+    }
 };
 //----------------------------------------------------------------
 class FastaFile
@@ -26,15 +81,30 @@ private:
 
     size_t totalSize; void * rawFile;
 
+    static void FetchContigs(const string & filename,faidx_t * fai,size_t nThreads,const function<void(size_t,char*,hts_pos_t)> & process);
+
+    void CreateRaw(const string & filename,const string & rawFilename,faidx_t * fai,size_t nThreads,const struct stat & sourceStat);
+    void CreatePacked(const string & filename,const string & packedFilename,faidx_t * fai,size_t nThreads,const struct stat & sourceStat);
+
+    bool OpenCache(const string & cacheFilename,bool packed,const struct stat & sourceStat);
+
+    unordered_map<string,int> contigIDs;
+
 public:
 
-    map<string,FastaEntry> entries;
+    vector<string> names;           //Contig names by contig ID (Fasta index order)
+    vector<FastaEntry> entries;     //Contig sequences by contig ID
 
     FastaFile(void);
-    FastaFile(const string & filename);
+    FastaFile(const string & filename,bool packed=false,size_t nThreads=1);
     ~FastaFile(void);
 
-    void Open(const string & filename);
+    void Open(const string & filename,bool packed=false,size_t nThreads=1);
+
+    int GetContigID(const string & name) const;    //-1 if the contig is not in the fasta file
+    void WillNeed(int contigID) const;              //Start reading the pages of a contig that will be used
+
+    size_t MemoryUsage(void) const;                 //Bytes of the mapped reference cache (Resident once touched)
 };
 //----------------------------------------------------------------
 #endif
@@ -0,0 +1,91 @@
+//----------------------------------------------------------------
+// Name        : generate.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Write a synthetic data set with injected variants at known VAFs (See synthetic_data.h for the files)
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <iostream>
+#include <getopt.h>
+#include "synthetic_data.h"
+//----------------------------------------------------------------
+#define SHORT_OPTIONS "o:c:l:n:r:pi:d:D:e:s:t:h"
+//----------------------------------------------------------------
+int main(int argc,char * argv[])
+{
+    static struct option longOptions[]=
+    {
+        {"output-prefix",required_argument,nullptr,'o'},
+        {"contigs",required_argument,nullptr,'c'},
+        {"contig-length",required_argument,nullptr,'l'},
+        {"samples",required_argument,nullptr,'n'},
+        {"read-length",required_argument,nullptr,'r'},
+        {"single-end",no_argument,nullptr,'p'},
+        {"insert-size",required_argument,nullptr,'i'},
+        {"depth",required_argument,nullptr,'d'},
+        {"duplicate-rate",required_argument,nullptr,'D'},
+        {"error-rate",required_argument,nullptr,'e'},
+        {"seed",required_argument,nullptr,'s'},
+        {"threads",required_argument,nullptr,'t'},
+        {"help",no_argument,nullptr,'h'},
+        {nullptr,0,nullptr,0}
+    };
+
+    try
+    {
+        SyntheticScenario scenario; size_t nThreads=1; bool showHelp=(argc==1);
+
+        for(int option;(option=getopt_long(argc,argv,SHORT_OPTIONS,longOptions,nullptr))!=-1;)
+        {
+            switch(option)
+            {
+            case 'o': scenario.name=optarg; break;
+            case 'c': scenario.nContigs=size_t(max(atoll(optarg),1LL)); break;
+            case 'l': scenario.contigLength=atoll(optarg); break;
+            case 'n': scenario.nSamples=size_t(max(atoll(optarg),1LL)); break;
+            case 'r': scenario.readLength=size_t(max(atoll(optarg),1LL)); break;
+            case 'p': scenario.paired=false; break;
+            case 'i': scenario.insertSize=size_t(max(atoll(optarg),1LL)); break;
+            case 'd': scenario.depth=atof(optarg); break;
+            case 'D': scenario.duplicateRate=atof(optarg); break;
+            case 'e': scenario.errorRate=atof(optarg); break;
+            case 's': scenario.seed=uint64_t(atoll(optarg)); break;
+            case 't': nThreads=size_t(max(atoll(optarg),1LL)); break;
+            default: showHelp=true; break;
+            }
+        }
+
+        if(showHelp)
+        {
+            cerr << "enhanced_ABS_generate [options] -o prefix"                                                         << endl;
+            cerr                                                                                                        << endl;
+            cerr << "-o --output-prefix <text>      Prefix of all written files (required)"                             << endl;
+            cerr << "-c --contigs <int>             Number of contigs (optional default=2)"                             << endl;
+            cerr << "-l --contig-length <int>       Length of every contig (optional default=500000)"                   << endl;
+            cerr << "-n --samples <int>             Number of bam files (optional default=2)"                           << endl;
+            cerr << "-r --read-length <int>         Read length (optional default=150)"                                 << endl;
+            cerr << "-p --single-end <void>         If specified write single end reads (optional default=paired)"      << endl;
+            cerr << "-i --insert-size <int>         Mean fragment length of pairs (optional default=350)"               << endl;
+            cerr << "-d --depth <float>             Mean fragment depth (optional default=200)"                         << endl;
+            cerr << "-D --duplicate-rate <float>    Fraction of fragments written twice (optional default=0.05)"        << endl;
+            cerr << "-e --error-rate <float>        Substitution errors per base (optional default=0.001)"              << endl;
+            cerr << "-s --seed <int>                Random seed (optional default=1)"                                   << endl;
+            cerr << "-t --threads <int>             Number of bam files written in parallel (optional default=1)"       << endl;
+            cerr                                                                                                        << endl;
+            return 0;
+        }
+
+        if(scenario.name.empty()) throw runtime_error("Error: Please specify an output prefix (-h for help)");
+
+        SyntheticData::Generate(scenario,nThreads);
+    }
+    catch(const exception & e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
+//----------------------------------------------------------------
@@ -0,0 +1,189 @@
+//----------------------------------------------------------------
+// Name        : instrumentation.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Per phase, per thread timing and call counts, memory estimates per subsystem and RSS per phase boundary with a JSON summary
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <sys/resource.h>
+#include "instrumentation.h"
+//----------------------------------------------------------------
+static const char * phaseNames[N_PHASES]={"input_parsing","job_creation","bam_seek","record_decoding","read_init","ssw_profile","ssw_align","counting","write"};
+static const char * subsystemNames[N_SUBSYSTEMS]={"reference","variant_lines","vep_collapse","variant_store","variant_statistics","known_snps","jobs","block_cache","indel_state"};
+//----------------------------------------------------------------
+static void WritePhases(FILE * file,const PhaseCounters & counters)
+{
+    for(size_t phase=0;phase<N_PHASES;phase++) fprintf(file,"%s\"%s\": {\"seconds\": %.6f, \"calls\": %lu}",phase==0 ? "" : ", ",phaseNames[phase],double(counters.nanoseconds[phase])*1e-9,counters.calls[phase]);
+}
+//----------------------------------------------------------------
+static void ReadRSS(uint64_t & rss,uint64_t & peakRSS)    //VmRSS and VmHWM of /proc/self/status (Peak from getrusage if not available)
+{
+    rss=peakRSS=0;
+
+    FILE * file=fopen("/proc/self/status","r");
+
+    if(file!=nullptr)
+    {
+        char line[256]; unsigned long long kB;
+
+        while(fgets(line,sizeof(line),file)!=nullptr)
+        {
+            if(sscanf(line,"VmRSS: %llu kB",&kB)==1) rss=uint64_t(kB)<<10;
+            else if(sscanf(line,"VmHWM: %llu kB",&kB)==1) peakRSS=uint64_t(kB)<<10;
+        }
+
+        fclose(file);
+    }
+
+    if(peakRSS==0)
+    {
+        struct rusage usage; if(getrusage(RUSAGE_SELF,&usage)==0) peakRSS=uint64_t(usage.ru_maxrss)<<10;
+    }
+}
+//----------------------------------------------------------------
+Instrumentation::Instrumentation(void) : enabled(false),generation(0),startTime(chrono::steady_clock::now()),memoryEnabled(false)
+{
+    for(size_t subsystem=0;subsystem<N_SUBSYSTEMS;subsystem++){memory[subsystem]=0; peakMemory[subsystem]=0;}
+}
+//----------------------------------------------------------------
+void Instrumentation::RaisePeak(Subsystem subsystem,uint64_t bytes)
+{
+    uint64_t peak=peakMemory[subsystem].load(memory_order_relaxed);
+    while(bytes>peak && peakMemory[subsystem].compare_exchange_weak(peak,bytes,memory_order_relaxed)==false){}
+}
+//----------------------------------------------------------------
+Instrumentation & Instrumentation::Instance(void)
+{
+    static Instrumentation instance;
+    return instance;
+}
+//----------------------------------------------------------------
+void Instrumentation::Enable(void)
+{
+    startTime=chrono::steady_clock::now(); enabled.store(true,memory_order_relaxed);
+}
+//----------------------------------------------------------------
+void Instrumentation::Reset(void)
+{
+    lock_guard<mutex> guard(lock);
+
+    enabled.store(false,memory_order_relaxed); memoryEnabled.store(false,memory_order_relaxed);
+
+    threads.clear(); generation.fetch_add(1,memory_order_release);
+
+    for(size_t subsystem=0;subsystem<N_SUBSYSTEMS;subsystem++){memory[subsystem]=0; peakMemory[subsystem]=0;}
+    memorySamples.clear();
+}
+//----------------------------------------------------------------
+PhaseCounters & Instrumentation::Local(void)
+{
+    static thread_local PhaseCounters * counters=nullptr;
+    static thread_local uint64_t counterGeneration=0;
+
+    if(counters==nullptr || counterGeneration!=generation.load(memory_order_acquire))
+    {
+        lock_guard<mutex> guard(lock);
+        threads.emplace_back(new PhaseCounters()); counters=threads.back().get(); counterGeneration=generation.load(memory_order_relaxed);
+    }
+
+    return *counters;
+}
+//----------------------------------------------------------------
+void Instrumentation::EnableMemory(void)
+{
+    lock_guard<mutex> guard(lock);
+
+    for(size_t subsystem=0;subsystem<N_SUBSYSTEMS;subsystem++){memory[subsystem]=0; peakMemory[subsystem]=0;}
+    memorySamples.clear();
+
+    FILE * file=fopen("/proc/self/clear_refs","w");    //Resets VmHWM so every run reports its own peak (Linux only, otherwise the peak of the process)
+    if(file!=nullptr){fputs("5",file); fclose(file);}
+
+    memoryEnabled.store(true,memory_order_relaxed);
+}
+//----------------------------------------------------------------
+void Instrumentation::SetMemory(Subsystem subsystem,uint64_t bytes)
+{
+    if(IsMemoryEnabled()==false) return;
+    memory[subsystem].store(bytes,memory_order_relaxed); RaisePeak(subsystem,bytes);
+}
+//----------------------------------------------------------------
+void Instrumentation::AddMemory(Subsystem subsystem,uint64_t bytes)
+{
+    if(IsMemoryEnabled()==false) return;
+    RaisePeak(subsystem,memory[subsystem].fetch_add(bytes,memory_order_relaxed)+bytes);
+}
+//----------------------------------------------------------------
+void Instrumentation::ReleaseMemory(Subsystem subsystem,uint64_t bytes)
+{
+    if(IsMemoryEnabled()==false) return;
+    memory[subsystem].fetch_sub(bytes,memory_order_relaxed);
+}
+//----------------------------------------------------------------
+void Instrumentation::SampleMemory(const string & boundary,bool verbose)
+{
+    if(IsMemoryEnabled()==false) return;
+
+    uint64_t rss,peakRSS; ReadRSS(rss,peakRSS);
+
+    {
+        lock_guard<mutex> guard(lock);
+        memorySamples.emplace_back(boundary,rss,peakRSS);
+    }
+
+    if(verbose) cerr << "Info: Memory after " << boundary << ": rss " << (rss>>20) << "MB, peak rss " << (peakRSS>>20) << "MB" << endl;
+}
+//----------------------------------------------------------------
+void Instrumentation::PrintMemory(void) const
+{
+    if(IsMemoryEnabled()==false) return;
+
+    for(size_t subsystem=0;subsystem<N_SUBSYSTEMS;subsystem++)
+    {
+        cerr << "Info: Memory " << subsystemNames[subsystem] << ": " << (memory[subsystem].load(memory_order_relaxed)>>20) << "MB (peak " << (peakMemory[subsystem].load(memory_order_relaxed)>>20) << "MB)" << endl;
+    }
+}
+//----------------------------------------------------------------
+void Instrumentation::WriteJSON(const string & filename)    //Call when the instrumented threads are idle
+{
+    lock_guard<mutex> guard(lock);
+
+    FILE * file=fopen(filename.c_str(),"w");
+    if(file==nullptr) throw runtime_error(string("Error: Could not open instrumentation file: ")+filename);
+
+    PhaseCounters total;
+
+    fprintf(file,"{\n  \"wall_seconds\": %.6f,\n  \"threads\": [\n",chrono::duration<double>(chrono::steady_clock::now()-startTime).count());
+
+    for(size_t i=0,nThreads=threads.size();i<nThreads;i++)
+    {
+        const PhaseCounters & counters=*threads[i];
+        for(size_t phase=0;phase<N_PHASES;phase++){total.nanoseconds[phase]+=counters.nanoseconds[phase]; total.calls[phase]+=counters.calls[phase];}
+
+        fprintf(file,"    {\"thread\": %lu, ",i); WritePhases(file,counters); fprintf(file,"}%s\n",i+1<nThreads ? "," : "");
+    }
+
+    fprintf(file,"  ],\n  \"total\": {"); WritePhases(file,total); fprintf(file,"}");
+
+    if(IsMemoryEnabled())
+    {
+        fprintf(file,",\n  \"memory\": {\n    \"subsystems\": {");
+
+        for(size_t subsystem=0;subsystem<N_SUBSYSTEMS;subsystem++) fprintf(file,"%s\"%s\": {\"bytes\": %lu, \"peak_bytes\": %lu}",subsystem==0 ? "" : ", ",subsystemNames[subsystem],memory[subsystem].load(memory_order_relaxed),peakMemory[subsystem].load(memory_order_relaxed));
+
+        fprintf(file,"},\n    \"phases\": [");
+
+        for(size_t i=0,nSamples=memorySamples.size();i<nSamples;i++) fprintf(file,"%s{\"boundary\": \"%s\", \"rss_bytes\": %lu, \"peak_rss_bytes\": %lu}",i==0 ? "" : ", ",memorySamples[i].boundary.c_str(),memorySamples[i].rss,memorySamples[i].peakRSS);
+
+        fprintf(file,"]\n  }");
+    }
+
+    fprintf(file,"\n}\n");
+
+    if(fclose(file)!=0) throw runtime_error(string("Error: Could not write instrumentation file: ")+filename);
+}
+//----------------------------------------------------------------
@@ -0,0 +1,127 @@
+//----------------------------------------------------------------
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+//----------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+enum Phase {PHASE_PARSE,PHASE_JOBS,PHASE_SEEK,PHASE_DECODE,PHASE_READ_INIT,PHASE_PROFILE,PHASE_ALIGN,PHASE_COUNT,PHASE_WRITE,N_PHASES};
+enum Subsystem {MEMORY_REFERENCE,MEMORY_VARIANT_LINES,MEMORY_VEP_COLLAPSE,MEMORY_VARIANT_STORE,MEMORY_STATISTICS,MEMORY_KNOWN_SNPS,MEMORY_JOBS,MEMORY_BLOCK_CACHE,MEMORY_INDEL_STATE,N_SUBSYSTEMS};
+//----------------------------------------------------------------
+class alignas(64) PhaseCounters     //Time and calls per phase of one thread (Only written by its own thread)
+{
+private:
+public:
+
+    uint64_t nanoseconds[N_PHASES];
+    uint64_t calls[N_PHASES];
+
+    PhaseCounters(void) : nanoseconds{},calls{} {}
+};
+//----------------------------------------------------------------
+class MemorySample  //Resident set size of the process at a phase boundary
+{
+private:
+public:
+
+    string boundary;
+    uint64_t rss;
+    uint64_t peakRSS;
+
+    MemorySample(const string & boundary,uint64_t rss,uint64_t peakRSS) : boundary(boundary),rss(rss),peakRSS(peakRSS) {}
+};
+//----------------------------------------------------------------
+class Instrumentation   //Per thread timing of the phases of a run (Disabled unless enabled, then a timer is two clock reads)
+{
+private:
+
+    atomic<bool> enabled;
+
+    mutex lock;
+    vector<unique_ptr<PhaseCounters> > threads;    //Registration order
+    atomic<uint64_t> generation;                   //Raised by Reset so threads that outlive a run register new counters
+
+    chrono::steady_clock::time_point startTime;
+
+    atomic<bool> memoryEnabled;
+    atomic<uint64_t> memory[N_SUBSYSTEMS];      //Estimated bytes per subsystem
+    atomic<uint64_t> peakMemory[N_SUBSYSTEMS];
+    vector<MemorySample> memorySamples;         //Boundary order
+
+    Instrumentation(void);
+
+    void RaisePeak(Subsystem subsystem,uint64_t bytes);
+
+public:
+
+    static Instrumentation & Instance(void);
+
+    void Enable(void);
+    void Reset(void);           //Disables timing and memory accounting and drops the counters of all threads (Call when the instrumented threads are idle)
+    inline bool IsEnabled(void) const {return enabled.load(memory_order_relaxed);}
+
+    PhaseCounters & Local(void);   //Counters of the calling thread
+
+    void EnableMemory(void);    //Resets the estimates, the samples and the peak RSS of the process
+    inline bool IsMemoryEnabled(void) const {return memoryEnabled.load(memory_order_relaxed);}
+
+    void SetMemory(Subsystem subsystem,uint64_t bytes);
+    void AddMemory(Subsystem subsystem,uint64_t bytes);     //Summed over threads (Peak is the largest sum)
+    void ReleaseMemory(Subsystem subsystem,uint64_t bytes);
+
+    void SampleMemory(const string & boundary,bool verbose=false);     //Current and peak RSS of the process
+    void PrintMemory(void) const;
+
+    void WriteJSON(const string & filename);
+};
+//----------------------------------------------------------------
+class PhaseTimer    //Adds the time from construction to Stop or destruction to a phase of the calling thread
+{
+private:
+
+    Phase phase;
+    bool running;
+    chrono::steady_clock::time_point startTime;
+
+public:
+
+    inline PhaseTimer(Phase phase) : phase(phase),running(Instrumentation::Instance().IsEnabled())
+    {
+        if(running) startTime=chrono::steady_clock::now();
+    }
+
+    inline ~PhaseTimer(void) {Stop();}
+
+    inline void Stop(void)
+    {
+        if(running==false) return;
+        running=false;
+
+        PhaseCounters & counters=Instrumentation::Instance().Local();
+        counters.nanoseconds[phase]+=uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now()-startTime).count()); counters.calls[phase]++;
+    }
+};
+//----------------------------------------------------------------
+class MemoryCharge  //Estimated bytes of a subsystem held from Add until destruction
+{
+private:
+
+    Subsystem subsystem;
+    uint64_t bytes;
+
+public:
+
+    inline MemoryCharge(Subsystem subsystem) : subsystem(subsystem),bytes(0) {}
+    inline ~MemoryCharge(void) {if(bytes>0) Instrumentation::Instance().ReleaseMemory(subsystem,bytes);}
+
+    inline void Add(uint64_t bytes) {this->bytes+=bytes; Instrumentation::Instance().AddMemory(subsystem,bytes);}
+};
+//----------------------------------------------------------------
+#endif // INSTRUMENTATION_H
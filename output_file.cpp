@@ -0,0 +1,256 @@
+//----------------------------------------------------------------
+// Name        : output_file.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Plain or bgzf compressed and tabix indexed output
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libdeflate.h>
+#include "output_file.h"
+//----------------------------------------------------------------
+#define BGZF_BLOCK_SIZE         0xff00      //Uncompressed bytes per block (Same as htslib)
+#define BGZF_MAX_BLOCK_SIZE     65536
+#define BGZF_HEADER_SIZE        18
+#define BGZF_FOOTER_SIZE        8
+#define BLOCKS_PER_THREAD       16          //Blocks compressed per thread before they are written
+#define COMPRESSION_LEVEL       6
+#define TBI_MIN_SHIFT           14
+#define TBI_N_LEVELS            5
+//----------------------------------------------------------------
+static const uint8_t bgzfEOF[28]={31,139,8,4,0,0,0,0,0,255,6,0,66,67,2,0,27,0,3,0,0,0,0,0,0,0,0,0};
+//----------------------------------------------------------------
+static inline void StoreU16(uint8_t * p,uint16_t value){p[0]=uint8_t(value); p[1]=uint8_t(value>>8);}
+static inline void StoreU32(uint8_t * p,uint32_t value){p[0]=uint8_t(value); p[1]=uint8_t(value>>8); p[2]=uint8_t(value>>16); p[3]=uint8_t(value>>24);}
+//----------------------------------------------------------------
+static void CompressBlock(const char * data,size_t size,vector<uint8_t> & block)    //One bgzf block (Stored if deflate does not fit)
+{
+    static thread_local unique_ptr<libdeflate_compressor,void(*)(libdeflate_compressor*)> compressor(libdeflate_alloc_compressor(COMPRESSION_LEVEL),libdeflate_free_compressor);
+    static thread_local unique_ptr<libdeflate_compressor,void(*)(libdeflate_compressor*)> storer(libdeflate_alloc_compressor(0),libdeflate_free_compressor);
+
+    if(compressor==nullptr || storer==nullptr) throw runtime_error("Error: Could not allocate compressor");
+
+    block.resize(BGZF_MAX_BLOCK_SIZE); uint8_t * p=block.data();
+
+    size_t cSize=libdeflate_deflate_compress(compressor.get(),data,size,p+BGZF_HEADER_SIZE,BGZF_MAX_BLOCK_SIZE-BGZF_HEADER_SIZE-BGZF_FOOTER_SIZE);
+    if(cSize==0) cSize=libdeflate_deflate_compress(storer.get(),data,size,p+BGZF_HEADER_SIZE,BGZF_MAX_BLOCK_SIZE-BGZF_HEADER_SIZE-BGZF_FOOTER_SIZE);
+    if(cSize==0) throw runtime_error("Error: Could not compress bgzf block");
+
+    size_t blockSize=BGZF_HEADER_SIZE+cSize+BGZF_FOOTER_SIZE;
+
+    memcpy(p,bgzfEOF,16); StoreU16(p+16,uint16_t(blockSize-1));
+    StoreU32(p+BGZF_HEADER_SIZE+cSize,libdeflate_crc32(0,data,size)); StoreU32(p+BGZF_HEADER_SIZE+cSize+4,uint32_t(size));
+
+    block.resize(blockSize);
+}
+//----------------------------------------------------------------
+void OutputFile::WriteRaw(const void * data,size_t size)
+{
+    const char * p=(const char*)data;
+
+    while(size>0)
+    {
+        ssize_t written=write(fd,p,size);
+
+        if(written<0)
+        {
+            if(errno==EINTR) continue;
+            throw runtime_error(string("Error: Could not write output: ")+filename);
+        }
+
+        p+=written; size-=size_t(written);
+    }
+}
+//----------------------------------------------------------------
+void OutputFile::CompressBlocks(bool flushAll)
+{
+    size_t nBlocks=flushAll ? (pending.size()+BGZF_BLOCK_SIZE-1)/BGZF_BLOCK_SIZE : pending.size()/BGZF_BLOCK_SIZE;
+    if(nBlocks==0) return;
+
+    size_t nBytes=min(nBlocks*BGZF_BLOCK_SIZE,pending.size());
+
+    //----------------------------------------------------------------
+    //Compress blocks in parallel
+    //----------------------------------------------------------------
+
+    vector<vector<uint8_t> > blocks(nBlocks); atomic<size_t> next(0); exception_ptr error;
+
+    auto compressBlocks=[&](void)
+    {
+        try
+        {
+            for(size_t i;(i=next.fetch_add(1))<nBlocks;) CompressBlock(pending.data()+i*BGZF_BLOCK_SIZE,min(size_t(BGZF_BLOCK_SIZE),nBytes-i*BGZF_BLOCK_SIZE),blocks[i]);
+        }
+        catch(...)
+        {
+            error=current_exception(); next=nBlocks;
+        }
+    };
+
+    vector<thread> threads; for(size_t i=1;i<min(nThreads,nBlocks);i++) threads.emplace_back(compressBlocks);
+    compressBlocks(); for(auto & thread : threads) thread.join();
+
+    if(error) rethrow_exception(error);
+
+    //----------------------------------------------------------------
+    //Write blocks in order and resolve the index records that end in them
+    //----------------------------------------------------------------
+
+    vector<uint64_t> addresses(nBlocks+1); addresses[0]=blockAddress;
+
+    for(size_t i=0;i<nBlocks;i++)
+    {
+        WriteRaw(blocks[i].data(),blocks[i].size()); addresses[i+1]=(blockAddress+=blocks[i].size());
+    }
+
+    for(;nIndexed<indexRecords.size() && indexRecords[nIndexed].offset<=pendingOffset+nBytes;nIndexed++)
+    {
+        const IndexRecord & record=indexRecords[nIndexed]; uint64_t offset=record.offset-pendingOffset;
+        uint64_t virtualOffset=(addresses[offset/BGZF_BLOCK_SIZE]<<16)|(offset%BGZF_BLOCK_SIZE);
+
+        if(hts_idx_push(index,record.tid,record.beg,record.end,virtualOffset,1)<0) throw runtime_error(string("Error: Could not index output (Records not sorted?): ")+filename);
+    }
+
+    indexRecords.erase(indexRecords.begin(),indexRecords.begin()+nIndexed); nIndexed=0;
+
+    pending.erase(pending.begin(),pending.begin()+nBytes); pendingOffset+=nBytes;
+}
+//----------------------------------------------------------------
+OutputFile::OutputFile(void) : fd(-1),nThreads(1),compressed(false),pendingOffset(0),blockAddress(0),index(nullptr),sc(0),bc(0),ec(0),lineSkip(0),nIndexed(0)
+{
+}
+//----------------------------------------------------------------
+OutputFile::OutputFile(const string & filename,size_t nThreads) : OutputFile()
+{
+    Open(filename,nThreads);
+}
+//----------------------------------------------------------------
+OutputFile::~OutputFile(void)
+{
+    if(fd>=0 && fd!=STDOUT_FILENO) close(fd);
+    if(index!=nullptr) hts_idx_destroy(index);
+}
+//----------------------------------------------------------------
+void OutputFile::Open(const string & filename,size_t nThreads)
+{
+    if(fd>=0) Close();
+
+    this->filename=(filename.empty() || filename=="-") ? string("stdout") : filename;
+    this->nThreads=max(nThreads,size_t(1));
+
+    compressed=(filename.size()>3 && filename.compare(filename.size()-3,3,".gz")==0);
+    pending.clear(); pendingOffset=0; blockAddress=0;
+
+    if(filename.empty() || filename=="-") fd=STDOUT_FILENO;
+    else if((fd=open(filename.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0666))<0) throw runtime_error(string("Error: Could not open output file: ")+filename);
+}
+//----------------------------------------------------------------
+void OutputFile::Close(void)
+{
+    if(fd<0) return;
+
+    //----------------------------------------------------------------
+    //Compress what is left and end the file with the bgzf EOF block
+    //----------------------------------------------------------------
+
+    if(compressed)
+    {
+        CompressBlocks(true);
+        uint64_t finalOffset=blockAddress<<16; WriteRaw(bgzfEOF,sizeof(bgzfEOF));
+
+        //----------------------------------------------------------------
+        //Save the tabix index (Meta data as written by tabix: preset, columns, meta char, skipped lines and the sequence names)
+        //----------------------------------------------------------------
+
+        if(index!=nullptr)
+        {
+            if(hts_idx_finish(index,finalOffset)<0) throw runtime_error(string("Error: Could not finish index: ")+filename);
+
+            string names; for(const auto & name : indexNames) names.append(name.c_str(),name.size()+1);
+
+            int32_t conf[7]={0,sc,bc,ec,'#',lineSkip,int32_t(names.size())};
+            vector<uint8_t> meta(sizeof(conf)+names.size()); memcpy(meta.data(),conf,sizeof(conf)); memcpy(meta.data()+sizeof(conf),names.data(),names.size());
+
+            if(hts_idx_set_meta(index,uint32_t(meta.size()),meta.data(),1)<0 || hts_idx_save_as(index,filename.c_str(),nullptr,HTS_FMT_TBI)<0) throw runtime_error(string("Error: Could not write index: ")+filename+string(".tbi"));
+
+            hts_idx_destroy(index); index=nullptr;
+        }
+    }
+
+    if(fd!=STDOUT_FILENO && close(fd)<0){fd=-1; throw runtime_error(string("Error: Could not close output file: ")+filename);}
+    fd=-1;
+}
+//----------------------------------------------------------------
+void OutputFile::BeginIndex(int sc,int bc,int ec,int lineSkip)
+{
+    if(compressed==false) return;
+
+    CompressBlocks(true);   //Records start in a new block like the alignments after a bam header
+
+    this->sc=sc; this->bc=bc; this->ec=ec; this->lineSkip=lineSkip;
+    indexNames.clear(); indexRecords.clear(); nIndexed=0;
+
+    if((index=hts_idx_init(0,HTS_FMT_TBI,blockAddress<<16,TBI_MIN_SHIFT,TBI_N_LEVELS))==nullptr) throw runtime_error(string("Error: Could not create index: ")+filename);
+}
+//----------------------------------------------------------------
+bool OutputFile::ParseRecord(string_view record,string_view & name,hts_pos_t & beg,hts_pos_t & end) const
+{
+    if(record.empty()==false && record.back()=='\n') record.remove_suffix(1);
+
+    bool hasName=false,hasBeg=false,hasEnd=(ec==0);
+
+    for(int column=1;;column++)
+    {
+        size_t tab=record.find('\t'); string_view field=record.substr(0,tab);
+
+        if(column==sc){name=field; hasName=true;}
+        else if(column==bc){if(from_chars(field.data(),field.data()+field.size(),beg).ec!=errc()) return false; end=beg--; hasBeg=true;}
+        else if(column==ec){if(from_chars(field.data(),field.data()+field.size(),end).ec!=errc()) return false; hasEnd=true;}
+
+        if(tab==string_view::npos) break;
+        record.remove_prefix(tab+1);
+    }
+
+    if(hasName==false || hasBeg==false || hasEnd==false) return false;
+
+    beg=max(beg,hts_pos_t(0)); end=max(end,hts_pos_t(1));
+    return true;
+}
+//----------------------------------------------------------------
+void OutputFile::Write(const char * data,size_t size)
+{
+    if(compressed==false){WriteRaw(data,size); return;}
+
+    pending.insert(pending.end(),data,data+size);
+    if(pending.size()>=nThreads*BLOCKS_PER_THREAD*BGZF_BLOCK_SIZE) CompressBlocks(false);
+}
+//----------------------------------------------------------------
+void OutputFile::WriteRecord(const char * data,size_t size)
+{
+    if(index!=nullptr)
+    {
+        string_view name; hts_pos_t beg,end;
+        if(ParseRecord(string_view(data,size),name,beg,end)==false) throw runtime_error(string("Error: Could not parse the index columns of an output record: ")+filename);
+
+        if(indexNames.empty() || indexNames.back()!=name)
+        {
+            if(find(indexNames.begin(),indexNames.end(),name)!=indexNames.end()) throw runtime_error(string("Error: Records of a sequence are not consecutive in output: ")+filename);
+            indexNames.emplace_back(name);
+        }
+
+        indexRecords.emplace_back(int(indexNames.size()-1),beg,end,pendingOffset+pending.size()+size);
+    }
+
+    Write(data,size);
+}
+//----------------------------------------------------------------
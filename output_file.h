@@ -0,0 +1,72 @@
+//----------------------------------------------------------------
+#ifndef OUTPUT_FILE_H
+#define OUTPUT_FILE_H
+//----------------------------------------------------------------
+#include <string_view>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "hts.h"
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+class IndexRecord   //Index entry waiting for the address of the bgzf block that contains its end
+{
+private:
+public:
+
+    int tid;
+    hts_pos_t beg;
+    hts_pos_t end;
+    uint64_t offset;    //Uncompressed offset of the end of the record
+
+    IndexRecord(void){}
+    IndexRecord(int tid,hts_pos_t beg,hts_pos_t end,uint64_t offset) : tid(tid),beg(beg),end(end),offset(offset){}
+};
+//----------------------------------------------------------------
+class OutputFile    //Text output to stdout or a file (Names ending in .gz are written as bgzf with the blocks compressed in parallel and an optional tabix index built while writing)
+{
+private:
+
+    string filename;
+    int fd;
+    size_t nThreads;
+    bool compressed;
+
+    vector<char> pending;       //Uncompressed text not yet compressed
+    uint64_t pendingOffset;     //Uncompressed offset of the first pending byte (Always the start of a block)
+    uint64_t blockAddress;      //File offset of the next block
+
+    hts_idx_t * index;
+    int sc,bc,ec,lineSkip;      //Tabix columns (1-based) and number of header lines
+    vector<string> indexNames;  //Sequence names by index tid
+    vector<IndexRecord> indexRecords; size_t nIndexed;
+
+    void WriteRaw(const void * data,size_t size);
+    void CompressBlocks(bool flushAll);
+
+public:
+
+    OutputFile(void);
+    OutputFile(const string & filename,size_t nThreads=1);
+    ~OutputFile(void);
+
+    OutputFile(const OutputFile &)=delete;
+    OutputFile & operator=(const OutputFile &)=delete;
+
+    void Open(const string & filename,size_t nThreads=1);  //Empty or "-" is stdout
+    void Close(void);
+
+    bool IsCompressed(void) const {return compressed;}
+    bool IsIndexed(void) const {return index!=nullptr;}
+
+    void BeginIndex(int sc,int bc,int ec,int lineSkip);    //Index the records written after this call (Compressed output only)
+    bool ParseRecord(string_view record,string_view & name,hts_pos_t & beg,hts_pos_t & end) const;    //Interval of a record as tabix reads it
+
+    void Write(const char * data,size_t size);
+    void Write(const string & text) {Write(text.data(),text.size());}
+    void WriteRecord(const char * data,size_t size);       //One line including the line end (Indexed if an index was started)
+    void WriteRecord(const string & text) {WriteRecord(text.data(),text.size());}
+};
+//----------------------------------------------------------------
+#endif // OUTPUT_FILE_H
@@ -0,0 +1,89 @@
+//----------------------------------------------------------------
+#ifndef PILEUP_KERNELS_H
+#define PILEUP_KERNELS_H
+//----------------------------------------------------------------
+#include <map>
+#include <string>
+#include "sam.h"
+#include "fasta_file.h"
+#include "vcf_file.h"
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+// Inner loops of the pileup shared by annotate_bam_statistics.cpp and the benchmark
+//----------------------------------------------------------------
+template<class T> using FragmentMap=map<string,T>;     //Reads of a locus paired by query name
+//----------------------------------------------------------------
+inline const char bamSeq2Base[]="NACNGNNNTNNNNNNN";
+//----------------------------------------------------------------
+inline size_t CountMismatches(const uint8_t * bamSeq,size_t queryPos,FastaCursor & fastaCursor,hts_pos_t refPos,hts_pos_t opLen,const KnownSNP * & vcfEntry,const KnownSNP * vcfEntryEnd)  //Mismatches of one aligned cigar op (Known SNP alleles are no mismatch, vcfEntry is advanced)
+{
+    size_t nMismatches=0;
+
+    for(size_t i=refPos,iEnd=refPos+opLen,j=queryPos;i<iEnd;i++,j++)
+    {
+        if(vcfEntry==vcfEntryEnd || vcfEntry->pos!=hts_pos_t(i))
+        {
+            nMismatches+=fastaCursor.Code(hts_pos_t(i))!=bamSeq2Code[bam_seqi(bamSeq,j)];
+            continue;
+        }
+
+        const char * vcfBases=(vcfEntry++)->alleles; char bamBase=bamSeq2Base[bam_seqi(bamSeq,j)];
+        nMismatches+=vcfBases[0]!=bamBase && vcfBases[1]!=bamBase && vcfBases[2]!=bamBase && vcfBases[3]!=bamBase;
+    }
+
+    return nMismatches;
+}
+//----------------------------------------------------------------
+inline void ReadSpan(const bam1_t * bamRead,hts_pos_t & readBegin,hts_pos_t & readEnd)    //Reference span of a read including its soft clips (Inclusive end)
+{
+    readBegin=readEnd=bamRead->core.pos;
+
+    for(const uint32_t *cigarBegin=bam_get_cigar(bamRead),*cigarEnd=cigarBegin+bamRead->core.n_cigar-1,*cigar=cigarBegin;cigar<=cigarEnd;cigar++)
+    {
+        hts_pos_t opLen=hts_pos_t(bam_cigar_oplen(*cigar));
+
+        switch(bam_cigar_op(*cigar))
+        {
+        case BAM_CSOFT_CLIP:
+
+            if(cigar==cigarBegin) {readBegin-=opLen; continue;}
+            if(cigar==cigarEnd) readEnd+=opLen;
+            continue;
+
+        case BAM_CDEL:
+        case BAM_CREF_SKIP:
+        case BAM_CMATCH:
+        case BAM_CEQUAL:
+        case BAM_CDIFF:
+
+            readEnd+=opLen;
+            continue;
+        }
+    }
+
+    readEnd--;
+}
+//----------------------------------------------------------------
+inline int EncodeQuery(const bam1_t * bamRead,uint8_t minHQBaseScore,char * query)   //Query for SSW (Lower case below minHQBaseScore, query needs l_qseq+1 chars) returns the maximum alignment score
+{
+    static const char bamSeq2ASCII[][2]={ {'n','N'},{'a','A'},{'c','C'},{'n','N'},{'g','G'},{'n','N'},{'n','N'},{'n','N'},{'t','T'},{'n','N'},{'n','N'},{'n','N'},{'n','N'},{'n','N'},{'n','N'},{'n','N'} };
+
+    int maxPosScore=0;
+
+    size_t queryLen=size_t(bamRead->core.l_qseq); const uint8_t * seq=bam_get_seq(bamRead); const uint8_t * qual=bam_get_qual(bamRead); const uint8_t * qualEnd=qual+(queryLen&~1UL); char * pQuery=query;
+
+    for(;qual<qualEnd;seq++,qual+=2,pQuery+=2)
+    {
+        uint8_t packedBases=seq[0]; size_t isHQ;
+        isHQ=size_t(qual[0]>=minHQBaseScore); maxPosScore+=1+isHQ; pQuery[0]=bamSeq2ASCII[size_t(packedBases>>4)][isHQ];
+        isHQ=size_t(qual[1]>=minHQBaseScore); maxPosScore+=1+isHQ; pQuery[1]=bamSeq2ASCII[size_t(packedBases&15)][isHQ];
+    }
+
+    if(queryLen&1){ size_t isHQ=size_t(qual[0]>=minHQBaseScore); maxPosScore+=1+isHQ; pQuery[0]=bamSeq2ASCII[size_t(seq[0]>>4)][isHQ]; }
+
+    query[queryLen]='\0';
+    return maxPosScore;
+}
+//----------------------------------------------------------------
+#endif // PILEUP_KERNELS_H
@@ -0,0 +1,113 @@
+//----------------------------------------------------------------
+// Name        : progress_reporter.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Lock free progress, throughput and ETA reporting (Workers only touch relaxed atomics)
+//----------------------------------------------------------------
+#include <iostream>
+#include <cstdio>
+#include "progress_bar.h"
+#include "progress_reporter.h"
+//----------------------------------------------------------------
+#define REPORT_INTERVAL chrono::seconds(1)
+//----------------------------------------------------------------
+static void FormatRate(char * buffer,size_t size,double rate)
+{
+    if(rate>=1e6) {snprintf(buffer,size,"%.1fM",rate/1e6); return;}
+    if(rate>=1e3) {snprintf(buffer,size,"%.1fk",rate/1e3); return;}
+    snprintf(buffer,size,"%.0f",rate);
+}
+//----------------------------------------------------------------
+static void FormatTime(char * buffer,size_t size,double seconds)
+{
+    if(seconds<0.0) {snprintf(buffer,size,"--:--:--"); return;}
+    uint64_t s=uint64_t(seconds+0.5); snprintf(buffer,size,"%02lu:%02lu:%02lu",s/3600,(s/60)%60,s%60);
+}
+//----------------------------------------------------------------
+ProgressReporter::ProgressReporter(size_t nWorkers,size_t nJobs,bool verbose) : nWorkers(nWorkers),nJobs(nJobs),verbose(verbose),counters(new ProgressCounters[nWorkers]),stop(false) {}
+//----------------------------------------------------------------
+ProgressReporter::~ProgressReporter(void)
+{
+    if(reporter.joinable())
+    {
+        {lock_guard<mutex> guard(stopLock); stop=true;}
+        stopped.notify_all(); reporter.join();
+    }
+}
+//----------------------------------------------------------------
+void ProgressReporter::Sum(uint64_t & jobs,uint64_t & reads,uint64_t & alignments) const
+{
+    jobs=reads=alignments=0;
+
+    for(size_t i=0;i<nWorkers;i++)
+    {
+        jobs+=counters[i].jobs.load(memory_order_relaxed);
+        reads+=counters[i].reads.load(memory_order_relaxed);
+        alignments+=counters[i].alignments.load(memory_order_relaxed);
+    }
+}
+//----------------------------------------------------------------
+void ProgressReporter::Report(void)
+{
+    uint64_t prevJobs=0,prevReads=0,prevAlignments=0; auto prevTime=startTime;
+
+    unique_lock<mutex> lock(stopLock);
+
+    while(stopped.wait_for(lock,REPORT_INTERVAL,[this]{return stop;})==false)
+    {
+        auto now=chrono::steady_clock::now();
+        double interval=chrono::duration<double>(now-prevTime).count(); double elapsed=chrono::duration<double>(now-startTime).count();
+
+        uint64_t jobs,reads,alignments; Sum(jobs,reads,alignments);
+
+        size_t progress=min(size_t((jobs*100)/max(nJobs,size_t(1))),size_t(100));
+        double eta=jobs>0 ? elapsed*double(nJobs-min(size_t(jobs),nJobs))/double(jobs) : -1.0;
+
+        char jobRate[32],readRate[32],alignmentRate[32],etaTime[32];
+        FormatRate(jobRate,sizeof(jobRate),double(jobs-prevJobs)/interval);
+        FormatRate(readRate,sizeof(readRate),double(reads-prevReads)/interval);
+        FormatRate(alignmentRate,sizeof(alignmentRate),double(alignments-prevAlignments)/interval);
+        FormatTime(etaTime,sizeof(etaTime),eta);
+
+        string bar(progressBar[progress]); bar.pop_back();  //Remove carriage return
+        cerr << bar << jobRate << " jobs/s " << readRate << " reads/s " << alignmentRate << " alignments/s ETA " << etaTime << "   \r" << flush;
+
+        prevJobs=jobs; prevReads=reads; prevAlignments=alignments; prevTime=now;
+    }
+}
+//----------------------------------------------------------------
+void ProgressReporter::Start(void)
+{
+    startTime=chrono::steady_clock::now();
+
+    if(verbose==false) return;
+
+    cerr << progressBar[0] << flush;
+    reporter=thread(&ProgressReporter::Report,this);
+}
+//----------------------------------------------------------------
+void ProgressReporter::Stop(void)
+{
+    if(reporter.joinable())
+    {
+        {lock_guard<mutex> guard(stopLock); stop=true;}
+        stopped.notify_all(); reporter.join();
+    }
+
+    if(verbose==false) return;
+
+    double elapsed=max(chrono::duration<double>(chrono::steady_clock::now()-startTime).count(),1e-9);
+    uint64_t jobs,reads,alignments; Sum(jobs,reads,alignments);
+
+    char jobRate[32],readRate[32],alignmentRate[32],time[32];
+    FormatRate(jobRate,sizeof(jobRate),double(jobs)/elapsed);
+    FormatRate(readRate,sizeof(readRate),double(reads)/elapsed);
+    FormatRate(alignmentRate,sizeof(alignmentRate),double(alignments)/elapsed);
+    FormatTime(time,sizeof(time),elapsed);
+
+    string bar(progressBar[100]); bar.pop_back();
+    cerr << bar << string(64,' ') << endl;
+    cerr << "Info: " << jobs << " jobs in " << time << " (" << jobRate << " jobs/s " << readRate << " reads/s " << alignmentRate << " alignments/s)" << endl;
+}
+//----------------------------------------------------------------
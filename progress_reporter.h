@@ -0,0 +1,62 @@
+//----------------------------------------------------------------
+#ifndef PROGRESS_REPORTER_H
+#define PROGRESS_REPORTER_H
+//----------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdint.h>
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+class alignas(64) ProgressCounters  //Per worker counters (Own cache line so workers never share one)
+{
+private:
+public:
+
+    atomic<uint64_t> jobs;
+    atomic<uint64_t> reads;
+    atomic<uint64_t> alignments;
+
+    ProgressCounters(void) : jobs(0),reads(0),alignments(0) {}
+
+    inline void AddJob(void){jobs.fetch_add(1,memory_order_relaxed);}
+    inline void AddReads(uint64_t n){reads.fetch_add(n,memory_order_relaxed);}
+    inline void AddAlignments(uint64_t n){alignments.fetch_add(n,memory_order_relaxed);}
+};
+//----------------------------------------------------------------
+class ProgressReporter  //Separate thread that reports progress, throughput and ETA on a fixed interval
+{
+private:
+
+    size_t nWorkers;
+    size_t nJobs;
+    bool verbose;
+
+    unique_ptr<ProgressCounters[]> counters;
+
+    thread reporter;
+    bool stop;
+    mutex stopLock;
+    condition_variable stopped;
+
+    chrono::steady_clock::time_point startTime;
+
+    void Sum(uint64_t & jobs,uint64_t & reads,uint64_t & alignments) const;
+    void Report(void);
+
+public:
+
+    ProgressReporter(size_t nWorkers,size_t nJobs,bool verbose);
+    ~ProgressReporter(void);
+
+    ProgressCounters & GetCounters(size_t workerIndex){return counters[workerIndex];}
+
+    void Start(void);
+    void Stop(void);
+};
+//----------------------------------------------------------------
+#endif // PROGRESS_REPORTER_H
@@ -0,0 +1,234 @@
+//----------------------------------------------------------------
+// Name        : result_cache.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Append only result cache shared between processes (Posix)
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <cstddef>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libdeflate.h>
+#include "result_cache.h"
+//----------------------------------------------------------------
+#define FILE_KEY_SIZE   65536   //Bytes hashed at the start and at the end of a file
+//----------------------------------------------------------------
+class FileLock  //Advisory lock on the whole file, released when out of scope
+{
+private:
+
+    int fd;
+
+public:
+
+    FileLock(int fd,int operation,const string & filename) : fd(fd)
+    {
+        while(flock(fd,operation)==-1) if(errno!=EINTR) throw runtime_error(string("Error: Could not lock result cache: ")+filename);
+    }
+
+    ~FileLock(void) {flock(fd,LOCK_UN);}
+};
+//----------------------------------------------------------------
+static bool WriteAt(int fd,const void * data,size_t size,off_t offset)
+{
+    for(const char * p=(const char*)data;size>0;)
+    {
+        ssize_t nBytes=pwrite(fd,p,size,offset);
+        if(nBytes<0 && errno==EINTR) continue;
+        if(nBytes<=0) return false;
+        p+=nBytes; size-=size_t(nBytes); offset+=off_t(nBytes);
+    }
+
+    return true;
+}
+//----------------------------------------------------------------
+ResultKey ResultKeyHasher::Key(void) const
+{
+    auto mix=[](uint64_t x){x^=x>>30; x*=0xbf58476d1ce4e5b9ULL; x^=x>>27; x*=0x94d049bb133111ebULL; return x^(x>>31);};   //SplitMix64 finalizer
+
+    ResultKey key; key.hash[0]=mix(lanes[0]); key.hash[1]=mix(lanes[1]);
+    return key;
+}
+//----------------------------------------------------------------
+ResultCache::ResultCache(void) : fd(-1),mapped(nullptr),mappedSize(0),validEnd(0),nPending(0)
+{
+}
+//----------------------------------------------------------------
+ResultCache::~ResultCache(void)
+{
+    Close();
+}
+//----------------------------------------------------------------
+uint32_t ResultCache::Checksum(const ResultCacheRecord & record,const void * statistics)
+{
+    uint32_t checksum=libdeflate_crc32(0,&record,offsetof(ResultCacheRecord,checksum));
+    return record.nStatistics>0 ? libdeflate_crc32(checksum,statistics,size_t(record.nStatistics)*sizeof(Statistics)) : checksum;
+}
+//----------------------------------------------------------------
+void ResultCache::Map(size_t size)
+{
+    if(mapped!=nullptr) munmap((void*)mapped,mappedSize);
+    mapped=nullptr; mappedSize=0;
+
+    void * rawFile=mmap(nullptr,size,PROT_READ,MAP_SHARED,fd,0);
+    if(rawFile==MAP_FAILED) throw runtime_error(string("Error: Could not memory map result cache: ")+filename);
+
+    mapped=(const uint8_t*)rawFile; mappedSize=size;
+}
+//----------------------------------------------------------------
+size_t ResultCache::Scan(size_t begin)
+{
+    size_t offset=begin;
+
+    while(mappedSize-offset>=sizeof(ResultCacheRecord))
+    {
+        const ResultCacheRecord & record=*(const ResultCacheRecord*)(mapped+offset);
+        const uint8_t * statistics=mapped+offset+sizeof(ResultCacheRecord);
+
+        if(RecordSize(record.nStatistics)>mappedSize-offset || Checksum(record,statistics)!=record.checksum) break;    //Cut short by a writer that did not finish
+
+        ResultKey key; key.hash[0]=record.key[0]; key.hash[1]=record.key[1];
+        index[key]=make_pair(offset+sizeof(ResultCacheRecord),record.nStatistics);
+
+        offset+=RecordSize(record.nStatistics);
+    }
+
+    return offset;
+}
+//----------------------------------------------------------------
+void ResultCache::Open(const string & filename)
+{
+    Close();
+
+    fd=open(filename.c_str(),O_RDWR|O_CREAT|O_CLOEXEC,0666);
+    if(fd==-1) throw runtime_error(string("Error: Could not open result cache: ")+filename);
+
+    this->filename=filename;
+
+    //----------------------------------------------------------------
+    //Write the header of a new file (Or of a file whose creator did not get that far)
+    //----------------------------------------------------------------
+
+    struct stat fileStat;
+
+    if(fstat(fd,&fileStat)==-1) throw runtime_error(string("Error: Could not open result cache: ")+filename);
+
+    if(size_t(fileStat.st_size)<sizeof(ResultCacheHeader))
+    {
+        FileLock lock(fd,LOCK_EX,filename);
+
+        if(fstat(fd,&fileStat)==-1) throw runtime_error(string("Error: Could not open result cache: ")+filename);
+
+        if(size_t(fileStat.st_size)<sizeof(ResultCacheHeader))
+        {
+            ResultCacheHeader header; memcpy(header.magic,RESULT_CACHE_MAGIC,8); header.version=RESULT_CACHE_VERSION; header.statisticsSize=uint32_t(sizeof(Statistics));
+
+            if(ftruncate(fd,0)==-1 || WriteAt(fd,&header,sizeof(header),0)==false) throw runtime_error(string("Error: Could not write result cache: ")+filename);
+        }
+    }
+
+    //----------------------------------------------------------------
+    //Map and index the records written so far
+    //----------------------------------------------------------------
+
+    FileLock lock(fd,LOCK_SH,filename);
+
+    if(fstat(fd,&fileStat)==-1) throw runtime_error(string("Error: Could not open result cache: ")+filename);
+
+    Map(size_t(fileStat.st_size));
+
+    const ResultCacheHeader & header=*(const ResultCacheHeader*)mapped;
+
+    if(mappedSize<sizeof(ResultCacheHeader) || memcmp(header.magic,RESULT_CACHE_MAGIC,8)!=0) throw runtime_error(string("Error: Not a result cache: ")+filename);
+    if(header.version!=RESULT_CACHE_VERSION || header.statisticsSize!=uint32_t(sizeof(Statistics))) throw runtime_error(string("Error: Result cache was written by another version: ")+filename);
+
+    validEnd=Scan(sizeof(ResultCacheHeader));
+}
+//----------------------------------------------------------------
+void ResultCache::Close(void)
+{
+    if(mapped!=nullptr) munmap((void*)mapped,mappedSize);
+    if(fd!=-1) close(fd);
+
+    fd=-1; mapped=nullptr; mappedSize=0; validEnd=0;
+    index.clear(); pending.clear(); nPending=0;
+}
+//----------------------------------------------------------------
+const Statistics * ResultCache::Find(const ResultKey & key,size_t nStatistics) const
+{
+    auto it=index.find(key);
+    if(it==index.end() || size_t(it->second.second)!=nStatistics) return nullptr;
+
+    return (const Statistics*)(mapped+it->second.first);
+}
+//----------------------------------------------------------------
+void ResultCache::Add(const ResultKey & key,const vector<Statistics> & statistics)
+{
+    ResultCacheRecord record; record.key[0]=key.hash[0]; record.key[1]=key.hash[1]; record.nStatistics=uint32_t(statistics.size());
+    record.checksum=Checksum(record,statistics.data());
+
+    pending.append((const char*)&record,sizeof(record));
+    pending.append((const char*)statistics.data(),statistics.size()*sizeof(Statistics));
+    pending.resize(pending.size()+RecordSize(statistics.size())-sizeof(record)-statistics.size()*sizeof(Statistics),'\0');
+
+    nPending++;
+}
+//----------------------------------------------------------------
+size_t ResultCache::Flush(void)
+{
+    if(fd==-1 || nPending==0) return 0;
+
+    //----------------------------------------------------------------
+    //Find the end of the valid records (Other processes may have appended since Open) and cut off an unfinished tail
+    //----------------------------------------------------------------
+
+    FileLock lock(fd,LOCK_EX,filename);
+
+    struct stat fileStat;
+
+    if(fstat(fd,&fileStat)==-1) throw runtime_error(string("Error: Could not write result cache: ")+filename);
+    if(size_t(fileStat.st_size)<validEnd) throw runtime_error(string("Error: Result cache was truncated while in use: ")+filename);
+
+    Map(size_t(fileStat.st_size)); validEnd=Scan(validEnd);
+
+    if(validEnd<mappedSize && ftruncate(fd,off_t(validEnd))==-1) throw runtime_error(string("Error: Could not write result cache: ")+filename);
+
+    //----------------------------------------------------------------
+    //Append (Readers that open the file from now on index these records too)
+    //----------------------------------------------------------------
+
+    if(WriteAt(fd,pending.data(),pending.size(),off_t(validEnd))==false) throw runtime_error(string("Error: Could not write result cache: ")+filename);
+
+    size_t nAppended=nPending; pending.clear(); nPending=0;
+    return nAppended;
+}
+//----------------------------------------------------------------
+ResultKey ResultCache::FileKey(const string & filename)
+{
+    int fileFD=open(filename.c_str(),O_RDONLY|O_CLOEXEC); struct stat fileStat;
+
+    if(fileFD==-1 || fstat(fileFD,&fileStat)==-1)
+    {
+        if(fileFD!=-1) close(fileFD);
+        throw runtime_error(string("Error: Could not open file: ")+filename);
+    }
+
+    size_t size=size_t(fileStat.st_size); size_t headSize=min(size,size_t(FILE_KEY_SIZE)); size_t tailSize=min(size-headSize,size_t(FILE_KEY_SIZE));
+
+    vector<uint8_t> buffer(headSize+tailSize);
+
+    bool valid=pread(fileFD,buffer.data(),headSize,0)==ssize_t(headSize) && pread(fileFD,buffer.data()+headSize,tailSize,off_t(size-tailSize))==ssize_t(tailSize);
+    close(fileFD);
+
+    if(valid==false) throw runtime_error(string("Error: Could not read file: ")+filename);
+
+    ResultKeyHasher hasher; hasher.Add(uint64_t(size)); hasher.Add(buffer.data(),buffer.size());
+    return hasher.Key();
+}
+//----------------------------------------------------------------
@@ -0,0 +1,131 @@
+//----------------------------------------------------------------
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+//----------------------------------------------------------------
+#include <string_view>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "variant_entry.h"
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+// Append only file of job results shared by all runs (Little endian, meant to be memory mapped)
+//
+// ResultCacheHeader
+// ResultCacheRecord followed by Statistics[nStatistics] padded to 8 bytes, one record per (locus, bam file) in the order they were appended
+//
+// Readers scan the records under a shared lock and stop at the first record that is cut short or fails its checksum,
+// writers append under an exclusive lock after cutting off such a tail. A key found more than once is served by its last record.
+//----------------------------------------------------------------
+#define RESULT_CACHE_MAGIC      "EABSRES\0"
+#define RESULT_CACHE_VERSION    2   //Raised when the statistics of a locus change (2: job local tie-break of ambiguous indel reads)
+//----------------------------------------------------------------
+class ResultCacheHeader
+{
+private:
+public:
+
+    char magic[8];
+    uint32_t version;
+    uint32_t statisticsSize;    //sizeof(Statistics) of the writer
+};
+//----------------------------------------------------------------
+class ResultCacheRecord
+{
+private:
+public:
+
+    uint64_t key[2];
+    uint32_t nStatistics;
+    uint32_t checksum;          //CRC32 of the key, the count and the statistics
+};
+//----------------------------------------------------------------
+static_assert(sizeof(ResultCacheHeader)==16 && sizeof(ResultCacheRecord)==24 && sizeof(Statistics)%4==0,"Result cache layout");
+//----------------------------------------------------------------
+class ResultKey
+{
+private:
+public:
+
+    uint64_t hash[2];
+
+    bool operator==(const ResultKey & key) const {return hash[0]==key.hash[0] && hash[1]==key.hash[1];}
+};
+//----------------------------------------------------------------
+class ResultKeyHash
+{
+private:
+public:
+
+    size_t operator()(const ResultKey & key) const {return size_t(key.hash[0]);}
+};
+//----------------------------------------------------------------
+class ResultKeyHasher   //128 bit key from two FNV-1a style lanes with different offset bases and multipliers
+{
+private:
+
+    uint64_t lanes[2];
+
+public:
+
+    ResultKeyHasher(void) : lanes{14695981039346656037ULL,7809847782465536322ULL} {}
+
+    void Add(const void * data,size_t size)
+    {
+        for(const uint8_t *p=(const uint8_t*)data,*pEnd=p+size;p<pEnd;p++)
+        {
+            lanes[0]^=*p; lanes[0]*=1099511628211ULL;
+            lanes[1]^=*p; lanes[1]*=11400714819323198485ULL;
+        }
+    }
+
+    template<class T> void Add(const T & value) {Add(&value,sizeof(value));}   //Plain values only (Text goes through AddText)
+    void AddText(string_view text) {Add(uint64_t(text.size())); Add(text.data(),text.size());}
+
+    ResultKey Key(void) const;
+};
+//----------------------------------------------------------------
+class ResultCache
+{
+private:
+
+    string filename;
+    int fd;
+
+    const uint8_t * mapped;
+    size_t mappedSize;
+    size_t validEnd;            //End of the records scanned so far
+
+    unordered_map<ResultKey,pair<size_t,uint32_t>,ResultKeyHash> index;    //Offset and count of the statistics by key
+
+    string pending;             //Records added by this run
+    size_t nPending;
+
+    static uint32_t Checksum(const ResultCacheRecord & record,const void * statistics);
+    static size_t RecordSize(size_t nStatistics) {return (sizeof(ResultCacheRecord)+nStatistics*sizeof(Statistics)+7)&~size_t(7);}
+
+    void Map(size_t size);
+    size_t Scan(size_t begin);  //Indexes the valid records from begin on and returns where they end
+
+public:
+
+    ResultCache(void);
+    ~ResultCache(void);
+
+    void Open(const string & filename);     //Creates the file if it does not exist
+    void Close(void);
+
+    bool IsOpen(void) const {return fd!=-1;}
+    size_t Size(void) const {return index.size();}
+
+    const Statistics * Find(const ResultKey & key,size_t nStatistics) const;   //nullptr if not cached
+    void Add(const ResultKey & key,const vector<Statistics> & statistics);      //Kept in memory until Flush
+
+    size_t Flush(void);                     //Appends the added records and returns their number
+
+    static ResultKey FileKey(const string & filename);     //Size and the first and last 64KB of a file (Copies and moves of a file keep their results)
+};
+//----------------------------------------------------------------
+#endif // RESULT_CACHE_H
@@ -7,10 +7,16 @@
 //----------------------------------------------------------------
 #include <stdexcept>
 #include <cstring>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "instrumentation.h"
 #include "ssw.h"
 //----------------------------------------------------------------
 static const int gapOpen=3;
 static const int gapExtension=1;
+static const size_t profileLanes=16;    //16 bit lanes of the widest (AVX2) striped profile
 //----------------------------------------------------------------
 static const int matrix[]=  //Substitution matrix (Rows=query Cols=reference)
 {
@@ -61,21 +67,95 @@ static const parasail_matrix_t parasailMatrix=
     nullptr
 };
 //----------------------------------------------------------------
+static size_t ProfileSize(size_t referenceLen)  //Striped profile: one row of int16 segments per matrix entry
+{
+    return size_t(parasailMatrix.size)*((referenceLen+profileLanes-1)/profileLanes)*profileLanes*sizeof(int16_t);
+}
+//----------------------------------------------------------------
+class ProfileCache  //Size bounded LRU cache of profiles by reference sequence (Profiles are read only while aligning so threads share them)
+{
+private:
+
+    typedef list<pair<string,shared_ptr<parasail_profile_t> > > ProfileList;
+
+    mutex lock;
+    atomic<size_t> maxSize; size_t size;
+    ProfileList profiles;   //Most recently used first
+    unordered_map<string,ProfileList::iterator> index;
+
+public:
+
+    ProfileCache(void) : maxSize(0),size(0) {}
+
+    static ProfileCache & Instance(void) {static ProfileCache instance; return instance;}
+
+    bool IsEnabled(void) const {return maxSize.load(memory_order_relaxed)>0;}
+
+    void SetMaxSize(size_t maxSize)
+    {
+        lock_guard<mutex> guard(lock);
+        this->maxSize.store(maxSize,memory_order_relaxed); if(maxSize==0){profiles.clear(); index.clear(); size=0;}
+    }
+
+    shared_ptr<parasail_profile_t> Get(const string & reference)
+    {
+        lock_guard<mutex> guard(lock);
+        if(IsEnabled()==false) return nullptr;
+
+        auto it=index.find(reference); if(it==index.end()) return nullptr;
+        profiles.splice(profiles.begin(),profiles,it->second);
+        return it->second->second;
+    }
+
+    void Put(const string & reference,const shared_ptr<parasail_profile_t> & profile)
+    {
+        lock_guard<mutex> guard(lock);
+        if(IsEnabled()==false || index.count(reference)>0) return;
+
+        profiles.emplace_front(reference,profile); index.emplace(reference,profiles.begin()); size+=ProfileSize(reference.length())+reference.length();
+
+        while(size>maxSize.load(memory_order_relaxed) && profiles.size()>1)
+        {
+            auto & last=profiles.back(); size-=ProfileSize(last.first.length())+last.first.length();
+            index.erase(last.first); profiles.pop_back();
+        }
+    }
+};
+//----------------------------------------------------------------
 void SSW::Clear(void)
 {
-    if(referenceProfile!=nullptr) parasail_profile_free(referenceProfile);
+    referenceProfile.reset(); profileSize=0;
 }
 //----------------------------------------------------------------
-SSW::SSW(void) : referenceProfile(nullptr)
+void SSW::CreateProfile(size_t referenceLen,const char * reference)
 {
+    PhaseTimer timer(PHASE_PROFILE);
+
+    Clear();
+
+    ProfileCache & cache=ProfileCache::Instance(); bool caching=cache.IsEnabled();
+    string key; if(caching) key.assign(reference,referenceLen);
+
+    if(caching==false || (referenceProfile=cache.Get(key))==nullptr)
+    {
+        referenceProfile.reset(parasail_profile_create_16(reference,int(referenceLen),&parasailMatrix),parasail_profile_free);
+        if(referenceProfile==nullptr) throw runtime_error("Error: Could not create alignment profile");
+        if(caching) cache.Put(key,referenceProfile);
+    }
+
+    profileSize=ProfileSize(referenceLen);
 }
 //----------------------------------------------------------------
-SSW::SSW(const string & reference) : referenceProfile(nullptr)
+SSW::SSW(void) : profileSize(0)
+{
+}
+//----------------------------------------------------------------
+SSW::SSW(const string & reference) : profileSize(0)
 {
     Init(reference);
 }
 //----------------------------------------------------------------
-SSW::SSW(size_t referenceLen,const char * reference) : referenceProfile(nullptr)
+SSW::SSW(size_t referenceLen,const char * reference) : profileSize(0)
 {
     Init(referenceLen,reference);
 }
@@ -87,21 +167,25 @@ SSW::~SSW(void)
 //----------------------------------------------------------------
 void SSW::Init(const string & reference)
 {
-    Clear();
-    referenceProfile=parasail_profile_create_16(reference.c_str(),int(reference.length()),&parasailMatrix);
+    CreateProfile(reference.length(),reference.c_str());
 }
 //----------------------------------------------------------------
 void SSW::Init(size_t referenceLen,const char * reference)
 {
-    Clear();
-    referenceProfile=parasail_profile_create_16(reference,referenceLen,&parasailMatrix);
+    CreateProfile(referenceLen,reference);
+}
+//----------------------------------------------------------------
+void SSW::SetProfileCacheSize(size_t maxSize)
+{
+    ProfileCache::Instance().SetMaxSize(maxSize);
 }
 //----------------------------------------------------------------
 int SSW::Align(const char * query)
 {
     if(referenceProfile==nullptr) throw runtime_error("Error: Please initialze the SSW object first before aligning!");
+    PhaseTimer timer(PHASE_ALIGN);
 
-    parasail_result_t * parasailResult=parasail_sw_striped_profile_16(referenceProfile,query,strlen(query),gapOpen,gapExtension);
+    parasail_result_t * parasailResult=parasail_sw_striped_profile_16(referenceProfile.get(),query,strlen(query),gapOpen,gapExtension);
     int score=parasailResult->score;
     parasail_result_free(parasailResult);
 
@@ -111,8 +195,9 @@ int SSW::Align(const char * query)
 int SSW::Align(const string & query)
 {
     if(referenceProfile==nullptr) throw runtime_error("Error: Please initialze the SSW object first before aligning!");
+    PhaseTimer timer(PHASE_ALIGN);
 
-    parasail_result_t * parasailResult=parasail_sw_striped_profile_16(referenceProfile,query.c_str(),query.length(),gapOpen,gapExtension);
+    parasail_result_t * parasailResult=parasail_sw_striped_profile_16(referenceProfile.get(),query.c_str(),query.length(),gapOpen,gapExtension);
     int score=parasailResult->score;
     parasail_result_free(parasailResult);
 
@@ -122,8 +207,9 @@ int SSW::Align(const string & query)
 int SSW::Align(size_t queryLen,const char * query)
 {
     if(referenceProfile==nullptr) throw runtime_error("Error: Please initialze the SSW object first before aligning!");
+    PhaseTimer timer(PHASE_ALIGN);
 
-    parasail_result_t * parasailResult=parasail_sw_striped_profile_16(referenceProfile,query,queryLen,gapOpen,gapExtension);
+    parasail_result_t * parasailResult=parasail_sw_striped_profile_16(referenceProfile.get(),query,queryLen,gapOpen,gapExtension);
     int score=parasailResult->score;
     parasail_result_free(parasailResult);
 
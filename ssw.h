@@ -3,6 +3,7 @@
 #define SSW_H
 //----------------------------------------------------------------
 #include <string>
+#include <memory>
 #include <parasail.h>
 //----------------------------------------------------------------
 using namespace std;
@@ -11,9 +12,11 @@ class SSW
 {
 private:
 
-    parasail_profile_t * referenceProfile;
+    shared_ptr<parasail_profile_t> referenceProfile;   //Shared with the profile cache if enabled
+    size_t profileSize;     //Estimated bytes of the profile
 
     void Clear(void);
+    void CreateProfile(size_t referenceLen,const char * reference);
 
 public:
 
@@ -29,6 +32,10 @@ public:
     int Align(const char * query);
     int Align(const string & query);
     int Align(size_t queryLen,const char * query);
+
+    size_t MemoryUsage(void) const {return profileSize;}
+
+    static void SetProfileCacheSize(size_t maxSize);   //Process wide LRU cache of profiles by reference sequence (Zero disables)
 };
 //----------------------------------------------------------------
 #endif // SSW_H
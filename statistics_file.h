@@ -0,0 +1,57 @@
+//----------------------------------------------------------------
+#ifndef STATISTICS_FILE_H
+#define STATISTICS_FILE_H
+//----------------------------------------------------------------
+#include <stdint.h>
+//----------------------------------------------------------------
+// Binary columnar statistics file (Little endian, meant to be memory mapped)
+//
+// StatisticsFileHeader
+// StatisticsColumn[nColumns]
+// Column data, every column starting on a STATISTICS_FILE_ALIGNMENT boundary
+//
+// Variant columns (sample==STATISTICS_FILE_NO_SAMPLE), one value per variant in the order of the text output:
+//   contig (u32, index into contig_names), pos and end (i64, 0-based endpoints), var_type (u8, SNV DEL INS ITD PTD),
+//   line_offset (u64) and line_length (u32) of the input row in lines, and the text columns header, lines, contig_names and sample_names (NUL separated)
+//
+// Sample columns, one per raw counter and sample with one value per variant:
+//   total_depth unknown ambiguous alt_depth alt_bias_0 alt_bias_1 HQ_depth HQ_alt_depth HQ_alt_bias_0 HQ_alt_bias_1 mismatches_too_high (u32)
+//   VAF_ITD COE_ITD (f32)
+//
+// The ratios of the text output are left to the reader, e.g. depth=total_depth-(unknown+ambiguous) and alt_freq=alt_depth/max(depth,1)
+//----------------------------------------------------------------
+#define STATISTICS_FILE_MAGIC       "EABSSTAT"
+#define STATISTICS_FILE_VERSION     1
+#define STATISTICS_FILE_ALIGNMENT   64
+#define STATISTICS_FILE_NO_SAMPLE   UINT32_MAX
+//----------------------------------------------------------------
+enum ColumnType : uint32_t {COLUMN_U8,COLUMN_U32,COLUMN_U64,COLUMN_I64,COLUMN_F32,COLUMN_TEXT};
+//----------------------------------------------------------------
+class StatisticsFileHeader
+{
+private:
+public:
+
+    char magic[8];
+    uint32_t version;
+    uint32_t nColumns;
+    uint64_t nVariants;
+    uint32_t nSamples;
+    uint32_t nContigs;
+};
+//----------------------------------------------------------------
+class StatisticsColumn
+{
+private:
+public:
+
+    char name[32];      //NUL terminated
+    uint32_t type;      //ColumnType
+    uint32_t sample;    //Sample index or STATISTICS_FILE_NO_SAMPLE
+    uint64_t offset;    //From the start of the file
+    uint64_t size;      //In bytes
+};
+//----------------------------------------------------------------
+static_assert(sizeof(StatisticsFileHeader)==32 && sizeof(StatisticsColumn)==56,"Statistics file layout");
+//----------------------------------------------------------------
+#endif // STATISTICS_FILE_H
@@ -0,0 +1,439 @@
+//----------------------------------------------------------------
+// Name        : synthetic_data.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Reproducible synthetic reference, reads and variant files with injected variants at known VAFs
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <exception>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <thread>
+#include <sam.h>
+#include <faidx.h>
+#include "output_file.h"
+#include "text_reader.h"
+#include "synthetic_data.h"
+//----------------------------------------------------------------
+#define FASTA_LINE_LENGTH   60
+#define MIN_SPACING         1000        //Minimum distance between injected variants
+#define MAX_INDEL_LENGTH    10
+#define MAX_ITD_LENGTH      30
+#define LOW_QUALITY_RATE    0.1         //Fraction of bases with a base score below the default HQ threshold
+#define HIGH_BASE_SCORE     37
+#define LOW_BASE_SCORE      20
+#define MAPPING_QUALITY     60
+//----------------------------------------------------------------
+static const char bases[]="ACGT";
+static const double vafLevels[]={0.05,0.1,0.2,0.35,0.5,1.0};
+static const size_t nVAFLevels=sizeof(vafLevels)/sizeof(vafLevels[0]);
+//----------------------------------------------------------------
+static inline char OtherBase(char base,mt19937_64 & random)    //Random base different from base
+{
+    char other; do other=bases[random()&3]; while(other==base);
+    return other;
+}
+//----------------------------------------------------------------
+static inline hts_pos_t MaxFragmentLength(const SyntheticScenario & scenario)
+{
+    return scenario.paired ? scenario.FragmentLength()*5/4 : scenario.FragmentLength();
+}
+//----------------------------------------------------------------
+void SyntheticData::CreateVariants(const SyntheticScenario & scenario,const vector<string> & contigs,vector<SyntheticVariant> & variants)
+{
+    mt19937_64 random(scenario.seed*2+1);
+
+    hts_pos_t spacing=max(hts_pos_t(MIN_SPACING),2*MaxFragmentLength(scenario)+4*MAX_ITD_LENGTH);
+    hts_pos_t maxITDLength=max(hts_pos_t(3),min(hts_pos_t(MAX_ITD_LENGTH),hts_pos_t(scenario.readLength/3)));
+
+    variants.clear(); size_t i=0;
+
+    for(size_t contig=0;contig<contigs.size();contig++)
+    {
+        const string & refSeq=contigs[contig];
+
+        for(hts_pos_t slot=spacing;slot+spacing<=hts_pos_t(refSeq.size());slot+=spacing,i++)
+        {
+            SyntheticVariant variant; variant.contig=contig; variant.isGermline=false;
+            hts_pos_t p=variant.pos=slot+hts_pos_t(random()%uint64_t(spacing/4));
+
+            //----------------------------------------------------------------
+            //Cycle through the variant types, every sixth variant is a known germline SNP
+            //----------------------------------------------------------------
+
+            switch(i%6)
+            {
+            case 0:
+
+                variant.varType=SNV; variant.ref=refSeq.substr(size_t(p),1); variant.alt=string(1,OtherBase(refSeq[size_t(p)],random));
+                break;
+
+            case 1:
+
+                variant.varType=DEL; variant.ref=refSeq.substr(size_t(p),1+1+random()%MAX_INDEL_LENGTH); variant.alt=variant.ref.substr(0,1);
+                break;
+
+            case 2:
+            {
+                variant.varType=INS; variant.ref=refSeq.substr(size_t(p),1);
+                string insertion(1+random()%MAX_INDEL_LENGTH,'N'); for(auto & base : insertion) base=bases[random()&3];
+                insertion[0]=OtherBase(refSeq[size_t(p)+1],random); variant.alt=variant.ref+insertion;     //Does not continue like the reference
+                break;
+            }
+            case 3:
+
+                variant.varType=ITD; variant.ref=refSeq.substr(size_t(p),1); variant.alt=refSeq.substr(size_t(p),size_t(1+3+random()%uint64_t(maxITDLength-2)));   //Duplicate of the bases that follow
+                break;
+
+            case 4:
+            {
+                variant.varType=PTD; variant.ref=refSeq.substr(size_t(p),1);
+                size_t m=3+random()%5; string tail(1+random()%MAX_INDEL_LENGTH,'N'); for(auto & base : tail) base=bases[random()&3];
+                tail[0]=OtherBase(refSeq[size_t(p)+1+m],random); variant.alt=refSeq.substr(size_t(p),1+m)+tail;    //Partial duplicate of the bases that follow
+                break;
+            }
+            default:
+
+                variant.varType=SNV; variant.isGermline=true; variant.ref=refSeq.substr(size_t(p),1); variant.alt=string(1,OtherBase(refSeq[size_t(p)],random));
+                break;
+            }
+
+            for(size_t sample=0;sample<scenario.nSamples;sample++) variant.vafs.push_back(variant.isGermline ? 0.5 : vafLevels[(i+sample)%nVAFLevels]);
+
+            variants.push_back(move(variant));
+        }
+    }
+}
+//----------------------------------------------------------------
+void SyntheticData::WriteReference(const SyntheticScenario & scenario,const vector<string> & contigs)
+{
+    string filename=scenario.FastaFilename();
+    {
+        OutputFile output(filename);
+
+        for(size_t contig=0;contig<contigs.size();contig++)
+        {
+            string text=">chr"+to_string(contig+1)+"\n";
+            for(size_t i=0;i<contigs[contig].size();i+=FASTA_LINE_LENGTH) {text.append(contigs[contig],i,FASTA_LINE_LENGTH); text+='\n';}
+            output.Write(text);
+        }
+
+        output.Close();
+    }
+
+    if(fai_build(filename.c_str())<0) throw runtime_error(string("Error: Could not index fasta file: ")+filename);
+}
+//----------------------------------------------------------------
+void SyntheticData::WriteVariantFiles(const SyntheticScenario & scenario,const vector<string> & contigs,const vector<SyntheticVariant> & variants)
+{
+    OutputFile annovar(scenario.AnnovarFilename()),vep(scenario.VEPFilename()),truth(scenario.TruthFilename()),vcf(scenario.VCFFilename());
+
+    //----------------------------------------------------------------
+    //Write headers
+    //----------------------------------------------------------------
+
+    annovar.Write("Chr\tStart\tEnd\tRef\tAlt\tGene\n");
+
+    vep.Write("## ENSEMBL VARIANT EFFECT PREDICTOR format (Synthetic)\n#Uploaded_variation\tLocation\tAllele\tGene\tConsequence\n");
+
+    string header="Chr\tStart\tEnd\tRef\tAlt\tvep_id\tvar_type";
+    for(size_t sample=0;sample<scenario.nSamples;sample++) header+="\t"+Statistics::SampleName(scenario.BamFilename(sample))+":VAF";
+    truth.Write(header+"\n");
+
+    header="##fileformat=VCFv4.2\n";
+    for(size_t contig=0;contig<contigs.size();contig++) header+="##contig=<ID=chr"+to_string(contig+1)+",length="+to_string(contigs[contig].size())+">\n";
+    header+="#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n";
+    vcf.Write(header); vcf.BeginIndex(1,2,0,0);
+
+    //----------------------------------------------------------------
+    //Write variants (Annovar drops the shared first base of indels and starts deletions at the first deleted base)
+    //----------------------------------------------------------------
+
+    for(size_t i=0;i<variants.size();i++)
+    {
+        const SyntheticVariant & variant=variants[i]; string chr="chr"+to_string(variant.contig+1); hts_pos_t pos=variant.pos+1;
+
+        if(variant.isGermline){vcf.WriteRecord(chr+"\t"+to_string(pos)+"\t.\t"+variant.ref+"\t"+variant.alt+"\t.\tPASS\t.\n"); continue;}
+
+        string annovarKey;
+
+        if(variant.varType==SNV) annovarKey=chr+"\t"+to_string(pos)+"\t"+to_string(pos)+"\t"+variant.ref+"\t"+variant.alt;
+        else if(variant.varType==DEL) annovarKey=chr+"\t"+to_string(pos+1)+"\t"+to_string(pos+hts_pos_t(variant.ref.size())-1)+"\t"+variant.ref.substr(1)+"\t-";
+        else annovarKey=chr+"\t"+to_string(pos)+"\t"+to_string(pos)+"\t-\t"+variant.alt.substr(1);
+
+        string vepKey=chr+"_"+to_string(pos)+"_"+variant.ref+"_"+variant.alt;
+        string allele=variant.varType==SNV ? variant.alt : variant.varType==DEL ? string("-") : variant.alt.substr(1);
+        string gene="GENE"+to_string(i);
+
+        annovar.Write(annovarKey+"\t"+gene+"\n");
+
+        vep.Write(vepKey+"\t"+chr+":"+to_string(pos)+"\t"+allele+"\t"+gene+"\tintergenic_variant\n");
+        vep.Write(vepKey+"\t"+chr+":"+to_string(pos)+"\t"+allele+"\t"+gene+"_AS\tupstream_gene_variant\n");
+
+        string row=annovarKey+"\t"+vepKey+"\t"+varStrings[variant.varType];
+        for(double vaf : variant.vafs){char value[32]; snprintf(value,sizeof(value),"\t%g",vaf); row+=value;}
+        truth.Write(row+"\n");
+    }
+
+    annovar.Close(); vep.Close(); truth.Close(); vcf.Close();
+}
+//----------------------------------------------------------------
+class SyntheticRead
+{
+private:
+public:
+
+    hts_pos_t pos;
+    uint64_t order;     //Generation order of reads at the same position
+    string qname;
+    uint16_t flag;
+    hts_pos_t mpos;
+    hts_pos_t isize;
+    vector<uint32_t> cigar;
+    string seq;
+    string qual;
+
+    bool operator>(const SyntheticRead & read) const {return pos!=read.pos ? pos>read.pos : order>read.order;}
+};
+//----------------------------------------------------------------
+static void AddCigar(vector<uint32_t> & cigar,uint32_t op,hts_pos_t len)
+{
+    if(len<=0) return;
+    if(cigar.empty()==false && bam_cigar_op(cigar.back())==op){cigar.back()+=uint32_t(len)<<BAM_CIGAR_SHIFT; return;}
+    cigar.push_back(bam_cigar_gen(uint32_t(len),op));
+}
+//----------------------------------------------------------------
+static void MapRead(const SyntheticVariant * variant,hts_pos_t begin,hts_pos_t len,hts_pos_t & pos,vector<uint32_t> & cigar)  //Alignment of haplotype bases [begin,begin+len) carrying the variant (None if nullptr)
+{
+    cigar.clear();
+
+    if(variant==nullptr || (variant->ref.size()==1 && variant->alt.size()==1)){pos=begin; AddCigar(cigar,BAM_CMATCH,len); return;}
+
+    hts_pos_t p=variant->pos,a=hts_pos_t(variant->alt.size()),r=hts_pos_t(variant->ref.size()),end=begin+len; pos=-1;
+
+    if(begin<=p){pos=begin; AddCigar(cigar,BAM_CMATCH,min(end,p+1)-begin);}    //Up to and including the shared first base
+
+    hts_pos_t insBegin=max(begin,p+1),insEnd=min(end,p+a);     //Inserted bases (Clipped at the ends of the read)
+    if(insBegin<insEnd) AddCigar(cigar,cigar.empty() || insEnd==end ? BAM_CSOFT_CLIP : BAM_CINS,insEnd-insBegin);
+
+    if(r>1 && begin<=p && end>p+a) AddCigar(cigar,BAM_CDEL,r-1);
+
+    hts_pos_t tailBegin=max(begin,p+a);
+    if(tailBegin<end){if(pos<0) pos=tailBegin+r-a; AddCigar(cigar,BAM_CMATCH,end-tailBegin);}
+
+    if(pos<0){pos=p+1; cigar.clear(); AddCigar(cigar,BAM_CMATCH,len);}     //Read inside the insertion
+}
+//----------------------------------------------------------------
+static hts_pos_t ReferenceLength(const vector<uint32_t> & cigar)
+{
+    hts_pos_t len=0; for(uint32_t op : cigar) if(bam_cigar_type(bam_cigar_op(op))&2) len+=hts_pos_t(bam_cigar_oplen(op));
+    return len;
+}
+//----------------------------------------------------------------
+void SyntheticData::WriteBam(const SyntheticScenario & scenario,const vector<string> & contigs,const vector<SyntheticVariant> & variants,size_t sample)
+{
+    mt19937_64 random(scenario.seed*1000003+sample+1); uniform_real_distribution<double> uniform(0.0,1.0);
+
+    string filename=scenario.BamFilename(sample);
+
+    //----------------------------------------------------------------
+    //Open bam file and write header
+    //----------------------------------------------------------------
+    {
+        string headerText="@HD\tVN:1.6\tSO:coordinate\n";
+        for(size_t contig=0;contig<contigs.size();contig++) headerText+="@SQ\tSN:chr"+to_string(contig+1)+"\tLN:"+to_string(contigs[contig].size())+"\n";
+        headerText+="@PG\tID:enhanced_ABS_generate\tPN:enhanced_ABS_generate\n";
+
+        htsFile * handle=sam_open(filename.c_str(),"wb"); if(handle==nullptr) throw runtime_error(string("Error: Could not open bam file: ")+filename);
+        sam_hdr_t * header=sam_hdr_parse(headerText.size(),headerText.c_str());
+        bam1_t * record=bam_init1();
+
+        class Closer    //Closes the bam file on errors as well
+        {
+        private:
+
+            htsFile * handle; sam_hdr_t * header; bam1_t * record;
+
+        public:
+
+            Closer(htsFile * handle,sam_hdr_t * header,bam1_t * record) : handle(handle),header(header),record(record) {}
+            ~Closer(void){if(record!=nullptr) bam_destroy1(record); if(header!=nullptr) sam_hdr_destroy(header); sam_close(handle);}
+        }
+        closer(handle,header,record);
+
+        if(header==nullptr || record==nullptr || sam_hdr_write(handle,header)<0) throw runtime_error(string("Error: Could not write bam header: ")+filename);
+
+        //----------------------------------------------------------------
+        //Generate fragments in coordinate order, reads wait in a heap until no read can start before them
+        //----------------------------------------------------------------
+
+        priority_queue<SyntheticRead,vector<SyntheticRead>,greater<SyntheticRead> > pending; uint64_t order=0,fragmentID=0;
+
+        auto writeUntil=[&](int32_t tid,hts_pos_t pos)
+        {
+            for(;pending.empty()==false && pending.top().pos<pos;pending.pop())
+            {
+                const SyntheticRead & read=pending.top();
+
+                if(bam_set1(record,read.qname.size(),read.qname.c_str(),read.flag,tid,read.pos,MAPPING_QUALITY,read.cigar.size(),read.cigar.data(),(read.flag&BAM_FPAIRED) ? tid : -1,read.mpos,read.isize,read.seq.size(),read.seq.c_str(),read.qual.c_str(),0)<0 || sam_write1(handle,header,record)<0)
+                    throw runtime_error(string("Error: Could not write bam record: ")+filename);
+            }
+        };
+
+        hts_pos_t maxFragmentLength=MaxFragmentLength(scenario),readLength=hts_pos_t(scenario.readLength);
+        normal_distribution<double> insertSize(double(scenario.insertSize),double(scenario.insertSize)/10.0);
+        exponential_distribution<double> gap(scenario.depth/double(scenario.FragmentLength()));
+
+        const SyntheticVariant * variant=variants.data(),* variantEnd=variant+variants.size();
+
+        for(size_t contig=0;contig<contigs.size();contig++)
+        {
+            const string & refSeq=contigs[contig]; hts_pos_t contigLength=hts_pos_t(refSeq.size());
+
+            for(hts_pos_t f=hts_pos_t(gap(random));f+maxFragmentLength+2*MAX_ITD_LENGTH<contigLength;f+=hts_pos_t(gap(random)))
+            {
+                writeUntil(int32_t(contig),f);
+
+                hts_pos_t fragmentLength=scenario.paired ? min(max(hts_pos_t(llround(insertSize(random))),readLength),maxFragmentLength) : readLength;
+
+                //----------------------------------------------------------------
+                //Variant inside the fragment (At most one) and whether the fragment carries it
+                //----------------------------------------------------------------
+
+                while(variant<variantEnd && (variant->contig<contig || (variant->contig==contig && variant->pos<f))) variant++;
+
+                const SyntheticVariant * carried=nullptr;
+                if(variant<variantEnd && variant->contig==contig && variant->pos<f+fragmentLength && uniform(random)<variant->vafs[sample]) carried=variant;
+
+                auto hapBase=[&](hts_pos_t i)
+                {
+                    if(carried==nullptr || i<carried->pos) return refSeq[size_t(i)];
+                    hts_pos_t a=hts_pos_t(carried->alt.size()); if(i<carried->pos+a) return carried->alt[size_t(i-carried->pos)];
+                    return refSeq[size_t(i-a+hts_pos_t(carried->ref.size()))];
+                };
+
+                //----------------------------------------------------------------
+                //Create the reads of the fragment (Duplicates repeat the fragment)
+                //----------------------------------------------------------------
+
+                SyntheticRead reads[2]; size_t nReads=scenario.paired ? 2 : 1;
+
+                for(size_t i=0;i<nReads;i++)
+                {
+                    SyntheticRead & read=reads[i]; hts_pos_t begin=i==0 ? f : f+fragmentLength-readLength;
+
+                    MapRead(carried,begin,readLength,read.pos,read.cigar);
+
+                    read.seq.resize(size_t(readLength)); read.qual.resize(size_t(readLength));
+
+                    for(hts_pos_t j=0;j<readLength;j++)
+                    {
+                        char base=hapBase(begin+j); if(uniform(random)<scenario.errorRate) base=OtherBase(base,random);
+                        read.seq[size_t(j)]=base; read.qual[size_t(j)]=char(uniform(random)<LOW_QUALITY_RATE ? LOW_BASE_SCORE : HIGH_BASE_SCORE);
+                    }
+                }
+
+                if(scenario.paired)
+                {
+                    hts_pos_t templateLength=reads[1].pos+ReferenceLength(reads[1].cigar)-reads[0].pos;
+
+                    reads[0].flag=BAM_FPAIRED|BAM_FPROPER_PAIR|BAM_FMREVERSE|BAM_FREAD1; reads[0].mpos=reads[1].pos; reads[0].isize=templateLength;
+                    reads[1].flag=BAM_FPAIRED|BAM_FPROPER_PAIR|BAM_FREVERSE|BAM_FREAD2; reads[1].mpos=reads[0].pos; reads[1].isize=-templateLength;
+                }
+                else
+                {
+                    reads[0].flag=(random()&1) ? BAM_FREVERSE : 0; reads[0].mpos=-1; reads[0].isize=0;
+                }
+
+                size_t nCopies=uniform(random)<scenario.duplicateRate ? 2 : 1;
+
+                for(size_t copy=0;copy<nCopies;copy++,fragmentID++)
+                {
+                    string qname="S"+to_string(sample)+":"+to_string(fragmentID);
+
+                    for(size_t i=0;i<nReads;i++)
+                    {
+                        SyntheticRead read=reads[i]; read.qname=qname; read.order=order++; if(copy>0) read.flag|=BAM_FDUP;
+                        pending.push(move(read));
+                    }
+                }
+            }
+
+            writeUntil(int32_t(contig),contigLength+1);
+        }
+    }   //Closed before indexing
+
+    if(sam_index_build(filename.c_str(),0)<0) throw runtime_error(string("Error: Could not index bam file: ")+filename);
+}
+//----------------------------------------------------------------
+void SyntheticData::Generate(const SyntheticScenario & scenario,size_t nThreads)
+{
+    if(scenario.readLength<2*MAX_ITD_LENGTH/3 || scenario.contigLength<hts_pos_t(4*MIN_SPACING)) throw runtime_error("Error: Synthetic reads or contigs too short");
+
+    //----------------------------------------------------------------
+    //Random reference and variants
+    //----------------------------------------------------------------
+
+    mt19937_64 random(scenario.seed*2);
+
+    vector<string> contigs(scenario.nContigs);
+    for(auto & contig : contigs){contig.resize(size_t(scenario.contigLength)); for(auto & base : contig) base=bases[random()&3];}
+
+    vector<SyntheticVariant> variants; CreateVariants(scenario,contigs,variants);
+
+    WriteReference(scenario,contigs);
+    WriteVariantFiles(scenario,contigs,variants);
+
+    //----------------------------------------------------------------
+    //Write the bam files of the samples in parallel
+    //----------------------------------------------------------------
+
+    size_t nSamples=scenario.nSamples; atomic<size_t> next(0); exception_ptr error;
+
+    auto writeBams=[&](void)
+    {
+        try
+        {
+            for(size_t sample;(sample=next.fetch_add(1))<nSamples;) WriteBam(scenario,contigs,variants,sample);
+        }
+        catch(...)
+        {
+            error=current_exception(); next=nSamples;
+        }
+    };
+
+    vector<thread> threads; for(size_t i=1;i<min(nThreads,nSamples);i++) threads.emplace_back(writeBams);
+    writeBams(); for(auto & thread : threads) thread.join();
+
+    if(error) rethrow_exception(error);
+}
+//----------------------------------------------------------------
+void SyntheticData::ReadTruth(const string & filename,vector<SyntheticTruth> & truth)
+{
+    TextReader reader(filename);
+
+    truth.clear(); if(reader.ReadLine()==nullptr) throw runtime_error(string("Error: Could not read header from truth file: ")+filename);
+
+    for(char * line;(line=reader.ReadLine())!=nullptr;)
+    {
+        if(line[0]=='\0') continue;
+
+        vector<string> fields; for(char * field;(field=strsep(&line,"\t"))!=nullptr;) fields.emplace_back(field);
+        if(fields.size()<8) throw runtime_error(string("Error: Invalid truth file: ")+filename);
+
+        SyntheticTruth entry;
+        entry.annovarKey=fields[0]+"\t"+fields[1]+"\t"+fields[2]+"\t"+fields[3]+"\t"+fields[4];
+        entry.vepKey=fields[5];
+        entry.varType=SNV; for(int varType=SNV;varType<=PTD;varType++) if(fields[6]==varStrings[varType]) entry.varType=VarType(varType);
+        for(size_t i=7;i<fields.size();i++) entry.vafs.push_back(stod(fields[i]));
+
+        truth.push_back(move(entry));
+    }
+}
+//----------------------------------------------------------------
@@ -0,0 +1,97 @@
+//----------------------------------------------------------------
+#ifndef SYNTHETIC_DATA_H
+#define SYNTHETIC_DATA_H
+//----------------------------------------------------------------
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "hts.h"
+#include "variant_entry.h"
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+// Synthetic data set with injected variants at known VAFs (Every file name starts with the prefix):
+//
+// <prefix>.fa + .fai                   Random reference
+// <prefix>_sample<i>.bam + .bai        Coordinate sorted reads of sample i
+// <prefix>.annovar.txt                 Injected variants as annovar rows
+// <prefix>.vep.txt                     Injected variants as VEP rows (Two rows per variant)
+// <prefix>.vcf.gz + .tbi               Known germline SNPs (Heterozygous in every sample)
+// <prefix>.truth.tsv                   Injected variants with their VAF per sample
+//
+// Variants are spaced further apart than a fragment is long so every fragment carries at most one of them
+//----------------------------------------------------------------
+class SyntheticScenario
+{
+private:
+public:
+
+    string name;
+
+    size_t nContigs;
+    hts_pos_t contigLength;
+    size_t nSamples;
+
+    size_t readLength;
+    bool paired;
+    size_t insertSize;      //Mean fragment length of pairs
+    double depth;           //Mean fragment depth (Duplicates not included)
+    double duplicateRate;   //Fraction of fragments written twice, the copy flagged as duplicate
+    double errorRate;       //Substitutions per base
+
+    uint64_t seed;
+
+    SyntheticScenario(void) : nContigs(2),contigLength(500000),nSamples(2),readLength(150),paired(true),insertSize(350),depth(200.0),duplicateRate(0.05),errorRate(0.001),seed(1) {}
+
+    hts_pos_t FragmentLength(void) const {return hts_pos_t(paired ? max(insertSize,readLength) : readLength);}
+
+    string FastaFilename(void) const {return name+".fa";}
+    string BamFilename(size_t sample) const {return name+"_sample"+to_string(sample)+".bam";}
+    string AnnovarFilename(void) const {return name+".annovar.txt";}
+    string VEPFilename(void) const {return name+".vep.txt";}
+    string VCFFilename(void) const {return name+".vcf.gz";}
+    string TruthFilename(void) const {return name+".truth.tsv";}
+};
+//----------------------------------------------------------------
+class SyntheticVariant  //VCF style: ref and alt share the first base unless the variant is a SNV
+{
+private:
+public:
+
+    size_t contig;
+    hts_pos_t pos;      //0-based position of the first reference base
+    string ref;
+    string alt;
+
+    bool isGermline;    //Known SNP of the vcf file
+    VarType varType;
+    vector<double> vafs;    //By sample
+};
+//----------------------------------------------------------------
+class SyntheticTruth    //Injected variant of the truth file
+{
+private:
+public:
+
+    string annovarKey;  //Chr Start End Ref Alt (Tab separated)
+    string vepKey;      //Chr_Pos_Ref_Alt
+    VarType varType;
+    vector<double> vafs;
+};
+//----------------------------------------------------------------
+class SyntheticData
+{
+private:
+
+    static void CreateVariants(const SyntheticScenario & scenario,const vector<string> & contigs,vector<SyntheticVariant> & variants);
+    static void WriteReference(const SyntheticScenario & scenario,const vector<string> & contigs);
+    static void WriteVariantFiles(const SyntheticScenario & scenario,const vector<string> & contigs,const vector<SyntheticVariant> & variants);
+    static void WriteBam(const SyntheticScenario & scenario,const vector<string> & contigs,const vector<SyntheticVariant> & variants,size_t sample);
+
+public:
+
+    static void Generate(const SyntheticScenario & scenario,size_t nThreads=1);    //Samples are written in parallel
+    static void ReadTruth(const string & filename,vector<SyntheticTruth> & truth);
+};
+//----------------------------------------------------------------
+#endif // SYNTHETIC_DATA_H
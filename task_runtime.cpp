@@ -0,0 +1,165 @@
+//----------------------------------------------------------------
+// Name        : task_runtime.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Work stealing task runtime with per worker deques
+//----------------------------------------------------------------
+#include <cstdint>
+#include "task_runtime.h"
+//----------------------------------------------------------------
+static thread_local const TaskRuntime * currentRuntime=nullptr;
+static thread_local size_t currentWorkerIndex=SIZE_MAX;
+//----------------------------------------------------------------
+TaskRuntime::TaskRuntime(size_t nWorkers) : nQueued(0),nextWorker(0),stop(false)
+{
+    nWorkers=max(nWorkers,size_t(1));
+
+    for(size_t i=0;i<nWorkers;i++) workers.emplace_back(new Worker());
+    for(size_t i=0;i<nWorkers;i++) threads.emplace_back(&TaskRuntime::WorkerLoop,this,i);
+}
+//----------------------------------------------------------------
+TaskRuntime::~TaskRuntime(void)
+{
+    {
+        lock_guard<mutex> guard(wakeLock);
+        stop=true;
+    }
+
+    wake.notify_all();
+    for(auto & thread : threads) thread.join();
+}
+//----------------------------------------------------------------
+size_t TaskRuntime::CurrentWorker(void) const
+{
+    return currentRuntime==this ? currentWorkerIndex : SIZE_MAX;
+}
+//----------------------------------------------------------------
+bool TaskRuntime::Pop(size_t workerIndex,const TaskGroup * group,Task & task)   //Newest task of the own deque (Optionally only if it belongs to group)
+{
+    Worker & worker=*workers[workerIndex];
+    lock_guard<mutex> guard(worker.lock);
+
+    if(worker.tasks.empty() || (group!=nullptr && worker.tasks.back().group!=group)) return false;
+
+    task=move(worker.tasks.back()); worker.tasks.pop_back();
+    nQueued.fetch_sub(1,memory_order_relaxed);
+    return true;
+}
+//----------------------------------------------------------------
+bool TaskRuntime::Steal(size_t workerIndex,Task & task)     //Oldest task (Largest range) of another worker
+{
+    size_t nWorkers=workers.size();
+
+    for(size_t i=1;i<nWorkers;i++)
+    {
+        Worker & victim=*workers[(workerIndex+i)%nWorkers];
+        lock_guard<mutex> guard(victim.lock);
+
+        if(victim.tasks.empty()) continue;
+
+        task=move(victim.tasks.front()); victim.tasks.pop_front();
+        nQueued.fetch_sub(1,memory_order_relaxed);
+        return true;
+    }
+
+    return false;
+}
+//----------------------------------------------------------------
+void TaskRuntime::Execute(size_t workerIndex,Task & task)
+{
+    TaskGroup * group=task.group;
+
+    try
+    {
+        task.function(workerIndex);
+    }
+    catch(...)
+    {
+        lock_guard<mutex> guard(group->lock);
+        if(group->error==nullptr) group->error=current_exception();
+    }
+
+    task.function=nullptr;  //Release captured state before the group can be destroyed
+
+    lock_guard<mutex> guard(group->lock);
+    if(group->nPending.fetch_sub(1)==1) group->done.notify_all();
+}
+//----------------------------------------------------------------
+void TaskRuntime::WorkerLoop(size_t workerIndex)
+{
+    currentRuntime=this; currentWorkerIndex=workerIndex;
+
+    for(;;)
+    {
+        Task task;
+
+        if(Pop(workerIndex,nullptr,task) || Steal(workerIndex,task))
+        {
+            Execute(workerIndex,task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(wakeLock);
+        wake.wait(lock,[this]{return stop || nQueued.load()>0;});
+        if(stop) return;
+    }
+}
+//----------------------------------------------------------------
+void TaskRuntime::Spawn(TaskGroup & group,Function function)
+{
+    size_t workerIndex=CurrentWorker(); if(workerIndex==SIZE_MAX) workerIndex=nextWorker.fetch_add(1,memory_order_relaxed)%workers.size();
+
+    group.nPending.fetch_add(1);
+
+    {
+        Worker & worker=*workers[workerIndex];
+        lock_guard<mutex> guard(worker.lock);
+        worker.tasks.emplace_back(move(function),&group);
+    }
+
+    nQueued.fetch_add(1);
+
+    {lock_guard<mutex> guard(wakeLock);}
+    wake.notify_one();
+}
+//----------------------------------------------------------------
+void TaskRuntime::Wait(TaskGroup & group)
+{
+    size_t workerIndex=CurrentWorker();
+
+    if(workerIndex!=SIZE_MAX)   //Called from within a task: help by running tasks of this group from the own deque, then block (Only this worker pushes to its deque, so none of the group appear there later)
+    {
+        for(Task task;group.nPending.load()>0 && Pop(workerIndex,&group,task);) Execute(workerIndex,task);
+    }
+
+    unique_lock<mutex> lock(group.lock);
+    group.done.wait(lock,[&group]{return group.nPending.load()==0;});
+
+    if(group.error!=nullptr)
+    {
+        exception_ptr error=group.error; group.error=nullptr;
+        rethrow_exception(error);
+    }
+}
+//----------------------------------------------------------------
+static void SplitRange(TaskRuntime & runtime,TaskGroup & group,size_t begin,size_t end,size_t grainSize,const function<void(size_t,size_t,size_t)> * body,size_t workerIndex)
+{
+    while(end-begin>grainSize)  //Leave the upper half for thieves and continue with the lower half
+    {
+        size_t middle=begin+(end-begin)/2;
+        runtime.Spawn(group,[&runtime,&group,middle,end,grainSize,body](size_t workerIndex){SplitRange(runtime,group,middle,end,grainSize,body,workerIndex);});
+        end=middle;
+    }
+
+    (*body)(begin,end,workerIndex);
+}
+//----------------------------------------------------------------
+void TaskRuntime::ForRange(TaskGroup & group,size_t begin,size_t end,size_t grainSize,const function<void(size_t begin,size_t end,size_t workerIndex)> & body)
+{
+    if(begin>=end) return;
+
+    grainSize=max(grainSize,size_t(1)); const auto * pBody=&body;   //body must stay alive until the group is waited for
+    Spawn(group,[this,&group,begin,end,grainSize,pBody](size_t workerIndex){SplitRange(*this,group,begin,end,grainSize,pBody,workerIndex);});
+}
+//----------------------------------------------------------------
@@ -0,0 +1,92 @@
+//----------------------------------------------------------------
+#ifndef TASK_RUNTIME_H
+#define TASK_RUNTIME_H
+//----------------------------------------------------------------
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+class TaskGroup     //Set of tasks that can be waited for (Tasks may spawn more tasks in the same or another group)
+{
+private:
+
+    friend class TaskRuntime;
+
+    atomic<size_t> nPending;
+
+    mutex lock;
+    condition_variable done;
+    exception_ptr error;
+
+public:
+
+    TaskGroup(void) : nPending(0) {}
+};
+//----------------------------------------------------------------
+class TaskRuntime   //Small work stealing runtime: every worker owns a deque, pops its own tasks LIFO and steals FIFO from others
+{
+public:
+
+    typedef function<void(size_t workerIndex)> Function;
+
+private:
+
+    class Task
+    {
+    private:
+    public:
+
+        Function function;
+        TaskGroup * group;
+
+        Task(void) : group(nullptr) {}
+        Task(Function && function,TaskGroup * group) : function(move(function)),group(group) {}
+    };
+
+    class Worker
+    {
+    private:
+    public:
+
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<Worker> > workers;
+    vector<thread> threads;
+
+    atomic<size_t> nQueued;
+    atomic<size_t> nextWorker;
+
+    bool stop;
+    mutex wakeLock;
+    condition_variable wake;
+
+    bool Pop(size_t workerIndex,const TaskGroup * group,Task & task);
+    bool Steal(size_t workerIndex,Task & task);
+    void Execute(size_t workerIndex,Task & task);
+    void WorkerLoop(size_t workerIndex);
+
+public:
+
+    TaskRuntime(size_t nWorkers);
+    ~TaskRuntime(void);
+
+    size_t GetNumWorkers(void) const {return workers.size();}
+    size_t CurrentWorker(void) const;
+
+    void Spawn(TaskGroup & group,Function function);
+    void Wait(TaskGroup & group);
+
+    void ForRange(TaskGroup & group,size_t begin,size_t end,size_t grainSize,const function<void(size_t begin,size_t end,size_t workerIndex)> & body);
+};
+//----------------------------------------------------------------
+#endif // TASK_RUNTIME_H
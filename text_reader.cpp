@@ -0,0 +1,518 @@
+//----------------------------------------------------------------
+// Name        : text_reader.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Read lines of plain, gzip, bgzf or bzip2 compressed text files without external processes
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <libdeflate.h>
+#include "text_reader.h"
+//----------------------------------------------------------------
+#define READ_SIZE           4194304     //Bytes read from the file or decompressed per call
+#define BGZF_BATCH_SIZE     1048576     //Compressed bytes per bgzf batch (Decompressed by one thread)
+#define BGZF_MAX_BLOCK_SIZE 65536
+#define BGZF_HEADER_SIZE    18
+#define BGZF_FOOTER_SIZE    8
+//----------------------------------------------------------------
+static inline uint16_t LoadU16(const uint8_t * p){return uint16_t(p[0])|uint16_t(p[1]<<8);}
+static inline uint32_t LoadU32(const uint8_t * p){return uint32_t(p[0])|(uint32_t(p[1])<<8)|(uint32_t(p[2])<<16)|(uint32_t(p[3])<<24);}
+//----------------------------------------------------------------
+static size_t BGZFBlockSize(const uint8_t * p,size_t size)   //Size of the bgzf block at p or 0 if p does not start with a bgzf header
+{
+    if(size<BGZF_HEADER_SIZE || p[0]!=31 || p[1]!=139 || p[2]!=8 || (p[3]&4)==0) return 0;
+
+    size_t xLen=LoadU16(p+10);
+
+    for(size_t i=12,iEnd=min(size,12+xLen);i+4<=iEnd;i+=4+LoadU16(p+i+2))
+    {
+        if(p[i]==66 && p[i+1]==67 && LoadU16(p+i+2)==2) return size_t(LoadU16(p+i+4))+1;
+    }
+
+    return 0;
+}
+//----------------------------------------------------------------
+static size_t ReadFile(int fd,void * dest,size_t size,const string & filename)
+{
+    size_t nRead=0;
+
+    while(nRead<size)
+    {
+        ssize_t n=read(fd,(char*)dest+nRead,size-nRead);
+        if(n<0) throw runtime_error(string("Error: Could not read file: ")+filename);
+        if(n==0) break;
+        nRead+=size_t(n);
+    }
+
+    return nRead;
+}
+//----------------------------------------------------------------
+class PlainSource : public TextSource
+{
+private:
+
+    int fd; string filename;
+
+public:
+
+    PlainSource(int fd,const string & filename) : fd(fd),filename(filename) {}
+    ~PlainSource(void) override {close(fd);}
+
+    size_t Read(char * dest,size_t size) override {return ReadFile(fd,dest,size,filename);}
+};
+//----------------------------------------------------------------
+class GzipSource : public TextSource     //Streaming inflate (Concatenated members are read as one stream)
+{
+private:
+
+    int fd; string filename;
+
+    z_stream stream; vector<uint8_t> input; bool endOfFile; bool inMember;
+
+public:
+
+    GzipSource(int fd,const string & filename) : fd(fd),filename(filename),input(READ_SIZE),endOfFile(false),inMember(false)
+    {
+        memset(&stream,0,sizeof(stream));
+
+        if(inflateInit2(&stream,15+32)!=Z_OK)
+        {
+            close(fd);
+            throw runtime_error(string("Error: Could not initialize gzip decompression: ")+filename);
+        }
+    }
+
+    ~GzipSource(void) override {inflateEnd(&stream); close(fd);}
+
+    bool NextMember(void)   //True if the bytes after a member start another member
+    {
+        while(stream.avail_in<2 && endOfFile==false)
+        {
+            memmove(input.data(),stream.next_in,stream.avail_in);
+
+            size_t n=ReadFile(fd,input.data()+stream.avail_in,input.size()-stream.avail_in,filename);
+
+            stream.next_in=input.data(); stream.avail_in+=uInt(n);
+            if(n==0) endOfFile=true;
+        }
+
+        return stream.avail_in>=2 && stream.next_in[0]==31 && stream.next_in[1]==139;
+    }
+
+    size_t Read(char * dest,size_t size) override
+    {
+        stream.next_out=(Bytef*)dest; stream.avail_out=uInt(min(size,size_t(UINT32_MAX)));
+
+        while(stream.avail_out>0)
+        {
+            if(stream.avail_in==0)
+            {
+                if(endOfFile) break;
+
+                size_t n=ReadFile(fd,input.data(),input.size(),filename);
+
+                if(n==0)
+                {
+                    if(inMember) throw runtime_error(string("Error: Truncated gzip file: ")+filename);
+                    endOfFile=true; break;
+                }
+
+                stream.next_in=input.data(); stream.avail_in=uInt(n);
+            }
+
+            int ret=inflate(&stream,Z_NO_FLUSH);
+
+            if(ret==Z_STREAM_END)
+            {
+                inflateReset(&stream); inMember=false;
+                if(NextMember()) continue;
+
+                stream.avail_in=0; endOfFile=true; break;   //Zero padding or garbage after the last member is ignored (As zcat does)
+            }
+            if(ret!=Z_OK && ret!=Z_BUF_ERROR) throw runtime_error(string("Error: Could not decompress gzip file: ")+filename);
+
+            inMember=true;
+        }
+
+        return size_t((char*)stream.next_out-dest);
+    }
+};
+//----------------------------------------------------------------
+class Bzip2Source : public TextSource    //Streaming bzip2 (Concatenated streams are read as one stream)
+{
+private:
+
+    int fd; string filename;
+
+    bz_stream stream; vector<char> input; bool endOfFile; bool inStream;
+
+public:
+
+    Bzip2Source(int fd,const string & filename) : fd(fd),filename(filename),input(READ_SIZE),endOfFile(false),inStream(false)
+    {
+        memset(&stream,0,sizeof(stream));
+
+        if(BZ2_bzDecompressInit(&stream,0,0)!=BZ_OK)
+        {
+            close(fd);
+            throw runtime_error(string("Error: Could not initialize bzip2 decompression: ")+filename);
+        }
+    }
+
+    ~Bzip2Source(void) override {BZ2_bzDecompressEnd(&stream); close(fd);}
+
+    size_t Read(char * dest,size_t size) override
+    {
+        stream.next_out=dest; stream.avail_out=unsigned(min(size,size_t(UINT32_MAX)));
+
+        while(stream.avail_out>0)
+        {
+            if(stream.avail_in==0)
+            {
+                if(endOfFile) break;
+
+                size_t n=ReadFile(fd,input.data(),input.size(),filename);
+
+                if(n==0)
+                {
+                    if(inStream) throw runtime_error(string("Error: Truncated bzip2 file: ")+filename);
+                    endOfFile=true; break;
+                }
+
+                stream.next_in=input.data(); stream.avail_in=unsigned(n);
+            }
+
+            int ret=BZ2_bzDecompress(&stream);
+
+            if(ret==BZ_STREAM_END)  //Next stream
+            {
+                char * nextIn=stream.next_in; unsigned availIn=stream.avail_in; char * nextOut=stream.next_out; unsigned availOut=stream.avail_out;
+
+                BZ2_bzDecompressEnd(&stream); memset(&stream,0,sizeof(stream));
+                if(BZ2_bzDecompressInit(&stream,0,0)!=BZ_OK) throw runtime_error(string("Error: Could not initialize bzip2 decompression: ")+filename);
+
+                stream.next_in=nextIn; stream.avail_in=availIn; stream.next_out=nextOut; stream.avail_out=availOut;
+                inStream=false; continue;
+            }
+
+            if(ret!=BZ_OK) throw runtime_error(string("Error: Could not decompress bzip2 file: ")+filename);
+
+            inStream=true;
+        }
+
+        return size_t(stream.next_out-dest);
+    }
+};
+//----------------------------------------------------------------
+class BGZFSource : public TextSource     //Batches of whole blocks are cut from the file in order and inflated by a pool of threads
+{
+private:
+
+    int fd; string filename;
+
+    size_t maxBatchesInFlight;
+
+    mutex lock;
+    condition_variable batchReady;
+    condition_variable slotFree;
+
+    bool stop;
+    bool endOfFile;
+    uint64_t nBatches;      //Batches cut so far
+    uint64_t nextBatch;     //Next batch to hand to the reader
+    vector<uint8_t> carry;  //Partial block at the end of the last batch
+    map<uint64_t,vector<char> > batches;
+    exception_ptr error;
+
+    vector<thread> threads;
+
+    vector<char> current; size_t currentOffset;
+
+    void Inflate(const vector<uint8_t> & compressed,vector<char> & decompressed)
+    {
+        static thread_local unique_ptr<libdeflate_decompressor,void(*)(libdeflate_decompressor*)> decompressor(libdeflate_alloc_decompressor(),libdeflate_free_decompressor);
+
+        size_t totalSize=0;
+
+        for(size_t offset=0,blockSize;offset<compressed.size();offset+=blockSize)
+        {
+            blockSize=BGZFBlockSize(&compressed[offset],compressed.size()-offset);
+            totalSize+=LoadU32(&compressed[offset+blockSize-4]);
+        }
+
+        decompressed.resize(totalSize); char * dest=decompressed.data();
+
+        for(size_t offset=0,blockSize;offset<compressed.size();offset+=blockSize)
+        {
+            const uint8_t * block=&compressed[offset]; blockSize=BGZFBlockSize(block,compressed.size()-offset);
+
+            size_t xLen=LoadU16(block+10); const uint8_t * footer=block+blockSize-BGZF_FOOTER_SIZE;
+            uint32_t crc=LoadU32(footer); size_t iSize=LoadU32(footer+4);
+
+            if(iSize==0) continue;
+
+            size_t actualSize;
+            if(libdeflate_deflate_decompress(decompressor.get(),block+12+xLen,blockSize-12-xLen-BGZF_FOOTER_SIZE,dest,iSize,&actualSize)!=LIBDEFLATE_SUCCESS || actualSize!=iSize) throw runtime_error(string("Error: Could not inflate bgzf block: ")+filename);
+            if(libdeflate_crc32(0,dest,iSize)!=crc) throw runtime_error(string("Error: CRC mismatch in bgzf block: ")+filename);
+
+            dest+=iSize;
+        }
+    }
+
+    void Work(void)
+    {
+        for(;;)
+        {
+            uint64_t batch; vector<uint8_t> compressed;
+
+            //----------------------------------------------------------------
+            //Cut the next batch of whole blocks (In file order)
+            //----------------------------------------------------------------
+
+            {
+                unique_lock<mutex> guard(lock);
+                slotFree.wait(guard,[this]{return stop || endOfFile || nBatches<nextBatch+maxBatchesInFlight;});
+                if(stop || endOfFile) return;
+
+                try
+                {
+                    compressed.swap(carry); size_t carrySize=compressed.size();
+                    compressed.resize(carrySize+BGZF_BATCH_SIZE);
+                    size_t n=ReadFile(fd,&compressed[carrySize],BGZF_BATCH_SIZE,filename); compressed.resize(carrySize+n);
+
+                    size_t end=0; for(size_t blockSize;end<compressed.size();end+=blockSize)
+                    {
+                        blockSize=BGZFBlockSize(&compressed[end],compressed.size()-end);
+
+                        if(blockSize==0 && compressed.size()-end>=BGZF_HEADER_SIZE) throw runtime_error(string("Error: Invalid bgzf block header: ")+filename);
+                        if(blockSize==0 || end+blockSize>compressed.size()) break;
+                        if(blockSize<BGZF_HEADER_SIZE+BGZF_FOOTER_SIZE || LoadU32(&compressed[end+blockSize-4])>BGZF_MAX_BLOCK_SIZE) throw runtime_error(string("Error: Invalid bgzf block: ")+filename);
+                    }
+
+                    if(n==0)
+                    {
+                        if(end!=compressed.size()) throw runtime_error(string("Error: Truncated bgzf file: ")+filename);
+                        endOfFile=true;
+                    }
+
+                    carry.assign(compressed.begin()+long(end),compressed.end()); compressed.resize(end);
+                }
+                catch(...)
+                {
+                    if(error==nullptr) error=current_exception();
+                    endOfFile=true; batchReady.notify_all(); slotFree.notify_all();
+                    return;
+                }
+
+                batch=nBatches++;
+                if(endOfFile) slotFree.notify_all();
+            }
+
+            //----------------------------------------------------------------
+            //Inflate outside the lock
+            //----------------------------------------------------------------
+
+            vector<char> decompressed; exception_ptr inflateError;
+
+            try {Inflate(compressed,decompressed);} catch(...) {inflateError=current_exception();}
+
+            lock_guard<mutex> guard(lock);
+            if(inflateError!=nullptr && error==nullptr) error=inflateError;
+            batches[batch].swap(decompressed); batchReady.notify_all();
+        }
+    }
+
+public:
+
+    BGZFSource(int fd,const string & filename,size_t nThreads) : fd(fd),filename(filename),maxBatchesInFlight(2*nThreads),stop(false),endOfFile(false),nBatches(0),nextBatch(0),currentOffset(0)
+    {
+        for(size_t i=0;i<nThreads;i++) threads.emplace_back(&BGZFSource::Work,this);
+    }
+
+    ~BGZFSource(void) override
+    {
+        {lock_guard<mutex> guard(lock); stop=true;}
+        slotFree.notify_all();
+        for(auto & thread : threads) thread.join();
+        close(fd);
+    }
+
+    size_t Read(char * dest,size_t size) override
+    {
+        while(currentOffset==current.size())
+        {
+            unique_lock<mutex> guard(lock);
+            batchReady.wait(guard,[this]{return error!=nullptr || batches.count(nextBatch)!=0 || (endOfFile && nextBatch==nBatches);});
+
+            if(error!=nullptr) rethrow_exception(error);
+
+            auto batch=batches.find(nextBatch); if(batch==batches.end()) return 0;  //End of file
+
+            current.swap(batch->second); currentOffset=0;
+            batches.erase(batch); nextBatch++;
+            slotFree.notify_all();
+        }
+
+        size_t n=min(size,current.size()-currentOffset);
+        memcpy(dest,&current[currentOffset],n); currentOffset+=n;
+        return n;
+    }
+};
+//----------------------------------------------------------------
+TextReader::TextReader(void) : lineBegin(0),dataEnd(0),endOfSource(true),compressed(false) {}
+//----------------------------------------------------------------
+TextReader::TextReader(const string & filename,size_t nThreads) : lineBegin(0),dataEnd(0),endOfSource(true),compressed(false) {Open(filename,nThreads);}
+//----------------------------------------------------------------
+void TextReader::Open(const string & filename,size_t nThreads)
+{
+    Close();
+
+    int fd=open(filename.c_str(),O_RDONLY);
+
+    if(fd==-1) throw runtime_error(string("Error: Could not open file: ")+filename);
+
+    //----------------------------------------------------------------
+    //Detect compression from the first bytes (Files that can not be peeked at are read as plain text)
+    //----------------------------------------------------------------
+
+    uint8_t magic[BGZF_HEADER_SIZE]; ssize_t nMagic=pread(fd,magic,sizeof(magic),0);
+
+    if(nMagic>=BGZF_HEADER_SIZE && BGZFBlockSize(magic,size_t(nMagic))!=0) source.reset(new BGZFSource(fd,filename,max(nThreads,size_t(1))));
+    else if(nMagic>=2 && magic[0]==31 && magic[1]==139) source.reset(new GzipSource(fd,filename));
+    else if(nMagic>=3 && magic[0]=='B' && magic[1]=='Z' && magic[2]=='h') source.reset(new Bzip2Source(fd,filename));
+    else source.reset(new PlainSource(fd,filename));
+
+    this->filename=filename; compressed=dynamic_cast<PlainSource*>(source.get())==nullptr;
+    buffer.assign(READ_SIZE+1,'\0'); lineBegin=0; dataEnd=0; endOfSource=false;
+}
+//----------------------------------------------------------------
+void TextReader::Close(void)
+{
+    source.reset(); filename.clear(); compressed=false;
+    vector<char>().swap(buffer); lineBegin=0; dataEnd=0; endOfSource=true;
+}
+//----------------------------------------------------------------
+char * TextReader::ReadLine(void)
+{
+    if(source==nullptr) return nullptr;
+
+    for(size_t scanBegin=lineBegin;;)
+    {
+        char * newLine=(char*)memchr(buffer.data()+scanBegin,'\n',dataEnd-scanBegin);
+
+        if(newLine!=nullptr)
+        {
+            char * line=buffer.data()+lineBegin; *newLine='\0';
+            lineBegin=size_t(newLine-buffer.data())+1;
+            return line;
+        }
+
+        if(endOfSource)
+        {
+            if(lineBegin==dataEnd) return nullptr;
+
+            char * line=buffer.data()+lineBegin; buffer[dataEnd]='\0';  //Last line without line end
+            lineBegin=dataEnd;
+            return line;
+        }
+
+        //----------------------------------------------------------------
+        //Move the partial line to the front and append decompressed data (The buffer grows for long lines)
+        //----------------------------------------------------------------
+
+        size_t partialSize=dataEnd-lineBegin;
+        memmove(buffer.data(),buffer.data()+lineBegin,partialSize); lineBegin=0; dataEnd=partialSize; scanBegin=partialSize;
+
+        if(buffer.size()-dataEnd<READ_SIZE+1) buffer.resize(max(2*buffer.size(),dataEnd+READ_SIZE+1));
+
+        size_t n=source->Read(buffer.data()+dataEnd,buffer.size()-dataEnd-1);
+        if(n==0) endOfSource=true;
+        dataEnd+=n;
+    }
+}
+//----------------------------------------------------------------
+size_t TextReader::Read(char * dest,size_t size)
+{
+    return source!=nullptr ? source->Read(dest,size) : 0;
+}
+//----------------------------------------------------------------
+TextFile::TextFile(void) : mapped(MAP_FAILED),mappedSize(0),data(""),size(0) {}
+//----------------------------------------------------------------
+TextFile::TextFile(const string & filename,size_t nThreads) : mapped(MAP_FAILED),mappedSize(0),data(""),size(0) {Open(filename,nThreads);}
+//----------------------------------------------------------------
+TextFile::~TextFile(void) {Close();}
+//----------------------------------------------------------------
+void TextFile::Open(const string & filename,size_t nThreads)
+{
+    Close();
+
+    TextReader reader(filename,nThreads);
+
+    //----------------------------------------------------------------
+    //Compressed files are decompressed into one buffer
+    //----------------------------------------------------------------
+
+    if(reader.IsCompressed())
+    {
+        size_t n; do
+        {
+            buffer.resize(size+READ_SIZE);
+            n=reader.Read(buffer.data()+size,READ_SIZE); size+=n;
+        }
+        while(n>0);
+
+        buffer.resize(size); buffer.shrink_to_fit();
+        data=size>0 ? buffer.data() : "";
+        return;
+    }
+
+    //----------------------------------------------------------------
+    //Plain files are mapped
+    //----------------------------------------------------------------
+
+    reader.Close();
+
+    int fd=open(filename.c_str(),O_RDONLY);
+
+    struct stat fileStat;
+
+    if(fd==-1 || fstat(fd,&fileStat)==-1)
+    {
+        if(fd!=-1) close(fd);
+        throw runtime_error(string("Error: Could not open file: ")+filename);
+    }
+
+    if(fileStat.st_size==0) {close(fd); return;}
+
+    void * mapped=mmap(nullptr,size_t(fileStat.st_size),PROT_READ,MAP_PRIVATE,fd,0);
+
+    close(fd);
+
+    if(mapped==MAP_FAILED) throw runtime_error(string("Error: Could not memory map file: ")+filename);
+
+    madvise(mapped,size_t(fileStat.st_size),MADV_SEQUENTIAL);
+
+    this->mapped=mapped; mappedSize=size_t(fileStat.st_size);
+    data=(const char*)mapped; size=mappedSize;
+}
+//----------------------------------------------------------------
+void TextFile::Close(void)
+{
+    if(mapped!=MAP_FAILED) munmap(mapped,mappedSize);
+    mapped=MAP_FAILED; mappedSize=0;
+
+    vector<char>().swap(buffer); data=""; size=0;
+}
+//----------------------------------------------------------------
@@ -0,0 +1,83 @@
+//----------------------------------------------------------------
+#ifndef TEXT_READER_H
+#define TEXT_READER_H
+//----------------------------------------------------------------
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <immintrin.h>
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+inline const char * FindChar(const char * p,const char * end,char c)  //AVX2 memchr (Returns end if c is not found)
+{
+    const __m256i needle=_mm256_set1_epi8(c);
+
+    for(;p+32<=end;p+=32)
+    {
+        uint32_t mask=uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p),needle)));
+        if(mask!=0) return p+__builtin_ctz(mask);
+    }
+
+    for(;p<end && *p!=c;p++){}
+    return p;
+}
+//----------------------------------------------------------------
+class TextSource    //Decompressed byte stream of a plain, gzip, bgzf or bzip2 file
+{
+private:
+public:
+
+    virtual ~TextSource(void){}
+    virtual size_t Read(char * dest,size_t size)=0;    //Returns 0 at the end of the stream
+};
+//----------------------------------------------------------------
+class TextReader    //Line reader that detects the compression of a file and decompresses it in process (Bgzf blocks in parallel)
+{
+private:
+
+    string filename;
+    unique_ptr<TextSource> source;
+
+    vector<char> buffer; size_t lineBegin,dataEnd; bool endOfSource;
+    bool compressed;
+
+public:
+
+    TextReader(void);
+    TextReader(const string & filename,size_t nThreads=1);
+
+    void Open(const string & filename,size_t nThreads=1);
+    void Close(void);
+
+    bool IsCompressed(void) const {return compressed;}
+
+    char * ReadLine(void);  //Next line without line end (Points into the decompressed buffer and stays valid until the next call) or nullptr at the end of the file
+    size_t Read(char * dest,size_t size);  //Raw decompressed bytes (Do not mix with ReadLine)
+};
+//----------------------------------------------------------------
+class TextFile      //Whole text file in memory: memory mapped if plain, otherwise decompressed into one buffer
+{
+private:
+
+    void * mapped; size_t mappedSize;
+    vector<char> buffer;
+
+public:
+
+    const char * data;
+    size_t size;
+
+    TextFile(void);
+    TextFile(const string & filename,size_t nThreads=1);
+    ~TextFile(void);
+
+    TextFile(const TextFile &)=delete;
+    TextFile & operator=(const TextFile &)=delete;
+
+    void Open(const string & filename,size_t nThreads=1);
+    void Close(void);
+};
+//----------------------------------------------------------------
+#endif // TEXT_READER_H
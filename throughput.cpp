@@ -0,0 +1,191 @@
+//----------------------------------------------------------------
+// Name        : throughput.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : End to end throughput of AnnotateBamStatistics::Run on synthetic scenarios, checked against the injected VAFs
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+#include <getopt.h>
+#include "text_reader.h"
+#include "synthetic_data.h"
+#include "bgzf_block_cache.h"
+#include "annotate_bam_statistics.h"
+//----------------------------------------------------------------
+#define SHORT_OPTIONS   "o:t:s:h"
+#define MAX_VAF_ERROR   0.1     //Allowed alt_freq error on top of four binomial standard deviations
+#define MAX_REPORTED    10      //Failed variants reported per run
+//----------------------------------------------------------------
+static vector<SyntheticScenario> Scenarios(const string & prefix)
+{
+    vector<SyntheticScenario> scenarios;
+
+    SyntheticScenario scenario; scenario.name=prefix+"_short_paired";
+    scenarios.push_back(scenario);
+
+    scenario=SyntheticScenario(); scenario.name=prefix+"_deep_single";
+    scenario.nContigs=1; scenario.contigLength=200000; scenario.nSamples=1; scenario.readLength=100; scenario.paired=false; scenario.depth=1000.0; scenario.duplicateRate=0.1;
+    scenarios.push_back(scenario);
+
+    scenario=SyntheticScenario(); scenario.name=prefix+"_long_reads";
+    scenario.nContigs=1; scenario.contigLength=1000000; scenario.nSamples=1; scenario.readLength=10000; scenario.paired=false; scenario.depth=30.0; scenario.duplicateRate=0.0;
+    scenarios.push_back(scenario);
+
+    return scenarios;
+}
+//----------------------------------------------------------------
+static void CheckOutput(const string & filename,const vector<SyntheticTruth> & truth,bool isVEP,size_t & nChecked,size_t & nFailed)   //Compares alt_freq of every sample with the injected VAF
+{
+    unordered_map<string,const SyntheticTruth*> variants; for(const auto & entry : truth) variants.emplace(isVEP ? entry.vepKey : entry.annovarKey,&entry);
+
+    TextReader reader(filename); char * line=reader.ReadLine();
+    if(line==nullptr) throw runtime_error(string("Error: Empty output file: ")+filename);
+
+    //----------------------------------------------------------------
+    //Locate the sample columns (The sample name column is followed by total_depth unknown ambiguous depth alt_depth alt_freq)
+    //----------------------------------------------------------------
+
+    vector<string> fields; auto split=[&fields](char * line){fields.clear(); for(char * field;(field=strsep(&line,"\t"))!=nullptr;) fields.emplace_back(field);};
+
+    split(line); vector<size_t> sampleColumns;
+
+    for(size_t i=0;i<fields.size();i++) if(fields[i].empty()==false && fields[i].back()==':') sampleColumns.push_back(i);
+    if(sampleColumns.empty() || sampleColumns.back()+6>=fields.size()) throw runtime_error(string("Error: No sample columns in output file: ")+filename);
+
+    //----------------------------------------------------------------
+    //Check rows
+    //----------------------------------------------------------------
+
+    size_t nSeen=0,nReported=0; nChecked=nFailed=0;
+
+    while((line=reader.ReadLine())!=nullptr)
+    {
+        if(line[0]=='\0') continue;
+
+        split(line); if(fields.size()<=sampleColumns.back()+6) throw runtime_error(string("Error: Inconsistent number of columns in output file: ")+filename);
+
+        string key=isVEP ? fields[0] : fields[0]+"\t"+fields[1]+"\t"+fields[2]+"\t"+fields[3]+"\t"+fields[4];
+        auto variant=variants.find(key); if(variant==variants.end()) throw runtime_error(string("Error: Variant not in truth file: ")+key);
+
+        nSeen++;
+
+        for(size_t sample=0;sample<sampleColumns.size() && sample<variant->second->vafs.size();sample++)
+        {
+            double vaf=variant->second->vafs[sample]; double depth=stod(fields[sampleColumns[sample]+4]); double altFreq=stod(fields[sampleColumns[sample]+6]);
+            double maxError=MAX_VAF_ERROR+4.0*sqrt(vaf*(1.0-vaf)/max(depth,1.0));
+
+            nChecked++; if(depth>0.0 && fabs(altFreq-vaf)<=maxError) continue;
+
+            nFailed++; if(nReported++<MAX_REPORTED) cerr << "Warning: " << varStrings[variant->second->varType] << " " << key << " sample " << sample << ": alt_freq " << altFreq << " at depth " << depth << " expected " << vaf << endl;
+        }
+    }
+
+    if(nSeen!=truth.size()) throw runtime_error(string("Error: Not all injected variants in output file: ")+filename);
+}
+//----------------------------------------------------------------
+int main(int argc,char * argv[])
+{
+    static struct option longOptions[]=
+    {
+        {"output-prefix",required_argument,nullptr,'o'},
+        {"threads",required_argument,nullptr,'t'},
+        {"scenario",required_argument,nullptr,'s'},
+        {"help",no_argument,nullptr,'h'},
+        {nullptr,0,nullptr,0}
+    };
+
+    string prefix="synthetic",scenarioName; size_t maxThreads=max(size_t(thread::hardware_concurrency()),size_t(1));
+
+    try
+    {
+        for(int option;(option=getopt_long(argc,argv,SHORT_OPTIONS,longOptions,nullptr))!=-1;)
+        {
+            switch(option)
+            {
+            case 'o': prefix=optarg; break;
+            case 't': maxThreads=size_t(max(atoll(optarg),1LL)); break;
+            case 's': scenarioName=optarg; break;
+            default:
+
+                cerr << "enhanced_ABS_throughput [options] > results.tsv"                                                               << endl;
+                cerr                                                                                                                    << endl;
+                cerr << "-o --output-prefix <text>  Prefix of the synthetic files (optional default=synthetic)"                         << endl;
+                cerr << "-t --threads <int>         Scale from 1 to this number of threads (optional default=all cores)"                << endl;
+                cerr << "-s --scenario <text>       Only this scenario: short_paired, deep_single or long_reads (optional)"             << endl;
+                cerr                                                                                                                    << endl;
+                return option=='h' ? 0 : 1;
+            }
+        }
+
+        vector<size_t> threadCounts; for(size_t nThreads=1;nThreads<maxThreads;nThreads*=2) threadCounts.push_back(nThreads);
+        threadCounts.push_back(maxThreads);
+
+        printf("scenario\tinput\tthreads\tvariants\tseconds\tvariants_per_s\tspeedup\tchecked\tfailed\n");
+
+        size_t nTotalFailed=0;
+
+        for(const auto & scenario : Scenarios(prefix))
+        {
+            string name=scenario.name.substr(prefix.size()+1); if(scenarioName.empty()==false && scenarioName!=name) continue;
+
+            //----------------------------------------------------------------
+            //Generate the scenario
+            //----------------------------------------------------------------
+
+            cerr << "Info: Generate " << name << endl;
+            SyntheticData::Generate(scenario,maxThreads);
+
+            vector<SyntheticTruth> truth; SyntheticData::ReadTruth(scenario.TruthFilename(),truth);
+
+            string bamFilenames; for(size_t sample=0;sample<scenario.nSamples;sample++) bamFilenames+=(sample>0 ? "," : "")+scenario.BamFilename(sample);
+
+            //----------------------------------------------------------------
+            //Run both inputs from 1 to the maximum number of threads
+            //----------------------------------------------------------------
+
+            for(bool isVEP : {false,true})
+            {
+                double baseSeconds=0.0;
+
+                for(size_t nThreads : threadCounts)
+                {
+                    string outputFilename=scenario.name+(isVEP ? ".vep" : ".annovar")+".out"+to_string(nThreads)+".txt";
+
+                    vector<string> arguments={"enhanced_ABS","-f",scenario.FastaFilename(),"-V",scenario.VCFFilename(),isVEP ? "-e" : "-a",isVEP ? scenario.VEPFilename() : scenario.AnnovarFilename(),"-b",bamFilenames,"-t",to_string(nThreads),"-o",outputFilename};
+                    vector<char*> argv; for(auto & argument : arguments) argv.push_back(&argument[0]);
+                    argv.push_back(nullptr);
+
+                    optind=0;   //Run parses its own arguments with getopt (Zero also resets the internal state of glibc getopt)
+                    BGZFBlockCache::Instance().Clear();     //Every run starts cold like a new process
+
+                    auto startTime=chrono::steady_clock::now();
+                    if(AnnotateBamStatistics::Run(int(arguments.size()),argv.data())!=0) throw runtime_error(string("Error: Run failed on scenario: ")+name);
+                    double seconds=chrono::duration<double>(chrono::steady_clock::now()-startTime).count();
+
+                    if(nThreads==1) baseSeconds=seconds;
+
+                    size_t nChecked,nFailed; CheckOutput(outputFilename,truth,isVEP,nChecked,nFailed); nTotalFailed+=nFailed;
+
+                    printf("%s\t%s\t%lu\t%lu\t%.3f\t%.1f\t%.2f\t%lu\t%lu\n",name.c_str(),isVEP ? "vep" : "annovar",nThreads,truth.size(),seconds,double(truth.size())/seconds,baseSeconds/seconds,nChecked,nFailed);
+                    fflush(stdout);
+                }
+            }
+        }
+
+        return nTotalFailed>0 ? 1 : 0;
+    }
+    catch(const exception & e)
+    {
+        cerr << e.what() << endl;
+        return 1;
+    }
+}
+//----------------------------------------------------------------
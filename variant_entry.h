@@ -2,13 +2,17 @@
 #ifndef VARIANT_ENTRY_H
 #define VARIANT_ENTRY_H
 //----------------------------------------------------------------
-#include <iostream>
+#include <charconv>
+#include <string_view>
 #include <vector>
 #include <stdint.h>
 #include "hts.h"
+#include "fasta_file.h"
 //----------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------
+#define MAX_ENTRY_SIZE      (1+16*25)   //Leading tab plus 16 tab separated numbers
+//----------------------------------------------------------------
 class Statistics
 {
 private:
@@ -26,20 +30,21 @@ public:
 
     uint32_t mismatchesTooHigh;
 
-    hts_pos_t posSum;
-    hts_pos_t posSum2;
-
     float vafITD;
     float coeITD;
 
-    Statistics(void) : totalDepth(0U),unknown(0U),ambiguous(0U),altDepth(0U),altBias{0U,0U},hqDepth(0U),hqAltDepth(0U),hqAltBias{0U,0U},mismatchesTooHigh(0U),posSum(0U),posSum2(0U),vafITD(0.0f),coeITD(0.0f){}
+    Statistics(void) : totalDepth(0U),unknown(0U),ambiguous(0U),altDepth(0U),altBias{0U,0U},hqDepth(0U),hqAltDepth(0U),hqAltBias{0U,0U},mismatchesTooHigh(0U),vafITD(0.0f),coeITD(0.0f){}
 
-    static inline void PrintHeader(const string & fileName)
+    static inline string SampleName(const string & fileName)   //Bam file name without directory and extension
     {
         size_t pos=fileName.find_last_of("\\/")+1;
-        string sampleName=fileName.substr(pos,fileName.find_last_of('.')-pos);
+        return fileName.substr(pos,fileName.find_last_of('.')-pos);
+    }
 
-        cout    << '\t' << sampleName << ":"
+    static inline void RenderHeader(const string & fileName,string & header)  //Appends the column names of one sample
+    {
+        header+='\t'; header+=SampleName(fileName);
+        header+=":"
                 "\ttotal_depth"
                 "\tunknown"
                 "\tambiguous"
@@ -58,56 +63,47 @@ public:
                 "\tCOE_ITD";
     }
 
-    inline void PrintEntry(void) const
+    static inline char * Render(char * p,uint32_t value) {*p++='\t'; return to_chars(p,p+10,value).ptr;}
+    static inline char * Render(char * p,double value) {*p++='\t'; return to_chars(p,p+24,value,chars_format::general,6).ptr;}    //Same digits as cout with the default precision
+
+    inline char * RenderEntry(char * p) const   //Writes at most MAX_ENTRY_SIZE characters (Same text as the former cout output)
     {
         uint32_t depth=totalDepth-(unknown+ambiguous);
         uint32_t altReadDepth=max(altBias[0]+altBias[1],1U);
 
-        cout    << "\t\t" << totalDepth
-                << '\t' << unknown
-                << '\t' << ambiguous
-                << '\t' << depth
-                << '\t' << altDepth
-                << '\t' << double(altDepth) / double(max(depth,1U))
-                << '\t' << double(altBias[0]) / double(altReadDepth)
-                << '\t' << hqDepth
-                << '\t' << hqAltDepth
-                << '\t' << double(hqAltDepth) / double(max(hqDepth,1U))
-                << '\t' << double(hqAltBias[0]) / double(max(hqAltBias[0]+hqAltBias[1],1U))
-                << '\t' << double(hqDepth)/double(max(depth,1U))
-                << '\t' << double(mismatchesTooHigh)/double(altReadDepth)
-             << '\t' << double(posSum2)-double(posSum*posSum)/double(altReadDepth)
-                << '\t' << vafITD
-                << '\t' << coeITD;
+        *p++='\t';
+        p=Render(p,totalDepth);
+        p=Render(p,unknown);
+        p=Render(p,ambiguous);
+        p=Render(p,depth);
+        p=Render(p,altDepth);
+        p=Render(p,double(altDepth) / double(max(depth,1U)));
+        p=Render(p,double(altBias[0]) / double(altReadDepth));
+        p=Render(p,hqDepth);
+        p=Render(p,hqAltDepth);
+        p=Render(p,double(hqAltDepth) / double(max(hqDepth,1U)));
+        p=Render(p,double(hqAltBias[0]) / double(max(hqAltBias[0]+hqAltBias[1],1U)));
+        p=Render(p,double(hqDepth)/double(max(depth,1U)));
+        p=Render(p,double(mismatchesTooHigh)/double(altReadDepth));
+        p=Render(p,0U);     //Start position variance is not collected
+        p=Render(p,double(vafITD));
+        p=Render(p,double(coeITD));
+
+        return p;
     }
 };
 //----------------------------------------------------------------
 enum VarType {SNV=0,DEL=1,INS=2,ITD=3,PTD=4};
 inline char varStrings[][4]={"SNV","DEL","INS","ITD","PTD"};
 //----------------------------------------------------------------
-class VarEntry
+inline VarType AssessTandem(hts_pos_t pos1,string_view alt,const FastaEntry & fastaEntry,hts_pos_t & pos2)   //Classify an insertion by the reference sequence that follows it
 {
-private:
-public:
+    string refSeq=fastaEntry.Sequence(pos1,min(hts_pos_t(alt.size()),fastaEntry.len-pos1));
+    size_t i; for(i=0;i<alt.size() && i<refSeq.size() && refSeq[i]==alt[i];i++){} pos2=max(pos1+1,pos1+hts_pos_t(i)-1);
 
-    VarType varType;
-    string line,ref,alt;
-    vector<Statistics> statistics;
-
-    VarEntry(size_t nBamFiles) { statistics.assign(nBamFiles,Statistics()); }
-    VarEntry(size_t nBamFiles,char * line) : line(line) { statistics.assign(nBamFiles,Statistics()); }
-    VarEntry(size_t nBamFiles,const string & line) : line(line) { statistics.assign(nBamFiles,Statistics()); }
-
-    hts_pos_t AssessTandem(hts_pos_t pos1,const char * ref)
-    {
-        const char * alt=this->alt.c_str();
-        hts_pos_t pos2; for(pos2=pos1;*ref==*alt;pos2++,ref++,alt++){} pos2=max(pos1+1,pos2-1);
-
-        if(pos1+1==pos2) {varType=INS; return pos2;}
-        if(*alt=='\0') {varType=ITD; return pos2;}
-        varType=PTD; return pos2;
-    }
-
-};
+    if(pos1+1==pos2) return INS;
+    if(i==alt.size()) return ITD;
+    return PTD;
+}
 //----------------------------------------------------------------
 #endif // VARIANT_ENTRY_H
@@ -0,0 +1,254 @@
+//----------------------------------------------------------------
+// Name        : variant_file.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Common part of the annovar and VEP files
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <exception>
+#include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include "text_reader.h"
+#include "statistics_file.h"
+#include "variant_file.h"
+#define ROWS_PER_CHUNK      4096
+#define CHUNKS_PER_THREAD   4
+//----------------------------------------------------------------
+void VariantFile::Clear(void)
+{
+    variants.Clear();
+}
+//----------------------------------------------------------------
+void VariantFile::SortContigs(vector<size_t> & contigOrder) const
+{
+    contigOrder.resize(variants.endpoints.size()); iota(contigOrder.begin(),contigOrder.end(),size_t(0));
+    sort(contigOrder.begin(),contigOrder.end(),[this](size_t a,size_t b){return contigNames[a]<contigNames[b];});
+}
+//----------------------------------------------------------------
+template<class T,class F> static void WriteValues(OutputFile & output,size_t nValues,F value)  //One typed column written in chunks
+{
+    vector<T> buffer(min(nValues,size_t(ROWS_PER_CHUNK)));
+
+    for(size_t begin=0;begin<nValues;begin+=buffer.size())
+    {
+        size_t n=min(buffer.size(),nValues-begin); for(size_t i=0;i<n;i++) buffer[i]=T(value(begin+i));
+        output.Write((const char*)buffer.data(),n*sizeof(T));
+    }
+}
+//----------------------------------------------------------------
+VariantFile::~VariantFile(void) {}
+//----------------------------------------------------------------
+void VariantFile::WriteEntries(OutputFile & output,size_t nBamFiles,size_t nThreads)
+{
+    //----------------------------------------------------------------
+    //Collect the variants in output order
+    //----------------------------------------------------------------
+
+    vector<size_t> contigOrder; SortContigs(contigOrder);
+
+    vector<uint32_t> rows; rows.reserve(variants.Size());
+
+    for(size_t contigID : contigOrder)
+    {
+        size_t contigBegin=rows.size();
+        for(const auto & endpoint : variants.endpoints[contigID]) if(endpoint.pos<=endpoint.other) rows.push_back(endpoint.var);
+
+        if(output.IsIndexed())  //Tabix needs the rows of a contig ordered by the start column (Differs from the variant position for deletions)
+        {
+            vector<pair<hts_pos_t,uint32_t> > keys; keys.reserve(rows.size()-contigBegin);
+
+            for(size_t row=contigBegin;row<rows.size();row++)
+            {
+                string_view name; hts_pos_t beg,end;
+                if(output.ParseRecord(variants.Line(rows[row]),name,beg,end)==false) throw runtime_error(string("Error: Could not parse the index columns of a variant: ")+string(variants.ID(rows[row])));
+                keys.emplace_back(beg,rows[row]);
+            }
+
+            stable_sort(keys.begin(),keys.end(),[](const pair<hts_pos_t,uint32_t> & a,const pair<hts_pos_t,uint32_t> & b){return a.first<b.first;});
+            for(size_t i=0;i<keys.size();i++) rows[contigBegin+i]=keys[i].second;
+        }
+    }
+
+    //----------------------------------------------------------------
+    //Render chunks of rows in parallel and write them in order (One batch of chunks in memory at a time)
+    //----------------------------------------------------------------
+
+    nThreads=max(nThreads,size_t(1));
+
+    size_t nChunks=(rows.size()+ROWS_PER_CHUNK-1)/ROWS_PER_CHUNK;
+    size_t batchSize=nThreads*CHUNKS_PER_THREAD;
+
+    vector<vector<char> > buffers(min(batchSize,nChunks)); vector<size_t> sizes(buffers.size());
+
+    for(size_t batchBegin=0;batchBegin<nChunks;batchBegin+=batchSize)
+    {
+        size_t batchEnd=min(batchBegin+batchSize,nChunks); atomic<size_t> next(batchBegin); exception_ptr error;
+
+        auto renderChunks=[&](void)
+        {
+            try
+            {
+                for(size_t chunk;(chunk=next.fetch_add(1))<batchEnd;)
+                {
+                    size_t rowBegin=chunk*ROWS_PER_CHUNK,rowEnd=min(rowBegin+ROWS_PER_CHUNK,rows.size()),capacity=0;
+                    for(size_t row=rowBegin;row<rowEnd;row++) capacity+=variants.Line(rows[row]).size()+16+nBamFiles*MAX_ENTRY_SIZE;
+
+                    auto & buffer=buffers[chunk-batchBegin]; if(buffer.size()<capacity) buffer.resize(capacity);
+                    char * p=buffer.data();
+
+                    for(size_t row=rowBegin;row<rowEnd;row++)
+                    {
+                        size_t var=rows[row]; string_view line=variants.Line(var); const char * varString=varStrings[variants.Type(var)];
+
+                        p=copy(line.begin(),line.end(),p); *p++='\t';
+                        for(;*varString!='\0';varString++) *p++=*varString;
+
+                        for(size_t batch=0,nBatches=variants.NumBatches();batch<nBatches;batch++)    //Merge of the sample batches by variant
+                        {
+                            const StatisticsMatrix & matrix=variants.Batch(batch);
+                            const Statistics * statistics=matrix.Row(var); for(size_t i=0,nSamples=matrix.Samples();i<nSamples;i++) p=statistics[i].RenderEntry(p);
+                        }
+                        *p++='\n';
+                    }
+
+                    sizes[chunk-batchBegin]=size_t(p-buffer.data());
+                }
+            }
+            catch(...)
+            {
+                error=current_exception(); next=batchEnd;
+            }
+        };
+
+        vector<thread> threads; for(size_t i=1;i<min(nThreads,batchEnd-batchBegin);i++) threads.emplace_back(renderChunks);
+        renderChunks(); for(auto & thread : threads) thread.join();
+
+        if(error) rethrow_exception(error);
+
+        for(size_t chunk=batchBegin;chunk<batchEnd;chunk++)
+        {
+            const char * p=buffers[chunk-batchBegin].data(),* end=p+sizes[chunk-batchBegin];
+
+            if(output.IsIndexed()) for(const char * next;p<end;p=next){next=FindChar(p,end,'\n')+1; output.WriteRecord(p,size_t(next-p));}    //Records one by one so every row gets its index entry
+            else output.Write(p,size_t(end-p));
+        }
+    }
+}
+//----------------------------------------------------------------
+void VariantFile::WriteStatistics(const string & filename,const vector<string> & bamFilenames) const
+{
+    OutputFile output(filename);
+    if(output.IsCompressed()) throw runtime_error(string("Error: Binary statistics file can not be compressed: ")+filename);
+
+    //----------------------------------------------------------------
+    //Collect the variants in the order of the text output
+    //----------------------------------------------------------------
+
+    vector<size_t> contigOrder; SortContigs(contigOrder);
+    vector<VarEndpoint> rows; vector<uint32_t> rowContigs;
+
+    for(size_t contigID : contigOrder)
+    {
+        for(const auto & endpoint : variants.endpoints[contigID]) if(endpoint.pos<=endpoint.other){rows.push_back(endpoint); rowContigs.push_back(uint32_t(contigID));}
+    }
+
+    size_t nRows=rows.size(); size_t nSamples=bamFilenames.size();
+
+    string contigText; for(const auto & name : contigNames) contigText.append(name.c_str(),name.size()+1);
+    string sampleText; for(const auto & bamFilename : bamFilenames){string name=Statistics::SampleName(bamFilename); sampleText.append(name.c_str(),name.size()+1);}
+
+    vector<uint64_t> lineOffsets(nRows); uint64_t linesSize=0;
+    for(size_t row=0;row<nRows;row++){lineOffsets[row]=linesSize; linesSize+=variants.Line(rows[row].var).size()+1;}
+
+    //----------------------------------------------------------------
+    //Describe the columns
+    //----------------------------------------------------------------
+
+    vector<StatisticsColumn> columns; vector<function<void(void)> > writers;
+
+    auto addColumn=[&](const char * name,ColumnType type,uint32_t sample,uint64_t size,function<void(void)> writer)
+    {
+        StatisticsColumn column; memset(&column,0,sizeof(column));
+        strncpy(column.name,name,sizeof(column.name)-1); column.type=type; column.sample=sample; column.size=size;
+        columns.push_back(column); writers.push_back(writer);
+    };
+
+    auto writeText=[&output](const string & text){output.Write(text.data(),text.size());};
+
+    addColumn("contig",COLUMN_U32,STATISTICS_FILE_NO_SAMPLE,nRows*sizeof(uint32_t),[&](void){WriteValues<uint32_t>(output,nRows,[&](size_t row){return rowContigs[row];});});
+    addColumn("pos",COLUMN_I64,STATISTICS_FILE_NO_SAMPLE,nRows*sizeof(int64_t),[&](void){WriteValues<int64_t>(output,nRows,[&](size_t row){return rows[row].pos;});});
+    addColumn("end",COLUMN_I64,STATISTICS_FILE_NO_SAMPLE,nRows*sizeof(int64_t),[&](void){WriteValues<int64_t>(output,nRows,[&](size_t row){return rows[row].other;});});
+    addColumn("var_type",COLUMN_U8,STATISTICS_FILE_NO_SAMPLE,nRows*sizeof(uint8_t),[&](void){WriteValues<uint8_t>(output,nRows,[&](size_t row){return variants.Type(rows[row].var);});});
+    addColumn("line_offset",COLUMN_U64,STATISTICS_FILE_NO_SAMPLE,nRows*sizeof(uint64_t),[&](void){WriteValues<uint64_t>(output,nRows,[&](size_t row){return lineOffsets[row];});});
+    addColumn("line_length",COLUMN_U32,STATISTICS_FILE_NO_SAMPLE,nRows*sizeof(uint32_t),[&](void){WriteValues<uint32_t>(output,nRows,[&](size_t row){return variants.Line(rows[row].var).size();});});
+    addColumn("header",COLUMN_TEXT,STATISTICS_FILE_NO_SAMPLE,header.size()+1,[&](void){writeText(header); output.Write("",1);});
+    addColumn("lines",COLUMN_TEXT,STATISTICS_FILE_NO_SAMPLE,linesSize,[&](void){for(const auto & row : rows){string_view line=variants.Line(row.var); output.Write(line.data(),line.size()); output.Write("",1);}});
+    addColumn("contig_names",COLUMN_TEXT,STATISTICS_FILE_NO_SAMPLE,contigText.size(),[&](void){writeText(contigText);});
+    addColumn("sample_names",COLUMN_TEXT,STATISTICS_FILE_NO_SAMPLE,sampleText.size(),[&](void){writeText(sampleText);});
+
+    static const pair<const char*,uint32_t(*)(const Statistics&)> counters[]=
+    {
+        {"total_depth",[](const Statistics & s){return s.totalDepth;}},
+        {"unknown",[](const Statistics & s){return s.unknown;}},
+        {"ambiguous",[](const Statistics & s){return s.ambiguous;}},
+        {"alt_depth",[](const Statistics & s){return s.altDepth;}},
+        {"alt_bias_0",[](const Statistics & s){return s.altBias[0];}},
+        {"alt_bias_1",[](const Statistics & s){return s.altBias[1];}},
+        {"HQ_depth",[](const Statistics & s){return s.hqDepth;}},
+        {"HQ_alt_depth",[](const Statistics & s){return s.hqAltDepth;}},
+        {"HQ_alt_bias_0",[](const Statistics & s){return s.hqAltBias[0];}},
+        {"HQ_alt_bias_1",[](const Statistics & s){return s.hqAltBias[1];}},
+        {"mismatches_too_high",[](const Statistics & s){return s.mismatchesTooHigh;}}
+    };
+
+    static const pair<const char*,float(*)(const Statistics&)> reals[]=
+    {
+        {"VAF_ITD",[](const Statistics & s){return s.vafITD;}},
+        {"COE_ITD",[](const Statistics & s){return s.coeITD;}}
+    };
+
+    vector<pair<const StatisticsMatrix*,size_t> > sampleColumns;    //Batch and column of every sample (One batch unless the statistics were spilled)
+    for(size_t batch=0,nBatches=variants.NumBatches();batch<nBatches;batch++) for(size_t i=0;i<variants.Batch(batch).Samples();i++) sampleColumns.emplace_back(&variants.Batch(batch),i);
+
+    if(sampleColumns.size()<nSamples) throw runtime_error("Error: Statistics of fewer samples than bam files");
+
+    for(size_t sample=0;sample<nSamples;sample++)
+    {
+        const StatisticsMatrix * matrix=sampleColumns[sample].first; size_t column=sampleColumns[sample].second;
+
+        for(const auto & counter : counters) addColumn(counter.first,COLUMN_U32,uint32_t(sample),nRows*sizeof(uint32_t),[&,matrix,column](void){WriteValues<uint32_t>(output,nRows,[&](size_t row){return counter.second(matrix->Row(rows[row].var)[column]);});});
+        for(const auto & real : reals) addColumn(real.first,COLUMN_F32,uint32_t(sample),nRows*sizeof(float),[&,matrix,column](void){WriteValues<float>(output,nRows,[&](size_t row){return real.second(matrix->Row(rows[row].var)[column]);});});
+    }
+
+    //----------------------------------------------------------------
+    //Write the header, the directory and the aligned columns
+    //----------------------------------------------------------------
+
+    auto align=[](uint64_t offset){return (offset+STATISTICS_FILE_ALIGNMENT-1)/STATISTICS_FILE_ALIGNMENT*STATISTICS_FILE_ALIGNMENT;};
+
+    uint64_t offset=sizeof(StatisticsFileHeader)+columns.size()*sizeof(StatisticsColumn);
+    for(auto & column : columns){column.offset=align(offset); offset=column.offset+column.size;}
+
+    StatisticsFileHeader fileHeader; memset(&fileHeader,0,sizeof(fileHeader));
+    memcpy(fileHeader.magic,STATISTICS_FILE_MAGIC,sizeof(fileHeader.magic)); fileHeader.version=STATISTICS_FILE_VERSION;
+    fileHeader.nColumns=uint32_t(columns.size()); fileHeader.nVariants=nRows; fileHeader.nSamples=uint32_t(nSamples); fileHeader.nContigs=uint32_t(contigNames.size());
+
+    output.Write((const char*)&fileHeader,sizeof(fileHeader)); output.Write((const char*)columns.data(),columns.size()*sizeof(StatisticsColumn));
+
+    static const char padding[STATISTICS_FILE_ALIGNMENT]={};
+    offset=sizeof(StatisticsFileHeader)+columns.size()*sizeof(StatisticsColumn);
+
+    for(size_t i=0;i<columns.size();i++)
+    {
+        output.Write(padding,columns[i].offset-offset);
+        writers[i](); offset=columns[i].offset+columns[i].size;
+    }
+
+    output.Close();
+}
+//----------------------------------------------------------------
@@ -0,0 +1,32 @@
+//----------------------------------------------------------------
+#ifndef VARIANT_FILE_H
+#define VARIANT_FILE_H
+//----------------------------------------------------------------
+#include "fasta_file.h"
+#include "variant_store.h"
+#include "output_file.h"
+//----------------------------------------------------------------
+class VariantFile   //Common interface of annovar and VEP files so both share one execution path
+{
+protected:
+
+    void Clear(void);
+    void SortContigs(vector<size_t> & contigOrder) const;   //Contig IDs in output order (By name)
+    void WriteEntries(OutputFile & output,size_t nBamFiles,size_t nThreads);   //Rows rendered in parallel chunks and written in order
+
+public:
+
+    string          header;
+    vector<string>  contigNames;    //Same contig IDs as the fasta file
+    VariantStore    variants;       //Variants with their statistics (Endpoints by contig ID)
+
+    virtual ~VariantFile(void);
+
+    virtual void Open(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads)=0;
+    virtual void Write(OutputFile & output,const vector<string> & bamFilenames,size_t nThreads=1)=0;
+    virtual size_t LinesMemoryUsage(void) const=0;     //Bytes of the text the variant lines point into
+
+    void WriteStatistics(const string & filename,const vector<string> & bamFilenames) const;   //Raw counters as a binary columnar file (See statistics_file.h)
+};
+//----------------------------------------------------------------
+#endif // VARIANT_FILE_H
@@ -0,0 +1,194 @@
+//----------------------------------------------------------------
+// Name        : variant_store.cpp
+// Author      : Remco Hoogenboezem
+// Version     :
+// Copyright   :
+// Description : Struct of arrays store of the variants of an annovar or VEP file
+//----------------------------------------------------------------
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "variant_store.h"
+#define CACHE_LINE_SIZE     64
+#define SPILL_BUFFER_SIZE   (1<<20)     //Bytes of rows written at once
+//----------------------------------------------------------------
+void StatisticsMatrix::Init(size_t nRows,size_t nSamples)
+{
+    mapping.reset(); this->nRows=nRows; this->nSamples=nSamples;
+
+    rowStride=((nSamples*sizeof(Statistics)+CACHE_LINE_SIZE-1)/CACHE_LINE_SIZE)*CACHE_LINE_SIZE;
+
+    size=nRows*rowStride+CACHE_LINE_SIZE; memory.reset(new uint8_t[size]);
+    data=memory.get()+(CACHE_LINE_SIZE-uintptr_t(memory.get())%CACHE_LINE_SIZE)%CACHE_LINE_SIZE;
+
+    for(size_t row=0;row<nRows;row++)
+    {
+        Statistics * statistics=Row(row); for(size_t sample=0;sample<nSamples;sample++) new(statistics+sample) Statistics();
+    }
+}
+//----------------------------------------------------------------
+void StatisticsMatrix::Spill(const StatisticsMatrix & matrix,const string & directory)
+{
+    //----------------------------------------------------------------
+    //Write the rows without padding to a temporary file that is removed right away (Gone with the mapping, also if the process dies)
+    //----------------------------------------------------------------
+
+    string filename=directory+"/enhanced_ABS.statistics.XXXXXX";
+
+    int fd=mkstemp(&filename[0]);
+    if(fd==-1) throw runtime_error(string("Error: Could not create spill file in: ")+directory);
+
+    unlink(filename.c_str());
+
+    size_t packedStride=matrix.nSamples*sizeof(Statistics); size_t spillSize=matrix.nRows*packedStride;
+    string buffer; buffer.reserve(SPILL_BUFFER_SIZE+packedStride);
+
+    for(size_t row=0;row<matrix.nRows;row++)
+    {
+        buffer.append((const char*)matrix.Row(row),packedStride);
+        if(buffer.size()<SPILL_BUFFER_SIZE && row+1<matrix.nRows) continue;
+
+        for(const char * p=buffer.data(),* pEnd=p+buffer.size();p<pEnd;)
+        {
+            ssize_t nBytes=write(fd,p,size_t(pEnd-p));
+            if(nBytes<0 && errno==EINTR) continue;
+            if(nBytes<=0) {close(fd); throw runtime_error(string("Error: Could not write spill file in: ")+directory);}
+            p+=nBytes;
+        }
+
+        buffer.clear();
+    }
+
+    //----------------------------------------------------------------
+    //Map the rows back
+    //----------------------------------------------------------------
+
+    Clear();
+
+    if(spillSize>0)
+    {
+        void * rawFile=mmap(nullptr,spillSize,PROT_READ,MAP_SHARED,fd,0);
+        if(rawFile==MAP_FAILED) {close(fd); throw runtime_error(string("Error: Could not memory map spill file in: ")+directory);}
+
+        mapping.reset((const uint8_t*)rawFile,[spillSize](const uint8_t * p){munmap((void*)p,spillSize);});
+        data=(uint8_t*)rawFile;
+    }
+
+    close(fd);
+
+    rowStride=packedStride; nRows=matrix.nRows; nSamples=matrix.nSamples;
+}
+//----------------------------------------------------------------
+void VariantStore::Init(size_t nContigs,size_t nSamples)
+{
+    Clear();
+
+    this->nSamples=nSamples;
+    endpoints.assign(nContigs,vector<VarEndpoint>());
+}
+//----------------------------------------------------------------
+void VariantStore::Clear(void)
+{
+    lineData="";
+
+    vector<uint64_t>().swap(lineOffsets); vector<uint32_t>().swap(lineLengths); vector<uint8_t>().swap(varTypes);
+    vector<uint64_t>().swap(alleleOffsets); vector<uint32_t>().swap(refLengths); vector<uint32_t>().swap(altLengths); string().swap(alleles);
+
+    statistics.Clear(); batches.clear();
+    endpoints.clear();
+}
+//----------------------------------------------------------------
+size_t VariantStore::MemoryUsage(void) const
+{
+    size_t size=lineOffsets.capacity()*sizeof(uint64_t)+lineLengths.capacity()*sizeof(uint32_t)+varTypes.capacity()*sizeof(uint8_t)+
+                alleleOffsets.capacity()*sizeof(uint64_t)+refLengths.capacity()*sizeof(uint32_t)+altLengths.capacity()*sizeof(uint32_t)+alleles.capacity();
+
+    for(const auto & contigEndpoints : endpoints) size+=sizeof(contigEndpoints)+contigEndpoints.capacity()*sizeof(VarEndpoint);
+
+    return size;
+}
+//----------------------------------------------------------------
+void VariantStore::SpillStatistics(const string & directory)
+{
+    batches.emplace_back(); batches.back().Spill(statistics,directory);
+    statistics.Clear();
+}
+//----------------------------------------------------------------
+uint32_t VariantStore::Add(uint64_t lineOffset,size_t lineLength,VarType varType,const string & ref,const string & alt)
+{
+    if(Size()>=UINT32_MAX) throw runtime_error("Error: Too many variants");
+
+    lineOffsets.push_back(lineOffset); lineLengths.push_back(uint32_t(lineLength)); varTypes.push_back(uint8_t(varType));
+    alleleOffsets.push_back(alleles.size()); refLengths.push_back(uint32_t(ref.size())); altLengths.push_back(uint32_t(alt.size()));
+
+    alleles+=ref; alleles+=alt;
+
+    return uint32_t(Size()-1);
+}
+//----------------------------------------------------------------
+void VariantStore::AddEndpoints(size_t contigID,hts_pos_t pos1,hts_pos_t pos2,uint32_t var)
+{
+    endpoints[contigID].emplace_back(pos1,pos2,var);
+    if(pos1!=pos2) endpoints[contigID].emplace_back(pos2,pos1,var);
+}
+//----------------------------------------------------------------
+void VariantStore::Append(const VariantStore & store)
+{
+    size_t nVars=Size(); uint64_t allelesSize=alleles.size();
+
+    if(nVars+store.Size()>UINT32_MAX) throw runtime_error("Error: Too many variants");
+
+    lineOffsets.insert(lineOffsets.end(),store.lineOffsets.begin(),store.lineOffsets.end());
+    lineLengths.insert(lineLengths.end(),store.lineLengths.begin(),store.lineLengths.end());
+    varTypes.insert(varTypes.end(),store.varTypes.begin(),store.varTypes.end());
+    refLengths.insert(refLengths.end(),store.refLengths.begin(),store.refLengths.end());
+    altLengths.insert(altLengths.end(),store.altLengths.begin(),store.altLengths.end());
+
+    for(uint64_t offset : store.alleleOffsets) alleleOffsets.push_back(allelesSize+offset);
+    alleles+=store.alleles;
+
+    for(size_t contigID=0,nContigs=endpoints.size();contigID<nContigs;contigID++)
+    {
+        for(const auto & endpoint : store.endpoints[contigID]) endpoints[contigID].emplace_back(endpoint.pos,endpoint.other,uint32_t(nVars+endpoint.var));
+    }
+}
+//----------------------------------------------------------------
+void VariantStore::Finalize(size_t nThreads)
+{
+    //----------------------------------------------------------------
+    //Sort contigs in parallel (Stable so endpoints at the same position keep the input order)
+    //----------------------------------------------------------------
+
+    size_t nContigs=endpoints.size(); atomic<size_t> next(0);
+
+    auto sortContigs=[&](void)
+    {
+        for(size_t contigID;(contigID=next.fetch_add(1))<nContigs;)
+        {
+            auto & contigEndpoints=endpoints[contigID]; contigEndpoints.shrink_to_fit();
+            stable_sort(contigEndpoints.begin(),contigEndpoints.end(),[](const VarEndpoint & a,const VarEndpoint & b){return a.pos<b.pos;});
+        }
+    };
+
+    vector<thread> threads; for(size_t i=1;i<min(max(nThreads,size_t(1)),nContigs);i++) threads.emplace_back(sortContigs);
+    sortContigs(); for(auto & thread : threads) thread.join();
+
+    statistics.Init(Size(),nSamples);
+}
+//----------------------------------------------------------------
+const VarEndpoint * VariantStore::LowerBound(const vector<VarEndpoint> & endpoints,hts_pos_t pos)
+{
+    return endpoints.data()+(lower_bound(endpoints.begin(),endpoints.end(),pos,[](const VarEndpoint & endpoint,hts_pos_t pos){return endpoint.pos<pos;})-endpoints.begin());
+}
+//----------------------------------------------------------------
+const VarEndpoint * VariantStore::UpperBound(const vector<VarEndpoint> & endpoints,hts_pos_t pos)
+{
+    return endpoints.data()+(upper_bound(endpoints.begin(),endpoints.end(),pos,[](hts_pos_t pos,const VarEndpoint & endpoint){return pos<endpoint.pos;})-endpoints.begin());
+}
+//----------------------------------------------------------------
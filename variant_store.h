@@ -0,0 +1,104 @@
+//----------------------------------------------------------------
+#ifndef VARIANT_STORE_H
+#define VARIANT_STORE_H
+//----------------------------------------------------------------
+#include <string_view>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "variant_entry.h"
+//----------------------------------------------------------------
+using namespace std;
+//----------------------------------------------------------------
+class VarEndpoint   //One end of a variant (SNVs have a single endpoint, other variants one at pos1 and one at pos2)
+{
+private:
+public:
+
+    hts_pos_t pos;
+    hts_pos_t other;    //Position of the other end (Equal to pos for SNVs)
+    uint32_t var;       //Variant index in the store
+
+    VarEndpoint(void){}
+    VarEndpoint(hts_pos_t pos,hts_pos_t other,uint32_t var) : pos(pos),other(other),var(var){}
+};
+//----------------------------------------------------------------
+class StatisticsMatrix  //Statistics of all variants x samples in one allocation (Rows start on a cache line so threads counting neighbouring variants do not share lines)
+{
+private:
+
+    unique_ptr<uint8_t[]> memory;
+    shared_ptr<const uint8_t> mapping;     //Rows of a spilled matrix (Read only)
+    uint8_t * data;
+    size_t rowStride;
+    size_t size;        //Bytes of the allocation
+    size_t nRows;
+    size_t nSamples;
+
+public:
+
+    StatisticsMatrix(void) : data(nullptr),rowStride(0),size(0),nRows(0),nSamples(0){}
+
+    void Init(size_t nRows,size_t nSamples);
+    void Spill(const StatisticsMatrix & matrix,const string & directory);  //Copies the rows of matrix to an unlinked file and maps them (Pages are dropped by the kernel when memory is short)
+    void Clear(void) {memory.reset(); mapping.reset(); data=nullptr; rowStride=0; size=0; nRows=0; nSamples=0;}
+
+    size_t Samples(void) const {return nSamples;}
+    size_t MemoryUsage(void) const {return size;}  //Spilled rows are page cache and not counted
+
+    Statistics * Row(size_t row) {return (Statistics*)(data+row*rowStride);}
+    const Statistics * Row(size_t row) const {return (const Statistics*)(data+row*rowStride);}
+};
+//----------------------------------------------------------------
+class VariantStore  //All variants of a file as parallel arrays with the alleles in one string arena
+{
+private:
+public:
+
+    size_t nSamples;
+    const char * lineData;                  //Base of the line offsets (Mapped input file or line arena of the owner)
+
+    vector<uint64_t> lineOffsets;
+    vector<uint32_t> lineLengths;
+    vector<uint8_t> varTypes;
+    vector<uint64_t> alleleOffsets;         //Ref directly followed by alt in the allele arena
+    vector<uint32_t> refLengths;
+    vector<uint32_t> altLengths;
+    string alleles;
+
+    StatisticsMatrix statistics;            //Statistics by variant and sample (Allocated by Finalize)
+    vector<StatisticsMatrix> batches;       //Spilled statistics of consecutive sample batches (Cohort mode, otherwise empty)
+    vector<vector<VarEndpoint> > endpoints; //Endpoints by contig ID sorted by position (Window queries are binary searches on these arrays)
+
+    VariantStore(void) : nSamples(0),lineData(""){}
+
+    void Init(size_t nContigs,size_t nSamples);
+    void Clear(void);
+
+    uint32_t Add(uint64_t lineOffset,size_t lineLength,VarType varType,const string & ref,const string & alt);
+    void AddEndpoints(size_t contigID,hts_pos_t pos1,hts_pos_t pos2,uint32_t var);
+    void Append(const VariantStore & store);    //Variants of store after the variants of this store (Same line base)
+    void Finalize(size_t nThreads);             //Stable sort the endpoints by position and allocate the statistics
+
+    size_t Size(void) const {return varTypes.size();}
+    size_t MemoryUsage(void) const;             //Bytes of the arrays, the allele arena and the endpoints (Statistics not included)
+
+    VarType Type(size_t var) const {return VarType(varTypes[var]);}
+    string_view Line(size_t var) const {return string_view(lineData+lineOffsets[var],lineLengths[var]);}
+    string_view Ref(size_t var) const {return string_view(alleles.data()+alleleOffsets[var],refLengths[var]);}
+    string_view Alt(size_t var) const {return string_view(alleles.data()+alleleOffsets[var]+refLengths[var],altLengths[var]);}
+    string_view ID(size_t var) const {string_view line=Line(var); return line.substr(0,line.find('\t'));}   //First column
+
+    Statistics * GetStatistics(size_t var) {return statistics.Row(var);}
+    const Statistics * GetStatistics(size_t var) const {return statistics.Row(var);}
+
+    void SpillStatistics(const string & directory);    //Moves the statistics of the current sample batch to disk
+    size_t NumBatches(void) const {return batches.empty() ? 1 : batches.size();}
+    const StatisticsMatrix & Batch(size_t batch) const {return batches.empty() ? statistics : batches[batch];}    //Statistics of all samples in batch order
+
+    static const VarEndpoint * LowerBound(const vector<VarEndpoint> & endpoints,hts_pos_t pos);    //First endpoint at or after pos
+    static const VarEndpoint * UpperBound(const vector<VarEndpoint> & endpoints,hts_pos_t pos);    //First endpoint after pos
+};
+//----------------------------------------------------------------
+#endif // VARIANT_STORE_H
@@ -3,17 +3,106 @@
 // Author      : Remco Hoogenboezem
 // Version     :
 // Copyright   :
-// Description : Open a single vcf file
+// Description : Open a single vcf file (Whole file or only the regions around the variants through its index)
 //----------------------------------------------------------------
 #include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <vcf.h>
+#include <tbx.h>
 #include "vcf_file.h"
 //----------------------------------------------------------------
+static inline void AddKnownSNP(bcf1_t * vcfEntry,vector<KnownSNP> & entries)
+{
+    if(bcf_is_snp(vcfEntry)==false) return;
+
+    KnownSNP entry; entry.pos=vcfEntry->pos; entry.alleles[0]=entry.alleles[1]=entry.alleles[2]=entry.alleles[3]='\0';
+    for(size_t i=0,n=min(vcfEntry->n_allele,4U);i<n;i++) entry.alleles[i]=vcfEntry->d.allele[i][0];
+
+    entries.push_back(entry);
+}
+//----------------------------------------------------------------
+class IndexedReader //Vcf/bcf handle with its header and index (One per thread)
+{
+private:
+public:
+
+    htsFile * handle;
+    bcf_hdr_t * header;
+    hts_idx_t * idx;    //Bcf (csi)
+    tbx_t * tbx;        //Bgzipped vcf (tbi or csi)
+    kstring_t line;
+
+    IndexedReader(const string & filename) : handle(nullptr),header(nullptr),idx(nullptr),tbx(nullptr),line{0,0,nullptr}
+    {
+        handle=bcf_open(filename.c_str(),"r");
+        if(handle==nullptr) throw runtime_error(string("Error: Could not open vcf file: ")+filename);
+
+        header=bcf_hdr_read(handle);
+        if(header==nullptr) {bcf_close(handle); throw runtime_error(string("Error: Could not read header in vcf file: ")+filename);}
+
+        if(hts_get_format(handle)->format==bcf) idx=bcf_index_load(filename.c_str()); else tbx=tbx_index_load(filename.c_str());
+
+        if(idx==nullptr && tbx==nullptr)
+        {
+            bcf_hdr_destroy(header); bcf_close(handle);
+            throw runtime_error(string("Error: Could not load the index of vcf file (bgzip and index it with bcftools index or tabix): ")+filename);
+        }
+    }
+
+    ~IndexedReader(void)
+    {
+        free(line.s);
+        if(idx!=nullptr) hts_idx_destroy(idx);
+        if(tbx!=nullptr) tbx_destroy(tbx);
+        bcf_hdr_destroy(header);
+        bcf_close(handle);
+    }
+
+    void Read(const string & filename,const char * contig,hts_pos_t begin,hts_pos_t end,bcf1_t * vcfEntry,vector<KnownSNP> & entries)  //Closed interval
+    {
+        int tid=idx!=nullptr ? bcf_hdr_name2id(header,contig) : tbx_name2id(tbx,contig); if(tid<0) return;    //Contig without records
+
+        hts_itr_t * itr=idx!=nullptr ? bcf_itr_queryi(idx,tid,begin,end+1) : tbx_itr_queryi(tbx,tid,begin,end+1); if(itr==nullptr) return;
+
+        int result;
+
+        if(idx!=nullptr) while((result=bcf_itr_next(handle,itr,vcfEntry))>=0) AddKnownSNP(vcfEntry,entries);
+        else while((result=tbx_itr_next(handle,tbx,itr,&line))>=0)
+        {
+            if(vcf_parse(&line,header,vcfEntry)<0) {result=-2; break;}
+            AddKnownSNP(vcfEntry,entries);
+        }
+
+        hts_itr_destroy(itr);
+
+        if(result<-1) throw runtime_error(string("Error: Could not read region ")+contig+string(" from vcf file: ")+filename);
+    }
+};
+//----------------------------------------------------------------
 VCFFile::VCFFile(void){}
 //----------------------------------------------------------------
-VCFFile::VCFFile(const string & filename){ Open(filename); }
+VCFFile::VCFFile(const string & filename,const FastaFile & fastaFile){ Open(filename,fastaFile); }
 //----------------------------------------------------------------
-void VCFFile::Open(const string & filename)
+void VCFFile::Finalize(void)
+{
+    for(auto & contigEntries : entries)
+    {
+        stable_sort(contigEntries.begin(),contigEntries.end(),[](const KnownSNP & a,const KnownSNP & b){return a.pos<b.pos;});
+
+        size_t n=0; for(size_t i=0,nEntries=contigEntries.size();i<nEntries;i++)
+        {
+            if(i+1<nEntries && contigEntries[i+1].pos==contigEntries[i].pos) continue;    //The last record of a position wins
+            contigEntries[n++]=contigEntries[i];
+        }
+
+        contigEntries.resize(n); contigEntries.shrink_to_fit();
+    }
+}
+//----------------------------------------------------------------
+void VCFFile::Open(const string & filename,const FastaFile & fastaFile)
 {
     //----------------------------------------------------------------
     //Open file
@@ -48,20 +137,24 @@ void VCFFile::Open(const string & filename)
         throw runtime_error(string("Error: Could not parse seqeuence names: ")+filename);
     }
 
+    vector<int> contigIDs(size_t(max(nSeqs,0))); for(int i=0;i<nSeqs;i++) contigIDs[size_t(i)]=fastaFile.GetContigID(seqNames[i]);   //Contigs missing in the fasta file (-1) are never queried
+
     //----------------------------------------------------------------
     //Iterate over vcf entries
     //----------------------------------------------------------------
 
-    entries.clear();
+    entries.assign(fastaFile.entries.size(),vector<KnownSNP>());
 
     bcf1_t * vcfEntry=bcf_init();
 
     while(bcf_read(handle,header,vcfEntry)==0)
     {
-        if(bcf_is_snp(vcfEntry)==false) continue;
-        auto & entry=entries[seqNames[vcfEntry->rid]][vcfEntry->pos]; entry[2]='\0'; entry[3]='\0'; for(size_t i=0,n=min(vcfEntry->n_allele,4U);i<n;i++) entry[i]=vcfEntry->d.allele[i][0];
+        if(vcfEntry->rid<0 || vcfEntry->rid>=nSeqs || contigIDs[size_t(vcfEntry->rid)]<0) continue;
+        AddKnownSNP(vcfEntry,entries[size_t(contigIDs[size_t(vcfEntry->rid)])]);
     }
 
+    Finalize();
+
     //----------------------------------------------------------------
     //Clean up
     //----------------------------------------------------------------
@@ -72,3 +165,84 @@ void VCFFile::Open(const string & filename)
     bcf_close(handle);
 }
 //----------------------------------------------------------------
+void VCFFile::Open(const string & filename,const FastaFile & fastaFile,const vector<vector<pair<hts_pos_t,hts_pos_t> > > & regions,size_t nThreads)
+{
+    //----------------------------------------------------------------
+    //List the regions (Results are kept per region so the merge does not depend on the thread schedule)
+    //----------------------------------------------------------------
+
+    vector<pair<size_t,pair<hts_pos_t,hts_pos_t> > > regionList;
+
+    for(size_t contigID=0,nContigs=min(regions.size(),fastaFile.entries.size());contigID<nContigs;contigID++)
+    {
+        for(const auto & region : regions[contigID]) regionList.emplace_back(contigID,region);
+    }
+
+    size_t nRegions=regionList.size(); vector<vector<KnownSNP> > results(nRegions);
+
+    //----------------------------------------------------------------
+    //Fetch regions in parallel (Every thread has its own handle and index)
+    //----------------------------------------------------------------
+
+    atomic<size_t> next(0); exception_ptr error; mutex errorLock;
+
+    auto fetch=[&](void)
+    {
+        try
+        {
+            IndexedReader reader(filename); bcf1_t * vcfEntry=bcf_init();
+
+            try
+            {
+                for(size_t i;(i=next.fetch_add(1))<nRegions;)
+                {
+                    const auto & region=regionList[i];
+                    reader.Read(filename,fastaFile.names[region.first].c_str(),region.second.first,region.second.second,vcfEntry,results[i]);
+                }
+            }
+            catch(...)
+            {
+                bcf_destroy(vcfEntry);
+                throw;
+            }
+
+            bcf_destroy(vcfEntry);
+        }
+        catch(...)
+        {
+            next=nRegions;
+            lock_guard<mutex> guard(errorLock); if(error==nullptr) error=current_exception();
+        }
+    };
+
+    vector<thread> threads; for(size_t i=1;i<min(max(nThreads,size_t(1)),nRegions);i++) threads.emplace_back(fetch);
+    fetch(); for(auto & thread : threads) thread.join();
+
+    if(error!=nullptr) rethrow_exception(error);
+
+    //----------------------------------------------------------------
+    //Merge regions by contig
+    //----------------------------------------------------------------
+
+    entries.assign(fastaFile.entries.size(),vector<KnownSNP>());
+
+    for(size_t i=0;i<nRegions;i++)
+    {
+        auto & contigEntries=entries[regionList[i].first];
+        contigEntries.insert(contigEntries.end(),results[i].begin(),results[i].end()); vector<KnownSNP>().swap(results[i]);
+    }
+
+    Finalize();
+}
+//----------------------------------------------------------------
+size_t VCFFile::MemoryUsage(void) const
+{
+    size_t size=0; for(const auto & contigEntries : entries) size+=sizeof(contigEntries)+contigEntries.capacity()*sizeof(KnownSNP);
+    return size;
+}
+//----------------------------------------------------------------
+const KnownSNP * VCFFile::LowerBound(const vector<KnownSNP> & entries,hts_pos_t pos)
+{
+    return entries.data()+(lower_bound(entries.begin(),entries.end(),pos,[](const KnownSNP & entry,hts_pos_t pos){return entry.pos<pos;})-entries.begin());
+}
+//----------------------------------------------------------------
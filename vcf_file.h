@@ -4,21 +4,39 @@
 //----------------------------------------------------------------
 #include "hts.h"
 #include <string>
-#include <map>
+#include <vector>
+#include "fasta_file.h"
 //----------------------------------------------------------------
 using namespace std;
 //----------------------------------------------------------------
+class KnownSNP      //Position and first base of up to four alleles of a known SNP (Missing alleles are '\0')
+{
+private:
+public:
+
+    hts_pos_t pos;
+    char alleles[4];
+};
+//----------------------------------------------------------------
 class VCFFile
 {
 private:
+
+    void Finalize(void);    //Sort by position and keep the last record of duplicate positions
+
 public:
 
-    map<string,map<hts_pos_t,char[4]> > entries;
+    vector<vector<KnownSNP> > entries;  //Known SNPs by contig ID sorted by position (Same contig IDs as the fasta file)
 
     VCFFile(void);
-    VCFFile(const string & filename);
+    VCFFile(const string & filename,const FastaFile & fastaFile);
+
+    void Open(const string & filename,const FastaFile & fastaFile);
+    void Open(const string & filename,const FastaFile & fastaFile,const vector<vector<pair<hts_pos_t,hts_pos_t> > > & regions,size_t nThreads);  //Only the regions by contig ID through the csi or tbi index
+
+    size_t MemoryUsage(void) const;
 
-    void Open(const string & filename);
+    static const KnownSNP * LowerBound(const vector<KnownSNP> & entries,hts_pos_t pos);    //First known SNP at or after pos
 };
 //----------------------------------------------------------------
 #endif // VCF_FILE_H
@@ -3,227 +3,196 @@
 // Author      : Remco Hoogenboezem
 // Version     :
 // Copyright   :
-// Description : Open a single VEP file and store the variants in human readable format
+// Description : Stream a single VEP file, collapse the rows of every variant and store the variants in human readable format
 //----------------------------------------------------------------
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <unordered_set>
+#include <unistd.h>
+#include "text_reader.h"
+#include "instrumentation.h"
 #include "vep_file.h"
 //----------------------------------------------------------------
-void VEPFile::Clear(void)
-{
-    for(const auto & chr : entries)
-    {
-        for(const auto & pos : chr.second)
-        {
-            for(const auto & entry : pos.second)
-            {
-                if(pos.first<=entry.first) delete entry.second;
-            }
-        }
-    }
-
-    entries.clear();
-}
-//----------------------------------------------------------------
 VEPFile::VEPFile(void){}
 //----------------------------------------------------------------
-VEPFile::VEPFile(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples)
+VEPFile::VEPFile(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads)
 {
-    Open(filename,fastaEntries,nSamples);
+    Open(filename,fastaFile,nSamples,nThreads);
 }
 //----------------------------------------------------------------
-VEPFile::~VEPFile(void)
-{
-    Clear();
-}
-//----------------------------------------------------------------
-void VEPFile::Open(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples)
+void VEPFile::Open(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads)
 {
     //----------------------------------------------------------------
     //Open VEP file
     //----------------------------------------------------------------
 
-    FILE * vepFile=fopen(filename.c_str(),"r");
-
-    if(vepFile==nullptr) throw runtime_error(string("Error: Could not open vep file: ")+filename);
+    if(access(filename.c_str(),R_OK)!=0) throw runtime_error(string("Error: Could not open vep file: ")+filename);
 
-    fclose(vepFile);
-
-    vepFile=popen((string("bzcat -f ")+filename+string(" | zcat -f")).c_str(),"r");
+    TextReader vepFile(filename,nThreads);  //Plain, gzip, bgzf or bzip2
 
     //----------------------------------------------------------------
     //Read info + header
     //----------------------------------------------------------------
 
-    #define LINE_LEN 16777216
-    char * line=(char*)malloc(LINE_LEN);
-
     vector<string> info;
 
-    while(fgets(line,LINE_LEN,vepFile)!=nullptr && line[0]=='#' && line[1]=='#')
-    {
-        line[strcspn(line,"\n")]='\0';
-        info.push_back(line);
-    }
+    char * line;
 
-    if(line[0]!='#' || line[1]=='#')
-    {
-        free(line);pclose(vepFile);
-        throw runtime_error(string("Error: No header line found in vep file: ")+filename);
-    }
+    while((line=vepFile.ReadLine())!=nullptr && line[0]=='#' && line[1]=='#') info.push_back(line);
 
-    line[strcspn(line,"\n")]='\0';
+    if(line==nullptr || line[0]!='#' || line[1]=='#') throw runtime_error(string("Error: No header line found in vep file: ")+filename);
 
     string header(line);
     size_t nFields=count(header.begin(),header.end(),'\t');
 
     //----------------------------------------------------------------
-    //Read entries and remove duplicate variants
+    //Collapse the rows of every variant while streaming (VEP writes the rows of a variant consecutively)
     //----------------------------------------------------------------
 
-    map<string,vector<vector<string>>> entries;
+    VariantStore variants; variants.Init(fastaFile.entries.size(),nSamples);
+
+    string lines;   //Collapsed lines of all variants (Line arena)
+
+    string var; int contigID=-1; hts_pos_t pos1=0;
+    vector<unordered_set<string> > seen(nFields); vector<string> values(nFields);    //Distinct values per field of the current variant
+
+    bool accounting=Instrumentation::Instance().IsMemoryEnabled(); MemoryCharge collapseMemory(MEMORY_VEP_COLLAPSE); size_t collapseSize=0;
+
+    auto collapse=[&](void)
     {
-        while(fgets(line,LINE_LEN,vepFile)!=nullptr)
+        if(var.empty()) return;
+
+        if(accounting)  //Distinct value sets of the largest variant so far (Node, string and bucket estimate)
         {
-            if(line[0]=='\0' || line[0]=='\n' || line[0]=='#') continue;
+            size_t size=0; for(size_t i=0;i<nFields;i++) size+=seen[i].size()*(sizeof(string)+2*sizeof(void*))+seen[i].bucket_count()*sizeof(void*)+2*values[i].capacity();
+            if(size>collapseSize){collapseMemory.Add(size-collapseSize); collapseSize=size;}
+        }
 
-            line[strcspn(line,"\n")]='\0';
-            char * pLine=line; char * pVar=strsep(&pLine,"\t"); char * pChr=strsep(&pVar,"_"); char * pPos=strsep(&pVar,"_"); char * pRef=strsep(&pVar,"_"); char * pAlt=strsep(&pVar,"_");
+        uint64_t lineOffset=lines.size(); lines+=var; for(size_t i=0;i<nFields;i++) {lines+='\t'; lines+=values[i];}
 
-            if(pVar!=nullptr || pAlt==nullptr)
-            {
-                free(line); pclose(vepFile);
-                throw runtime_error(string("Error: Inconsistent number of columns in VEP entry: ")+filename);
-            }
+        char * pVar=&var[0]; strsep(&pVar,"_"); strsep(&pVar,"_"); string ref(strsep(&pVar,"_")); string alt(strsep(&pVar,"_"));
 
-            string chr(pChr);
+        for(auto & c : ref) c=toupper(c);
+        for(auto & c : alt) c=toupper(c);
 
-            if(fastaEntries.count(chr)==0)
-            {
-                free(line); pclose(vepFile);
-                throw runtime_error(string("Error: Chromosome names in vep and fasta file must agree: ")+filename);
-            }
+        hts_pos_t refLen=hts_pos_t(ref.length()); hts_pos_t altLen=hts_pos_t(alt.length());
 
-            const FastaEntry & fastaEntry=fastaEntries.at(chr);
+        VarType varType; hts_pos_t pos2;
 
-            hts_pos_t pos=atoll(pPos)-1;
+        if(refLen+altLen==2) {varType=SNV; pos2=pos1;}
+        else if(refLen>=altLen) {varType=DEL; pos2=pos1+refLen-1;}
+        else varType=AssessTandem(pos1,alt,fastaFile.entries[size_t(contigID)],pos2);
 
-            if(pos<0 || (pos + hts_pos_t(strlen(pRef)))>fastaEntry.len)
-            {
-                free(line); pclose(vepFile);
-                throw runtime_error(string("Error: Variant position outside fasta reference sequence: ")+filename);
-            }
+        variants.AddEndpoints(size_t(contigID),pos1,pos2,variants.Add(lineOffset,lines.size()-lineOffset,varType,ref,alt));
 
-            string var(pVar);
+        var.clear(); for(size_t i=0;i<nFields;i++) {seen[i].clear(); values[i].clear();}
+    };
 
-            if(entries.count(var)==0) entries[var].assign(nFields,vector<string>());
+    while((line=vepFile.ReadLine())!=nullptr)
+    {
+        if(line[0]=='\0' || line[0]=='#') continue;
 
-            size_t field=0;for(char * pField=strsep(&pLine,"\t");pField!=nullptr;pField=strsep(&pLine,"\t"),field++)
-            {
-                auto & vec=entries[var][field]; auto vecEnd=vec.end();
-                if(find(vec.begin(),vecEnd,pField)==vecEnd) vec.push_back(pField);
-            }
+        char * pLine=line; char * pVar=strsep(&pLine,"\t");
 
-            if(field<nFields)
-            {
-                free(line); pclose(vepFile);
-                throw runtime_error(string("Error: Inconsistent number of columns in VEP entry: ")+filename);
-            }
-        }
-    }
+        if(var.empty() || var!=pVar)
+        {
+            collapse(); var=pVar;
 
-    pclose(vepFile);
+            char * pChr=strsep(&pVar,"_"); char * pPos=strsep(&pVar,"_"); char * pRef=strsep(&pVar,"_"); char * pAlt=strsep(&pVar,"_");
 
-    this->info=info;
-    this->header=header;
+            if(pVar!=nullptr || pAlt==nullptr) throw runtime_error(string("Error: Inconsistent number of columns in VEP entry: ")+filename);
 
-    //----------------------------------------------------------------
-    //Convert entries
-    //----------------------------------------------------------------
+            contigID=fastaFile.GetContigID(pChr);
 
-    Clear();
+            if(contigID<0) throw runtime_error(string("Error: Chromosome names in vep and fasta file must agree: ")+filename);
 
-    for(auto & entry : entries)
-    {
-        VarEntry * newEntry=new VarEntry(nSamples,entry.first);
+            pos1=atoll(pPos)-1;
 
-        char * pVar=strcpy(line,entry.first.c_str());
-        string chr(strsep(&pVar,"_")); hts_pos_t pos1=atoll(strsep(&pVar,"_"))-1; newEntry->ref=strsep(&pVar,"_"); newEntry->alt=strsep(&pVar,"_");
+            if(pos1<0 || (pos1 + hts_pos_t(strlen(pRef)))>fastaFile.entries[size_t(contigID)].len) throw runtime_error(string("Error: Variant position outside fasta reference sequence: ")+filename);
+        }
 
-        for(auto & field : entry.second)
+        size_t field=0;for(char * pField=strsep(&pLine,"\t");pField!=nullptr;pField=strsep(&pLine,"\t"),field++)
         {
-            auto it=field.begin();
-            auto itEnd=field.end();
+            if(field>=nFields) throw runtime_error(string("Error: Inconsistent number of columns in VEP entry: ")+filename);
 
-            newEntry->line+=string("\t")+*it;
-            for(it++;it!=itEnd;it++) newEntry->line+=string(";")+*it;
+            if(seen[field].emplace(pField).second)
+            {
+                if(seen[field].size()>1) values[field]+=';';
+                values[field]+=pField;
+            }
         }
 
-        for(auto & c : newEntry->ref) c=toupper(c);
-        for(auto & c : newEntry->alt) c=toupper(c);
+        if(field<nFields) throw runtime_error(string("Error: Inconsistent number of columns in VEP entry: ")+filename);
+    }
 
-        hts_pos_t refLen=hts_pos_t(newEntry->ref.length()); hts_pos_t altLen=hts_pos_t(newEntry->alt.length());
+    collapse();
 
-        if(refLen+altLen==2)
-        {
-            newEntry->varType=SNV;
-            this->entries[chr][pos1].emplace_back(pos1,newEntry);
-            continue;
-        }
+    vepFile.Close();
+
+    variants.lineData=lines.data(); variants.Finalize(nThreads);
+
+    //----------------------------------------------------------------
+    //Variants at the same position in identifier order (A repeated identifier means the rows of a variant are not consecutive)
+    //----------------------------------------------------------------
 
-        if(refLen>=altLen)
+    for(auto & endpoints : variants.endpoints)
+    {
+        for(size_t i=0,j,nEndpoints=endpoints.size();i<nEndpoints;i=j)
         {
-            newEntry->varType=DEL;
-            hts_pos_t pos2=pos1+refLen-1;
-            this->entries[chr][pos1].emplace_back(pos2,newEntry);
-            this->entries[chr][pos2].emplace_back(pos1,newEntry);
-            continue;
-        }
+            for(j=i+1;j<nEndpoints && endpoints[j].pos==endpoints[i].pos;j++){} if(j-i==1) continue;
+
+            stable_sort(endpoints.begin()+ptrdiff_t(i),endpoints.begin()+ptrdiff_t(j),[&variants](const VarEndpoint & a,const VarEndpoint & b){return variants.ID(a.var)<variants.ID(b.var);});
 
-        hts_pos_t pos2=newEntry->AssessTandem(pos1,fastaEntries.at(chr).seq+pos1);
-        this->entries[chr][pos1].emplace_back(pos2,newEntry);
-        this->entries[chr][pos2].emplace_back(pos1,newEntry);
+            for(size_t k=i+1;k<j;k++)
+            {
+                const VarEndpoint & a=endpoints[k-1]; const VarEndpoint & b=endpoints[k];
+                if(a.pos<=a.other && b.pos<=b.other && variants.ID(a.var)==variants.ID(b.var)) throw runtime_error(string("Error: Rows of a variant are not consecutive in vep file: ")+filename);
+            }
+        }
     }
 
-    free(line);
+    //----------------------------------------------------------------
+    //Keep results in object
+    //----------------------------------------------------------------
+
+    Clear();
+
+    this->info=info;
+    this->header=header;
+    this->contigNames=fastaFile.names;
+    this->lines.swap(lines);
+    this->variants=move(variants);
+    this->variants.lineData=this->lines.data();
 }
 //----------------------------------------------------------------
-void VEPFile::Write(const vector<string> & bamFilenames)
+void VEPFile::Write(OutputFile & output,const vector<string> & bamFilenames,size_t nThreads)
 {
     //----------------------------------------------------------------
     //Write info lines
     //----------------------------------------------------------------
 
-    for(const auto & line : info) cout << line << '\n';
+    string text; for(const auto & line : info){text+=line; text+='\n';}
 
     //----------------------------------------------------------------
     //Write header
     //----------------------------------------------------------------
 
-    cout << header << "\tvar_type";
-    size_t nBamFiles=bamFilenames.size(); for(size_t i=0;i<nBamFiles;i++) Statistics::PrintHeader(bamFilenames[i]);
-    cout << '\n';
+    text+=header+"\tvar_type";
+    size_t nBamFiles=bamFilenames.size(); for(size_t i=0;i<nBamFiles;i++) Statistics::RenderHeader(bamFilenames[i],text);
+    text+='\n'; output.Write(text);    //Not indexed: the location is a single chr:start-end column tabix cannot read
 
     //----------------------------------------------------------------
     //Write entries
     //----------------------------------------------------------------
 
-    for(const auto & chr : entries)
-    {
-        for(const auto & pos : chr.second)
-        {
-            for(const auto & entry : pos.second)
-            {
-                if(pos.first<=entry.first)
-                {
-                    cout << entry.second->line << '\t' << varStrings[entry.second->varType];
-                    const auto & statistics=entry.second->statistics; for(size_t i=0;i<nBamFiles;i++) statistics[i].PrintEntry();
-                    cout << '\n';
-                }
-            }
-        }
-    }
+    WriteEntries(output,nBamFiles,nThreads);
+}
+//----------------------------------------------------------------
+size_t VEPFile::LinesMemoryUsage(void) const
+{
+    size_t size=lines.capacity(); for(const auto & line : info) size+=sizeof(line)+line.capacity();
+    return size;
 }
 //----------------------------------------------------------------
 
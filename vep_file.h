@@ -2,29 +2,24 @@
 #ifndef VEP_FILE_H
 #define VEP_FILE_H
 //----------------------------------------------------------------
-#include <map>
-#include "fasta_file.h"
-#include "variant_entry.h"
+#include "variant_file.h"
 //----------------------------------------------------------------
-class VEPFile
+class VEPFile : public VariantFile
 {
 private:
 
-    void Clear(void);
+    string lines;   //Collapsed lines (The variant lines point into it)
 
 public:
 
-    vector<string>                                                  info;
-    string                                                          header;
-    map<string,map<hts_pos_t,vector<pair<hts_pos_t,VarEntry*> > > > entries;
+    vector<string> info;
 
     VEPFile(void);
-    VEPFile(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples);
+    VEPFile(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads=1);
 
-    ~VEPFile(void);
-
-    void Open(const string & filename,const map<string,FastaEntry> & fastaEntries,size_t nSamples);
-    void Write(const vector<string> & bamFilenames);
+    void Open(const string & filename,const FastaFile & fastaFile,size_t nSamples,size_t nThreads) override;
+    void Write(OutputFile & output,const vector<string> & bamFilenames,size_t nThreads=1) override;
+    size_t LinesMemoryUsage(void) const override;
 };
 //----------------------------------------------------------------
 #endif // VEP_FILE_H